@@ -2,7 +2,20 @@
 #include "image.h"
 #include "error.h"
 #include "process.h"
+#include "stats.h"
 #include "string.h"
+#include "dirent.h"
+#include "limits.h"
+#include "inttypes.h"
+#include "time.h"
+#include "errno.h"
+#include "signal.h"
+#include "pthread.h"
+#include "stdatomic.h"
+#include "unistd.h"
+#include "sys/socket.h"
+#include "sys/stat.h"
+#include "sys/un.h"
 
 typedef struct {
 	uint8_t red;
@@ -10,6 +23,124 @@ typedef struct {
 	uint8_t blue;
 } Rgb;
 
+// How `--stats` reports the library's counters, if at all
+typedef enum {
+	stats_none = 0,
+	stats_text,
+	stats_json,
+} StatsFormat;
+
+typedef struct {
+	SimdLevel simd;
+	BorderMode border;
+	int threads;
+	int stream;
+	int batch;
+	int huge_pages;
+	int async_io;
+	const char* tune_file;
+	int explain;
+	StatsFormat stats;
+	int counters;
+	const char* serve_socket;
+	const char* client_socket;
+} Options;
+
+// Tuning cache used by `--tune` when no file is given
+#define DEFAULT_TUNE_FILE "bmp_processor.tune"
+
+// Parse leading `--name=value` options, returning the index of the first remaining argument
+int parseOptions(Options* const options, int argc, char* argv[]) {
+	options->simd = simd_auto;
+	options->border = border_mirror;
+	options->threads = 0;
+	options->stream = 0;
+	options->batch = 0;
+	options->huge_pages = 0;
+	options->async_io = 0;
+	options->tune_file = NULL;
+	options->explain = 0;
+	options->stats = stats_none;
+	options->counters = 0;
+	options->serve_socket = NULL;
+	options->client_socket = NULL;
+
+	int i = 1;
+	for (; i < argc && strncmp(argv[i], "--", 2) == 0; ++i) {
+		const char* arg = argv[i];
+		if (strncmp(arg, "--simd=", 7) == 0) {
+			const char* level = arg + 7;
+			if (strcmp(level, "auto") == 0) options->simd = simd_auto;
+			else if (strcmp(level, "scalar") == 0) options->simd = simd_scalar;
+			else if (strcmp(level, "sse4.1") == 0) options->simd = simd_sse41;
+			else if (strcmp(level, "avx2") == 0) options->simd = simd_avx2;
+			else if (strcmp(level, "avx512") == 0) options->simd = simd_avx512;
+			else return -1;
+		} else if (strncmp(arg, "--border=", 9) == 0) {
+			const char* mode = arg + 9;
+			if (strcmp(mode, "mirror") == 0) options->border = border_mirror;
+			else if (strcmp(mode, "clamp") == 0) options->border = border_clamp;
+			else if (strcmp(mode, "zero") == 0) options->border = border_zero;
+			else if (strcmp(mode, "wrap") == 0) options->border = border_wrap;
+			else return -1;
+		} else if (strcmp(arg, "--stream") == 0) {
+			options->stream = 1;
+		} else if (strcmp(arg, "--batch") == 0) {
+			options->batch = 1;
+		} else if (strcmp(arg, "--huge-pages") == 0) {
+			options->huge_pages = 1;
+		} else if (strcmp(arg, "--async-io") == 0) {
+			options->async_io = 1;
+		} else if (strcmp(arg, "--tune") == 0) {
+			options->tune_file = DEFAULT_TUNE_FILE;
+		} else if (strncmp(arg, "--tune=", 7) == 0 && arg[7] != '\0') {
+			options->tune_file = arg + 7;
+		} else if (strcmp(arg, "--explain") == 0) {
+			options->explain = 1;
+		} else if (strcmp(arg, "--stats") == 0 || strcmp(arg, "--stats=text") == 0) {
+			options->stats = stats_text;
+		} else if (strcmp(arg, "--stats=json") == 0) {
+			options->stats = stats_json;
+		} else if (strcmp(arg, "--counters") == 0) {
+			options->counters = 1;
+		} else if (strncmp(arg, "--serve=", 8) == 0 && arg[8] != '\0') {
+			options->serve_socket = arg + 8;
+		} else if (strncmp(arg, "--client=", 9) == 0 && arg[9] != '\0') {
+			options->client_socket = arg + 9;
+		} else if (strncmp(arg, "--threads=", 10) == 0) {
+			char* end;
+			options->threads = strtol(arg + 10, &end, 10);
+			if (*end != '\0' || end == arg + 10) return -1;
+		} else {
+			return -1;
+		}
+	}
+
+	return i;
+}
+
+
+void printUsage(const char* program) {
+	fprintf(stderr, "Usage: %s [options] <image processing command> <BMP input file> <BMP output file>\n", program);
+	fprintf(stderr, "       %s [options] --serve=<socket>\n", program);
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "  --simd=<level>    Limit convolution kernels to auto, scalar, sse4.1, avx2 or avx512\n");
+	fprintf(stderr, "  --border=<mode>   Make up pixels beyond the edges by mirror (default), clamp, zero or wrap\n");
+	fprintf(stderr, "  --threads=<n>     Number of processing threads (default 0: one per CPU)\n");
+	fprintf(stderr, "  --stream          Filter row by row without loading the whole image\n");
+	fprintf(stderr, "  --huge-pages      Back large image and scratch buffers with transparent huge pages\n");
+	fprintf(stderr, "  --async-io        Read and write files on their own threads, overlapping I/O with processing\n");
+	fprintf(stderr, "  --tune[=<file>]   Time the filter methods on first use, keeping the fastest in <file> (default %s)\n", DEFAULT_TUNE_FILE);
+	fprintf(stderr, "  --explain         Print the method chosen for each filter and why\n");
+	fprintf(stderr, "  --stats[=json]    Print time, calls and pixels per stage, bytes, allocations and peak memory to stderr\n");
+	fprintf(stderr, "  --counters        Add CPU cycles, instructions, cache and branch misses and page faults per stage to --stats\n");
+	fprintf(stderr, "  --batch           Input is a directory of BMPs or a file listing one per line; output is a directory\n");
+	fprintf(stderr, "  --serve=<socket>  Run as a server taking jobs on a Unix socket, keeping filters and buffers warm\n");
+	fprintf(stderr, "  --client=<socket> Send the job to a server and print its reply\n");
+	fprintf(stderr, "Commands are scale-rgb:<args>, filter:<file> or box:<radius>, and can be chained with '|', e.g. 'scale-rgb:r=50|filter:lpf5.csv', to run them on one read of the image.\n");
+}
+
+
 // Parse command-line args for colour-scaling
 Error parseRgb(Rgb* const rgb, const char* args) {
 	rgb->red = 100;
@@ -40,38 +171,64 @@ Error parseRgb(Rgb* const rgb, const char* args) {
 }
 
 
-Error processScaleRgbCommand(Image** image, const char* scale_args, const char* input_file) {
+void printScaleMessages(const Rgb* const rgb) {
+	if (rgb->red < 100) printf("Scaling red colour plane to %d%%\n", rgb->red);
+	if (rgb->green < 100) printf("Scaling green colour plane to %d%%\n", rgb->green);
+	if (rgb->blue < 100) printf("Scaling blue colour plane to %d%%\n", rgb->blue);
+}
+
+
+Error processScaleRgbCommand(const char* scale_args, const char* input_file, const char* output_file) {
 	Rgb rgb;
 	Error err_code = parseRgb(&rgb, scale_args);
 	if (err_code != SUCCESS) return err_code;
 
-	// Initialise image
-	err_code = initImage(image);
-	if (err_code != SUCCESS) return err_code;
+	printScaleMessages(&rgb);
 
-	// Read BMP pixel data into Image object
-	err_code = readBmp(*image, input_file, 0, 0);
-	if (err_code != SUCCESS) return err_code;
+	// Scale each line on its way from the input file to the output file
+	return scaleRgbBmp(input_file, output_file, rgb.red, rgb.green, rgb.blue);
+}
 
-	// Process image
-	return scaleRgb(*image, rgb.red, rgb.green, rgb.blue);
+
+// Whether `command` creates a filter: `filter:<file>` or `box:<radius>`
+int isFilterCommand(const char* command) {
+	return strncmp(command, "filter:", 7) == 0 || strncmp(command, "box:", 4) == 0;
 }
 
 
-Error processFilterCommand(Image** image, const char* filter_path, const char* input_file) {
-	Filter* filter;
-	Error err_code = initFilter(&filter);
+// Create a filter from a `filter:<file>` or `box:<radius>` command
+Error loadFilter(Filter** filter, const char* command) {
+	Error err_code = initFilter(filter);
 	if (err_code != SUCCESS) return err_code;
 
-	err_code = parseFilter(filter, filter_path);
+	if (strncmp(command, "filter:", 7) == 0) {
+		err_code = parseFilter(*filter, command + 7);
+	} else if (strncmp(command, "box:", 4) == 0) {
+		char* end;
+		const long radius = strtol(command + 4, &end, 10);
+		if (end == command + 4 || *end != '\0' || radius > INT_MAX / 4) {
+			err_code = INVALID_RADIUS_FORMAT;
+		} else {
+			err_code = initBoxFilter(*filter, (int)radius);
+		}
+	} else {
+		err_code = INVALID_COMMAND;
+	}
+
 	if (err_code != SUCCESS) {
-		freeFilter(filter);
-		return err_code;
+		freeFilter(*filter);
+		free(*filter);
+		*filter = NULL;
 	}
+	return err_code;
+}
+
+
+Error processFilterCommand(Image** image, const char* command, const char* input_file) {
+	Filter* filter;
+	Error err_code = loadFilter(&filter, command);
+	if (err_code != SUCCESS) return err_code;
 
-	int x_border = filter->radius;
-	int y_border = filter->radius;
-		
 	// Initialise image
 	err_code = initImage(image);
 	if (err_code != SUCCESS) {
@@ -79,8 +236,8 @@ Error processFilterCommand(Image** image, const char* filter_path, const char* i
 		return err_code;
 	}
 
-	// Read BMP pixel data into Image object
-	err_code = readBmp(*image, input_file, x_border, y_border);
+	// Read BMP pixel data into Image object, leaving the filter to make up the border
+	err_code = readBmp(*image, input_file, 0, 0);
 	if (err_code != SUCCESS) {
 		freeFilter(filter);
 		return err_code;
@@ -95,44 +252,856 @@ Error processFilterCommand(Image** image, const char* filter_path, const char* i
 }
 
 
-int main(int argc, char* argv[]) {
-	// Handle invalid arguments
-	if (argc != 4) {
-		fprintf(stderr, "Usage: %s <image processing command> <BMP input file> <BMP output file>\n", argv[0]);
-		return -1;
+Error processFilterStreamCommand(const char* command, const char* input_file, const char* output_file) {
+	Filter* filter;
+	Error err_code = loadFilter(&filter, command);
+	if (err_code != SUCCESS) return err_code;
+
+	// Read, process and write the image one block of rows at a time
+	err_code = filterBmp(input_file, output_file, filter);
+
+	freeFilter(filter);
+
+	return err_code;
+}
+
+
+// Parse a single pipeline stage and append it to `pipeline`
+Error parseStage(Pipeline* const pipeline, const char* stage) {
+	if (strncmp(stage, "scale-rgb:", 10) == 0) {
+		Rgb rgb;
+		Error err_code = parseRgb(&rgb, stage + 10);
+		if (err_code != SUCCESS) return err_code;
+
+		printScaleMessages(&rgb);
+		return addScaleStage(pipeline, rgb.red, rgb.green, rgb.blue);
 	}
 
-	// Parse arguments
-	const char* command = argv[1];
-	const char* input_file = argv[2];
-	const char* output_file = argv[3];
+	if (isFilterCommand(stage)) {
+		Filter* filter;
+		Error err_code = loadFilter(&filter, stage);
+		if (err_code != SUCCESS) return err_code;
 
-	// Process image based on command
-	Image* image;
+		// The pipeline owns the filter only once the stage is added
+		err_code = addFilterStage(pipeline, filter);
+		if (err_code != SUCCESS) {
+			freeFilter(filter);
+			free(filter);
+		}
+		return err_code;
+	}
+
+	return INVALID_COMMAND;
+}
+
+
+// Parse commands separated by `|` into a pipeline
+Error parsePipeline(Pipeline* const pipeline, const char* commands) {
+	const size_t length = strlen(commands);
+	char* const stages = (char*)malloc(length + 1);
+	if (stages == NULL) return IO_ERR_ALLOC;
+	memcpy(stages, commands, length + 1);
+
+	Error err_code = SUCCESS;
+	char* stage = stages;
+	while (err_code == SUCCESS) {
+		char* const end = strchr(stage, '|');
+		if (end != NULL) *end = '\0';
+		err_code = parseStage(pipeline, stage);
+		if (end == NULL) break;
+		stage = end + 1;
+	}
+
+	free(stages);
+	return err_code;
+}
+
+
+Error processPipelineCommand(Image** image, const char* commands, const char* input_file) {
+	Pipeline* pipeline;
+	Error err_code = initPipeline(&pipeline);
+	if (err_code != SUCCESS) return err_code;
+
+	err_code = parsePipeline(pipeline, commands);
+	if (err_code != SUCCESS) {
+		freePipeline(pipeline);
+		return err_code;
+	}
+
+	// Read the image once, leaving each filter to make up the border
+	err_code = initImage(image);
+	if (err_code == SUCCESS) err_code = readBmp(*image, input_file, 0, 0);
+
+	// Process image
+	if (err_code == SUCCESS) err_code = applyPipeline(*image, pipeline);
+
+	freePipeline(pipeline);
+
+	return err_code;
+}
+
+
+// Input files of a batch and the paths their results are written to
+typedef struct {
+	int num_files;
+	int capacity;
+	char** in_files;
+	char** out_files;
+} FileList;
+
+
+void freeFileList(FileList* const list) {
+	for (int i = 0; i < list->num_files; ++i) {
+		free(list->in_files[i]);
+		free(list->out_files[i]);
+	}
+	free(list->in_files);
+	free(list->out_files);
+	memset(list, 0, sizeof(FileList));
+}
+
+
+// Add `in_file` to the list, to be written under the same name in `out_dir`
+Error addBatchFile(FileList* const list, const char* in_file, const char* out_dir) {
+	if (list->num_files == list->capacity) {
+		const int capacity = list->capacity ? 2 * list->capacity : 64;
+		char** const in_files = (char**)realloc(list->in_files, capacity * sizeof(char*));
+		if (in_files == NULL) return IO_ERR_ALLOC;
+		list->in_files = in_files;
+		char** const out_files = (char**)realloc(list->out_files, capacity * sizeof(char*));
+		if (out_files == NULL) return IO_ERR_ALLOC;
+		list->out_files = out_files;
+		list->capacity = capacity;
+	}
+
+	const char* const slash = strrchr(in_file, '/');
+	const char* const name = (slash != NULL) ? slash + 1 : in_file;
+	const size_t in_length = strlen(in_file);
+	const size_t dir_length = strlen(out_dir);
+	const size_t name_length = strlen(name);
+
+	char* const in_copy = (char*)malloc(in_length + 1);
+	char* const out_path = (char*)malloc(dir_length + name_length + 2);
+	if (in_copy == NULL || out_path == NULL) {
+		free(in_copy);
+		free(out_path);
+		return IO_ERR_ALLOC;
+	}
+	memcpy(in_copy, in_file, in_length + 1);
+	memcpy(out_path, out_dir, dir_length);
+	out_path[dir_length] = '/';
+	memcpy(out_path + dir_length + 1, name, name_length + 1);
+
+	list->in_files[list->num_files] = in_copy;
+	list->out_files[list->num_files] = out_path;
+	list->num_files++;
+	return SUCCESS;
+}
+
+
+int compareNames(const void* a, const void* b) {
+	return strcmp(*(const char* const*)a, *(const char* const*)b);
+}
+
+
+// List the BMP files in a directory, in name order
+Error listDirectory(FileList* const list, DIR* const dir, const char* dir_path, const char* out_dir) {
+	char** names = NULL;
+	int num_names = 0;
+	Error err_code = SUCCESS;
+
+	struct dirent* entry;
+	while ((entry = readdir(dir)) != NULL && err_code == SUCCESS) {
+		const size_t length = strlen(entry->d_name);
+		if (length < 4 || (strcmp(entry->d_name + length - 4, ".bmp") != 0 && strcmp(entry->d_name + length - 4, ".BMP") != 0)) continue;
+
+		char** const temp = (char**)realloc(names, (num_names + 1) * sizeof(char*));
+		char* const path = (char*)malloc(strlen(dir_path) + length + 2);
+		if (temp != NULL) names = temp;
+		if (temp == NULL || path == NULL) {
+			free(path);
+			err_code = IO_ERR_ALLOC;
+			break;
+		}
+		sprintf(path, "%s/%s", dir_path, entry->d_name);
+		names[num_names++] = path;
+	}
+
+	if (err_code == SUCCESS && num_names > 0) qsort(names, num_names, sizeof(char*), compareNames);
+	for (int i = 0; i < num_names; ++i) {
+		if (err_code == SUCCESS) err_code = addBatchFile(list, names[i], out_dir);
+		free(names[i]);
+	}
+	free(names);
+
+	return err_code;
+}
+
+
+// List the files named in a manifest, one path per line; blank lines and lines starting with `#` are skipped
+Error listManifest(FileList* const list, const char* manifest_path, const char* out_dir) {
+	FILE* const manifest = fopen(manifest_path, "r");
+	if (manifest == NULL) return IO_ERR_NO_FILE;
+
+	Error err_code = SUCCESS;
+	char line[4096];
+	while (err_code == SUCCESS && fgets(line, sizeof(line), manifest) != NULL) {
+		size_t length = strlen(line);
+		while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) line[--length] = '\0';
+		if (length == 0 || line[0] == '#') continue;
+		err_code = addBatchFile(list, line, out_dir);
+	}
+
+	fclose(manifest);
+	return err_code;
+}
+
+
+// Check that no two inputs are written to the same output, as inputs in different directories of a manifest can be
+Error checkOutputNames(const FileList* const list) {
+	if (list->num_files < 2) return SUCCESS;
+	char** const names = (char**)malloc(list->num_files * sizeof(char*));
+	if (names == NULL) return IO_ERR_ALLOC;
+	memcpy(names, list->out_files, list->num_files * sizeof(char*));
+	qsort(names, list->num_files, sizeof(char*), compareNames);
+
+	Error err_code = SUCCESS;
+	for (int i = 1; i < list->num_files && err_code == SUCCESS; ++i) {
+		if (strcmp(names[i - 1], names[i]) != 0) continue;
+		fprintf(stderr, "%s: written by more than one input\n", names[i]);
+		err_code = BATCH_DUPLICATE_NAME;
+	}
+	free(names);
+
+	return err_code;
+}
+
+
+Error processBatchCommand(const char* commands, const char* input, const char* out_dir) {
+	Pipeline* pipeline;
+	Error err_code = initPipeline(&pipeline);
+	if (err_code != SUCCESS) return err_code;
+
+	// Parse the commands once for every file
+	FileList list;
+	memset(&list, 0, sizeof(FileList));
+	err_code = parsePipeline(pipeline, commands);
+
+	// Input is either a directory or a manifest
+	if (err_code == SUCCESS) {
+		DIR* const dir = opendir(input);
+		if (dir != NULL) {
+			err_code = listDirectory(&list, dir, input, out_dir);
+			closedir(dir);
+		} else {
+			err_code = listManifest(&list, input, out_dir);
+		}
+		if (err_code == SUCCESS) err_code = checkOutputNames(&list);
+	}
+
+	Error* results = NULL;
+	if (err_code == SUCCESS && list.num_files > 0) {
+		results = (Error*)malloc(list.num_files * sizeof(Error));
+		if (results == NULL) err_code = IO_ERR_ALLOC;
+	}
+
+	if (err_code == SUCCESS && list.num_files > 0) {
+		err_code = processBatch(pipeline, (const char* const*)list.in_files, (const char* const*)list.out_files,
+			list.num_files, results);
+
+		int num_failed = 0;
+		for (int i = 0; i < list.num_files; ++i) {
+			if (results[i] == SUCCESS) continue;
+			fprintf(stderr, "%s: %s\n", list.in_files[i], getErrorString(results[i]));
+			num_failed++;
+		}
+		printf("Processed %d of %d images.\n", list.num_files - num_failed, list.num_files);
+	}
+
+	free(results);
+	freeFileList(&list);
+	freePipeline(pipeline);
+
+	return err_code;
+}
+
+
+// Print the event counts of each stage that ran, with instructions per cycle and misses per thousand pixels
+void printStatsEvents(const Stats* const stats) {
+	const int has_ipc = (stats->event_mask & (1u << stats_event_cycles)) && (stats->event_mask & (1u << stats_event_instructions));
+	fprintf(stderr, "%-14s", "stage");
+	for (int e = 0; e < STATS_NUM_EVENTS; ++e) {
+		if (stats->event_mask & (1u << e)) fprintf(stderr, " %14s", getStatsEventName((StatsEvent)e));
+	}
+	if (has_ipc) fprintf(stderr, " %6s", "IPC");
+	fprintf(stderr, "\n");
+
+	for (int s = 0; s < STATS_NUM_STAGES; ++s) {
+		if (stats->calls[s] == 0) continue;
+		fprintf(stderr, "%-14s", getStatsStageName((StatsStage)s));
+		for (int e = 0; e < STATS_NUM_EVENTS; ++e) {
+			if (stats->event_mask & (1u << e)) fprintf(stderr, " %14" PRIu64, stats->events[s][e]);
+		}
+		const uint64_t cycles = stats->events[s][stats_event_cycles];
+		if (has_ipc) fprintf(stderr, " %6.2f", (cycles > 0) ? (double)stats->events[s][stats_event_instructions] / cycles : 0.0);
+		fprintf(stderr, "\n");
+	}
+
+	// Misses normalised by the pixels each stage handled, comparable between images of different sizes
+	const StatsEvent misses[] = { stats_event_cache_misses, stats_event_l1d_misses, stats_event_branch_misses };
+	for (int s = 0; s < STATS_NUM_STAGES; ++s) {
+		if (stats->calls[s] == 0 || stats->pixels[s] == 0) continue;
+		int first = 1;
+		for (int m = 0; m < 3; ++m) {
+			if (!(stats->event_mask & (1u << misses[m]))) continue;
+			fprintf(stderr, "%s%s %.2f", first ? "" : ", ", getStatsEventName(misses[m]),
+				1000.0 * stats->events[s][misses[m]] / stats->pixels[s]);
+			if (first) fprintf(stderr, " per 1000 %s pixels", getStatsStageName((StatsStage)s));
+			first = 0;
+		}
+		if (!first) fprintf(stderr, "\n");
+	}
+}
+
+
+// Print the totals collected by the library as one JSON object, without a newline
+void printStatsJson(FILE* const stream, double wall_seconds) {
+	Stats stats;
+	getStats(&stats);
+
+	fprintf(stream, "{\"enabled\": %s, \"wall_seconds\": %.6f, \"stages\": {", stats.enabled ? "true" : "false", wall_seconds);
+	for (int s = 0; s < STATS_NUM_STAGES; ++s) {
+		fprintf(stream, "%s\"%s\": {\"seconds\": %.6f, \"calls\": %" PRIu64 ", \"pixels\": %" PRIu64, (s > 0) ? ", " : "",
+			getStatsStageName((StatsStage)s), stats.seconds[s], stats.calls[s], stats.pixels[s]);
+		for (int e = 0; e < STATS_NUM_EVENTS; ++e) {
+			if (stats.event_mask & (1u << e)) fprintf(stream, ", \"%s\": %" PRIu64, getStatsEventName((StatsEvent)e), stats.events[s][e]);
+		}
+		fprintf(stream, "}");
+	}
+	fprintf(stream, "}, \"bytes_read\": %" PRIu64 ", \"bytes_written\": %" PRIu64 ", \"allocations\": %" PRIu64
+		", \"allocated_bytes\": %" PRIu64 ", \"peak_resident_bytes\": %" PRIu64 "}", stats.bytes_read, stats.bytes_written,
+		stats.allocations, stats.allocated_bytes, stats.peak_resident_bytes);
+}
+
+
+// Print the totals collected by the library once the command has finished, successfully or not
+void printStats(StatsFormat format, double wall_seconds) {
+	if (format == stats_json) {
+		printStatsJson(stderr, wall_seconds);
+		fprintf(stderr, "\n");
+		return;
+	}
+
+	Stats stats;
+	getStats(&stats);
+
+	fprintf(stderr, "Wall time: %.3f s\n", wall_seconds);
+	if (!stats.enabled) {
+		fprintf(stderr, "Stage statistics were not compiled in (BMP_PROCESSOR_STATS is off).\n");
+		return;
+	}
+	fprintf(stderr, "%-14s %10s %10s %14s %10s\n", "stage", "seconds", "calls", "pixels", "Mpixel/s");
+	for (int s = 0; s < STATS_NUM_STAGES; ++s) {
+		if (stats.calls[s] == 0) continue;
+		const double rate = (stats.seconds[s] > 0.0) ? (double)stats.pixels[s] / stats.seconds[s] * 1e-6 : 0.0;
+		fprintf(stderr, "%-14s %10.4f %10" PRIu64 " %14" PRIu64 " %10.1f\n", getStatsStageName((StatsStage)s),
+			stats.seconds[s], stats.calls[s], stats.pixels[s], rate);
+	}
+	if (stats.event_mask != 0) printStatsEvents(&stats);
+	fprintf(stderr, "Bytes read: %" PRIu64 ", written: %" PRIu64 "\n", stats.bytes_read, stats.bytes_written);
+	fprintf(stderr, "Allocations: %" PRIu64 " (%.1f MiB)\n", stats.allocations, (double)stats.allocated_bytes / (1 << 20));
+	fprintf(stderr, "Peak resident: %.1f MiB\n", (double)stats.peak_resident_bytes / (1 << 20));
+}
+
+
+// Run the command once the options are in effect, printing any success messages
+Error runCommand(const Options* const options, const char* command, const char* input_file, const char* output_file) {
+	// Batches write their output files as they go
+	if (options->batch) {
+		return options->stream ? INVALID_COMMAND : processBatchCommand(command, input_file, output_file);
+	}
+
+	// Streamed commands write the output file themselves
+	const int is_pipeline = strchr(command, '|') != NULL;
+	const int is_scale = !is_pipeline && strncmp(command, "scale-rgb:", 10) == 0;
 	Error err_code;
-	if (strncmp(command, "scale-rgb:", 10) == 0) {
-		err_code = processScaleRgbCommand(&image, command + 10, input_file);		
-	} else if (strncmp(command, "filter:", 7) == 0) {
-		err_code = processFilterCommand(&image, command + 7, input_file);
+	if (options->stream || is_scale) {
+		if (is_pipeline) {
+			err_code = INVALID_COMMAND;
+		} else if (is_scale) {
+			err_code = processScaleRgbCommand(command + 10, input_file, output_file);
+		} else if (isFilterCommand(command)) {
+			err_code = processFilterStreamCommand(command, input_file, output_file);
+		} else {
+			err_code = INVALID_COMMAND;
+		}
+
+		if (err_code == SUCCESS) printf("Image processed successfully.\n");
+		return err_code;
+	}
+
+	// Process image based on command
+	Image* image = NULL;
+	if (is_pipeline) {
+		err_code = processPipelineCommand(&image, command, input_file);
+	} else if (isFilterCommand(command)) {
+		err_code = processFilterCommand(&image, command, input_file);
 	} else {
 		err_code = INVALID_COMMAND;
 	}
 
+	// Write BMP from processed Image object
+	if (err_code == SUCCESS) err_code = writeBmp(image, output_file);
+	if (err_code == SUCCESS) printf("Image processed successfully.\n");
+
+	freeImage(image);
+
+	return err_code;
+}
+
+
+// Seconds on the monotonic clock
+double getWallTime(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)now.tv_sec + 1e-9 * (double)now.tv_nsec;
+}
+
+
+// Commands a server keeps parsed, with their plans and buffers, before dropping the least recently used
+#define SERVER_CACHE_SIZE 8
+
+// Longest request a server reads: a command and two paths, separated by tabs
+#define SERVER_MAX_REQUEST (3 * PATH_MAX)
+
+// A command parsed by the server and the runner that keeps its buffers warm
+typedef struct {
+	char* command;
+	Pipeline* pipeline;
+	PipelineRunner* runner;
+	uint64_t last_used;		// Job number of the last use, 0 if the entry is empty
+} ServerEntry;
+
+typedef struct {
+	ServerEntry entries[SERVER_CACHE_SIZE];
+	uint64_t num_jobs;
+} ServerCache;
+
+// A connection, served on its own thread so that a client waiting between requests holds up no other
+typedef struct ServerConnection {
+	struct Server* server;
+	int client;
+	int finished;		// Set under the server's lock before the client socket is closed
+	pthread_t thread;
+	struct ServerConnection* next;
+} ServerConnection;
+
+typedef struct Server {
+	ServerCache cache;
+	pthread_mutex_t job_lock;		// Held while a job runs, as jobs share the cache, the stats and every thread
+	pthread_mutex_t lock;			// Protects the connection list
+	ServerConnection* connections;
+	atomic_int stopping;			// Set once the server stops accepting, so that connections take no more requests
+} Server;
+
+// Set by SIGINT or SIGTERM to stop the server once its current job is done
+static volatile sig_atomic_t server_stopping = 0;
+
+
+void stopServer(int signal_number) {
+	(void)signal_number;
+	server_stopping = 1;
+}
+
+
+void freeServerEntry(ServerEntry* const entry) {
+	freePipelineRunner(entry->runner);
+	if (entry->pipeline != NULL) freePipeline(entry->pipeline);
+	free(entry->command);
+	memset(entry, 0, sizeof(ServerEntry));
+}
+
+
+// Find the runner for `command`, parsing it into the least recently used entry if it is not cached
+Error getServerRunner(ServerCache* const cache, const char* command, PipelineRunner** runner, int* cached) {
+	cache->num_jobs++;
+	ServerEntry* entry = cache->entries;
+	for (int i = 0; i < SERVER_CACHE_SIZE; ++i) {
+		ServerEntry* const candidate = cache->entries + i;
+		if (candidate->last_used != 0 && strcmp(candidate->command, command) == 0) {
+			candidate->last_used = cache->num_jobs;
+			*runner = candidate->runner;
+			*cached = 1;
+			return SUCCESS;
+		}
+		if (candidate->last_used < entry->last_used) entry = candidate;
+	}
+
+	*cached = 0;
+	freeServerEntry(entry);
+	const size_t length = strlen(command);
+	entry->command = (char*)malloc(length + 1);
+	if (entry->command == NULL) return IO_ERR_ALLOC;
+	memcpy(entry->command, command, length + 1);
+
+	Error err_code = initPipeline(&entry->pipeline);
+	if (err_code == SUCCESS) err_code = parsePipeline(entry->pipeline, command);
+	if (err_code == SUCCESS) err_code = initPipelineRunner(&entry->runner, entry->pipeline);
 	if (err_code != SUCCESS) {
-		printErrorString(err_code);
-		freeImage(image);
+		freeServerEntry(entry);
 		return err_code;
 	}
 
-	// Write BMP from processed Image object
-	err_code = writeBmp(image, output_file);
+	entry->last_used = cache->num_jobs;
+	*runner = entry->runner;
+	return SUCCESS;
+}
+
+
+// Run one request, `<command>\t<input file>\t<output file>`, and reply with its status and stage totals
+void serveRequest(ServerCache* const cache, char* request, FILE* const reply) {
+	const double start = getWallTime();
+	resetStats();
+
+	char* const input_file = strchr(request, '\t');
+	char* const output_file = (input_file != NULL) ? strchr(input_file + 1, '\t') : NULL;
+	Error err_code = SERVER_ERR_PROTOCOL;
+	int cached = 0;
+	if (output_file != NULL && strchr(output_file + 1, '\t') == NULL) {
+		*input_file = '\0';
+		*output_file = '\0';
+		PipelineRunner* runner;
+		err_code = getServerRunner(cache, request, &runner, &cached);
+		if (err_code == SUCCESS) err_code = runPipelineFile(runner, input_file + 1, output_file + 1);
+	}
+
+	fprintf(reply, "{\"status\": %d, \"error\": \"%s\", \"cached\": %s, \"stats\": ", (int)err_code, getErrorString(err_code),
+		cached ? "true" : "false");
+	printStatsJson(reply, getWallTime() - start);
+	fprintf(reply, "}\n");
+	fflush(reply);
+}
+
+
+// Serve the requests of one connection, one per line, until the client closes it
+void serveClient(Server* const server, const int client) {
+	FILE* const in = fdopen(client, "r");
+	const int reply_fd = (in != NULL) ? dup(client) : -1;
+	FILE* const reply = (reply_fd >= 0) ? fdopen(reply_fd, "w") : NULL;
+	if (in == NULL || reply == NULL) {
+		if (reply_fd >= 0) close(reply_fd);
+		if (in != NULL) fclose(in);
+		else close(client);
+		return;
+	}
+
+	char* const request = (char*)malloc(SERVER_MAX_REQUEST);
+	while (request != NULL && !atomic_load(&server->stopping) && fgets(request, SERVER_MAX_REQUEST, in) != NULL) {
+		// A line starting with a NUL byte reads as empty, and is answered with an error rather than ignored
+		size_t length = strlen(request);
+		if (length > 0 && request[length - 1] != '\n' && !feof(in)) {
+			// Longer than any request: skip the rest of the line and reply with an error
+			int c;
+			while ((c = fgetc(in)) != EOF && c != '\n') {}
+			request[0] = '\0';
+		} else if (length > 0) {
+			// Blank lines are ignored
+			while (length > 0 && (request[length - 1] == '\n' || request[length - 1] == '\r')) request[--length] = '\0';
+			if (length == 0) continue;
+		}
+		pthread_mutex_lock(&server->job_lock);
+		serveRequest(&server->cache, request, reply);
+		pthread_mutex_unlock(&server->job_lock);
+	}
+
+	free(request);
+	fclose(reply);
+	fclose(in);
+}
+
+
+void* connectionMain(void* arg) {
+	ServerConnection* const connection = (ServerConnection*)arg;
+	Server* const server = connection->server;
+
+	// The socket stays open until the connection is marked finished, so that stopping the server never shuts
+	// down a descriptor that has been closed and reused
+	const int client = dup(connection->client);
+	if (client >= 0) serveClient(server, client);
+
+	pthread_mutex_lock(&server->lock);
+	connection->finished = 1;
+	close(connection->client);
+	pthread_mutex_unlock(&server->lock);
+	return NULL;
+}
+
+
+// Join and free the connections whose clients have gone, or all of them if `all` is set
+void reapConnections(Server* const server, const int all) {
+	pthread_mutex_lock(&server->lock);
+	ServerConnection** link = &server->connections;
+	while (*link != NULL) {
+		ServerConnection* const connection = *link;
+		if (!all && !connection->finished) {
+			link = &connection->next;
+			continue;
+		}
+		*link = connection->next;
+		pthread_mutex_unlock(&server->lock);
+		pthread_join(connection->thread, NULL);
+		free(connection);
+		pthread_mutex_lock(&server->lock);
+	}
+	pthread_mutex_unlock(&server->lock);
+}
+
+
+// Serve `client` on a thread of its own, which SIGINT and SIGTERM are kept from so that they reach accept()
+void startConnection(Server* const server, const int client) {
+	ServerConnection* const connection = (ServerConnection*)calloc(1, sizeof(ServerConnection));
+	if (connection == NULL) {
+		close(client);
+		return;
+	}
+	connection->server = server;
+	connection->client = client;
+
+	sigset_t blocked, previous;
+	sigemptyset(&blocked);
+	sigaddset(&blocked, SIGINT);
+	sigaddset(&blocked, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &blocked, &previous);
+	const int started = pthread_create(&connection->thread, NULL, connectionMain, connection) == 0;
+	pthread_sigmask(SIG_SETMASK, &previous, NULL);
+	if (!started) {
+		close(client);
+		free(connection);
+		return;
+	}
+
+	pthread_mutex_lock(&server->lock);
+	connection->next = server->connections;
+	server->connections = connection;
+	pthread_mutex_unlock(&server->lock);
+}
+
+
+// Listen on `socket_path` and serve jobs until SIGINT or SIGTERM, with a thread per connection
+Error runServer(const char* socket_path) {
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (strlen(socket_path) >= sizeof(address.sun_path)) return SERVER_ERR_SOCKET;
+	strcpy(address.sun_path, socket_path);
+
+	const int server = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (server < 0) return SERVER_ERR_SOCKET;
+
+	// A socket left behind by a server that has stopped is replaced, but a running server is not
+	struct stat info;
+	if (lstat(socket_path, &info) == 0 && S_ISSOCK(info.st_mode)) {
+		const int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+		const int running = probe >= 0 && connect(probe, (const struct sockaddr*)&address, sizeof(address)) == 0;
+		if (probe >= 0) close(probe);
+		if (!running) unlink(socket_path);
+	}
+	if (bind(server, (const struct sockaddr*)&address, sizeof(address)) != 0 || listen(server, SOMAXCONN) != 0) {
+		close(server);
+		return SERVER_ERR_SOCKET;
+	}
+
+	// Signals interrupt accept() rather than restarting it, so that the loop sees them
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = stopServer;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("Serving on %s\n", socket_path);
+	fflush(stdout);
+
+	Server state;
+	memset(&state, 0, sizeof(Server));
+	atomic_init(&state.stopping, 0);
+	pthread_mutex_init(&state.job_lock, NULL);
+	pthread_mutex_init(&state.lock, NULL);
+	Error err_code = SUCCESS;
+	while (!server_stopping) {
+		const int client = accept(server, NULL, NULL);
+		if (client >= 0) {
+			reapConnections(&state, 0);
+			startConnection(&state, client);
+		} else if (errno != EINTR && errno != ECONNABORTED) {
+			err_code = SERVER_ERR_SOCKET;
+			break;
+		}
+	}
+
+	// Wake connections waiting for a request; one running a job still replies to it before it stops
+	atomic_store(&state.stopping, 1);
+	pthread_mutex_lock(&state.lock);
+	for (ServerConnection* connection = state.connections; connection != NULL; connection = connection->next) {
+		if (!connection->finished) shutdown(connection->client, SHUT_RD);
+	}
+	pthread_mutex_unlock(&state.lock);
+	reapConnections(&state, 1);
+
+	for (int i = 0; i < SERVER_CACHE_SIZE; ++i) freeServerEntry(state.cache.entries + i);
+	pthread_mutex_destroy(&state.lock);
+	pthread_mutex_destroy(&state.job_lock);
+	close(server);
+	unlink(socket_path);
+
+	return err_code;
+}
+
+
+// Copy `path` into `buffer`, prefixed with the working directory if it is relative
+Error getAbsolutePath(char* const buffer, const size_t size, const char* path) {
+	if (path[0] == '/') {
+		if (strlen(path) >= size) return IO_ERR_NO_FILE;
+		strcpy(buffer, path);
+		return SUCCESS;
+	}
+
+	if (getcwd(buffer, size) == NULL) return IO_ERR_NO_FILE;
+	const size_t length = strlen(buffer);
+	if (length + strlen(path) + 2 > size) return IO_ERR_NO_FILE;
+	buffer[length] = '/';
+	strcpy(buffer + length + 1, path);
+	return SUCCESS;
+}
+
+
+// Copy `command` into `buffer` with the file of each `filter:<file>` stage made absolute
+Error getAbsoluteCommand(char* const buffer, const size_t size, const char* command) {
+	size_t used = 0;
+	for (;;) {
+		const char* const end = strchr(command, '|');
+		const size_t length = (end != NULL) ? (size_t)(end - command) : strlen(command);
+		char stage[PATH_MAX];
+		if (length >= sizeof(stage)) return INVALID_COMMAND;
+		memcpy(stage, command, length);
+		stage[length] = '\0';
+
+		// Stages are copied as they are apart from the path
+		char path[PATH_MAX];
+		const int is_file = strncmp(stage, "filter:", 7) == 0;
+		if (is_file && getAbsolutePath(path, sizeof(path), stage + 7) != SUCCESS) return INVALID_COMMAND;
+		const int written = snprintf(buffer + used, size - used, "%s%s%s", (used > 0) ? "|" : "", is_file ? "filter:" : stage,
+			is_file ? path : "");
+		if (written < 0 || (size_t)written >= size - used) return INVALID_COMMAND;
+		used += (size_t)written;
+
+		if (end == NULL) return SUCCESS;
+		command = end + 1;
+	}
+}
+
+
+// Send one job to the server at `socket_path`, print its reply and return the job's status
+Error runClient(const char* socket_path, const char* command, const char* input_file, const char* output_file) {
+	if (strpbrk(command, "\t\n") != NULL || strpbrk(input_file, "\t\n") != NULL || strpbrk(output_file, "\t\n") != NULL) {
+		return INVALID_COMMAND;
+	}
+
+	// The server resolves paths from its own working directory
+	char commands[PATH_MAX];
+	char input_path[PATH_MAX];
+	char output_path[PATH_MAX];
+	Error err_code = getAbsoluteCommand(commands, sizeof(commands), command);
+	if (err_code == SUCCESS) err_code = getAbsolutePath(input_path, sizeof(input_path), input_file);
+	if (err_code == SUCCESS) err_code = getAbsolutePath(output_path, sizeof(output_path), output_file);
+	if (err_code != SUCCESS) return err_code;
+
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (strlen(socket_path) >= sizeof(address.sun_path)) return SERVER_ERR_SOCKET;
+	strcpy(address.sun_path, socket_path);
+
+	const int server = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (server < 0) return SERVER_ERR_SOCKET;
+	if (connect(server, (const struct sockaddr*)&address, sizeof(address)) != 0) {
+		close(server);
+		return SERVER_ERR_SOCKET;
+	}
+
+	FILE* const stream = fdopen(server, "r+");
+	if (stream == NULL) {
+		close(server);
+		return SERVER_ERR_SOCKET;
+	}
+
+	// The reply is one line of JSON starting with the job's status
+	char reply[16384];
+	int status = SERVER_ERR_PROTOCOL;
+	fprintf(stream, "%s\t%s\t%s\n", commands, input_path, output_path);
+	if (fflush(stream) == 0 && fgets(reply, sizeof(reply), stream) != NULL && sscanf(reply, "{\"status\": %d", &status) == 1) {
+		fputs(reply, stdout);
+	} else {
+		status = SERVER_ERR_PROTOCOL;
+	}
+	fclose(stream);
+
+	return (Error)status;
+}
+
+int main(int argc, char* argv[]) {
+	// Handle invalid arguments
+	Options options;
+	const int first_arg = parseOptions(&options, argc, argv);
+	const int serving = first_arg >= 0 && options.serve_socket != NULL;
+	if (first_arg < 0 || argc - first_arg != (serving ? 0 : 3) || (serving && (options.batch || options.stream || options.client_socket != NULL))) {
+		printUsage(argv[0]);
+		return -1;
+	}
+
+	// Parse arguments
+	const char* command = serving ? NULL : argv[first_arg];
+	const char* input_file = serving ? NULL : argv[first_arg + 1];
+	const char* output_file = serving ? NULL : argv[first_arg + 2];
+
+	// Clients leave the work, and the settings, to the server
+	if (options.client_socket != NULL) {
+		const Error err_code = runClient(options.client_socket, command, input_file, output_file);
+		if (err_code != SUCCESS) printErrorString(err_code);
+		return err_code;
+	}
+
+	setArenaHugePages(options.huge_pages);
+	setBmpAsyncIo(options.async_io);
+	Error err_code = setSimdLevel(options.simd);
+	if (err_code == SUCCESS) err_code = setBorderMode(options.border);
+	if (err_code == SUCCESS) err_code = setFilterTuning(options.tune_file);
+	setFilterExplain(options.explain);
+	if (options.counters) {
+		if (options.stats == stats_none) options.stats = stats_text;
+		if (setStatsEvents(1) == 0) fprintf(stderr, "CPU event counters are not available (see /proc/sys/kernel/perf_event_paranoid).\n");
+	}
+	if (err_code == SUCCESS) err_code = setNumThreads(options.threads);
 	if (err_code != SUCCESS) {
 		printErrorString(err_code);
+		return err_code;
 	}
 
-	printf("Image processed successfully.\n");
+	// Servers reply with the totals of each job instead
+	if (serving) {
+		err_code = runServer(options.serve_socket);
+		if (err_code != SUCCESS) printErrorString(err_code);
+		return err_code;
+	}
 
-	freeImage(image);
+	const double start = getWallTime();
+	err_code = runCommand(&options, command, input_file, output_file);
+	if (options.stats != stats_none) printStats(options.stats, getWallTime() - start);
+	if (err_code != SUCCESS) {
+		printErrorString(err_code);
+		return err_code;
+	}
 
 	return 0;
-}
\ No newline at end of file
+}
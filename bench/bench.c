@@ -0,0 +1,454 @@
+#include "io_bmp.h"
+#include "image.h"
+#include "error.h"
+#include "process.h"
+#include "interleave.h"
+#include "string.h"
+#include "dirent.h"
+#include "time.h"
+
+// Filters timed when `--filters` is not given
+#ifndef BENCH_FILTER_DIR
+#define BENCH_FILTER_DIR "filters"
+#endif
+
+// Border read around the image for timing `extendBoundary`, as wide as the largest example filter
+#define BENCH_BORDER 4
+
+// Most sizes and bit depths in one run
+#define BENCH_MAX_SIZES 16
+#define BENCH_MAX_DEPTHS 2
+
+// Longest path of a generated image or filter
+#define BENCH_PATH_LENGTH 4096
+
+typedef struct {
+	int num_sizes;
+	int widths[BENCH_MAX_SIZES];
+	int heights[BENCH_MAX_SIZES];
+	int num_depths;
+	int depths[BENCH_MAX_DEPTHS];
+	int runs;
+	int threads;
+	SimdLevel simd;
+	const char* filter_dir;
+	const char* work_dir;
+} Options;
+
+// Filters parsed from the filter directory, in name order
+typedef struct {
+	int num_filters;
+	char** names;
+	Filter** filters;
+} FilterSet;
+
+// Time of each run of a stage, in seconds
+typedef struct {
+	int num_runs;
+	double* seconds;
+} Timings;
+
+
+// Parse a comma-separated list of `<width>x<height>` sizes
+int parseSizes(Options* const options, const char* list) {
+	options->num_sizes = 0;
+	while (*list != '\0') {
+		if (options->num_sizes == BENCH_MAX_SIZES) return -1;
+		char* end;
+		const long width = strtol(list, &end, 10);
+		if (end == list || *end != 'x') return -1;
+		list = end + 1;
+		const long height = strtol(list, &end, 10);
+		if (end == list || (*end != ',' && *end != '\0') || width <= 0 || height <= 0 || width > 65535 || height > 65535) return -1;
+		options->widths[options->num_sizes] = (int)width;
+		options->heights[options->num_sizes] = (int)height;
+		options->num_sizes++;
+		list = (*end == ',') ? end + 1 : end;
+	}
+	return (options->num_sizes > 0) ? 0 : -1;
+}
+
+
+// Parse a comma-separated list of bit depths, each 8 or 24
+int parseDepths(Options* const options, const char* list) {
+	options->num_depths = 0;
+	while (*list != '\0') {
+		char* end;
+		const long depth = strtol(list, &end, 10);
+		if (end == list || (*end != ',' && *end != '\0') || (depth != 8 && depth != 24)) return -1;
+		if (options->num_depths == BENCH_MAX_DEPTHS) return -1;
+		options->depths[options->num_depths++] = (int)depth;
+		list = (*end == ',') ? end + 1 : end;
+	}
+	return (options->num_depths > 0) ? 0 : -1;
+}
+
+
+// Parse `--name=value` options, returning 0 if they are all valid
+int parseOptions(Options* const options, int argc, char* argv[]) {
+	memset(options, 0, sizeof(Options));
+	options->num_sizes = 2;
+	options->widths[0] = 1920;
+	options->heights[0] = 1080;
+	options->widths[1] = 4000;
+	options->heights[1] = 3000;
+	options->num_depths = 2;
+	options->depths[0] = 24;
+	options->depths[1] = 8;
+	options->runs = 10;
+	options->threads = 0;
+	options->simd = simd_auto;
+	options->filter_dir = BENCH_FILTER_DIR;
+	options->work_dir = getenv("TMPDIR");
+	if (options->work_dir == NULL) options->work_dir = "/tmp";
+
+	for (int i = 1; i < argc; ++i) {
+		const char* arg = argv[i];
+		if (strncmp(arg, "--sizes=", 8) == 0) {
+			if (parseSizes(options, arg + 8) != 0) return -1;
+		} else if (strncmp(arg, "--depths=", 9) == 0) {
+			if (parseDepths(options, arg + 9) != 0) return -1;
+		} else if (strncmp(arg, "--runs=", 7) == 0) {
+			char* end;
+			options->runs = strtol(arg + 7, &end, 10);
+			if (*end != '\0' || end == arg + 7 || options->runs < 1) return -1;
+		} else if (strncmp(arg, "--threads=", 10) == 0) {
+			char* end;
+			options->threads = strtol(arg + 10, &end, 10);
+			if (*end != '\0' || end == arg + 10) return -1;
+		} else if (strncmp(arg, "--simd=", 7) == 0) {
+			const char* level = arg + 7;
+			if (strcmp(level, "auto") == 0) options->simd = simd_auto;
+			else if (strcmp(level, "scalar") == 0) options->simd = simd_scalar;
+			else if (strcmp(level, "sse4.1") == 0) options->simd = simd_sse41;
+			else if (strcmp(level, "avx2") == 0) options->simd = simd_avx2;
+			else if (strcmp(level, "avx512") == 0) options->simd = simd_avx512;
+			else return -1;
+		} else if (strncmp(arg, "--filters=", 10) == 0) {
+			options->filter_dir = arg + 10;
+		} else if (strncmp(arg, "--dir=", 6) == 0) {
+			options->work_dir = arg + 6;
+		} else {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+
+void printUsage(const char* program) {
+	fprintf(stderr, "Usage: %s [options]\n", program);
+	fprintf(stderr, "Times each processing stage on synthetic images and prints the results as JSON.\n");
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "  --sizes=<w>x<h>,...  Image sizes (default 1920x1080,4000x3000)\n");
+	fprintf(stderr, "  --depths=<bits>,...  Bit depths, 24 and/or 8 (default 24,8)\n");
+	fprintf(stderr, "  --runs=<n>           Timed runs of each stage, after one untimed run (default 10)\n");
+	fprintf(stderr, "  --threads=<n>        Number of processing threads (default 0: one per CPU)\n");
+	fprintf(stderr, "  --simd=<level>       Limit convolution kernels to auto, scalar, sse4.1, avx2 or avx512\n");
+	fprintf(stderr, "  --filters=<dir>      Directory of filter files to time (default %s)\n", BENCH_FILTER_DIR);
+	fprintf(stderr, "  --dir=<dir>          Directory for the generated images (default $TMPDIR or /tmp)\n");
+}
+
+
+double getSeconds(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+
+// Write a `width` x `height` BMP with `num_components` components of smooth gradients overlaid with noise, so
+// the image is neither constant nor incompressible
+Error writeSyntheticBmp(const char* path, int width, int height, int num_components) {
+	BmpOut bmp_out;
+	Error err_code = bmpOutOpen(&bmp_out, path, width, height, num_components);
+	if (err_code != SUCCESS) return err_code;
+
+	uint32_t seed = 1;
+	for (int r = 0; r < height && err_code == SUCCESS; ++r) {
+		uint8_t* line;
+		err_code = bmpOutGetLineRef(&bmp_out, &line);
+		if (err_code != SUCCESS) break;
+
+		for (int c = 0; c < width; ++c) {
+			for (int p = 0; p < num_components; ++p) {
+				seed = seed * 1664525u + 1013904223u;
+				const int gradient = (c * 255 / width + r * 255 / height + p * 85) / 2;
+				line[c * num_components + p] = (uint8_t)(gradient + (int)(seed >> 28) - 8);
+			}
+		}
+		err_code = bmpOutWriteLine(&bmp_out, line);
+	}
+
+	const Error close_err = bmpOutClose(&bmp_out);
+	return (err_code == SUCCESS) ? close_err : err_code;
+}
+
+
+int compareNames(const void* a, const void* b) {
+	return strcmp(*(const char* const*)a, *(const char* const*)b);
+}
+
+
+void freeFilterSet(FilterSet* const set) {
+	for (int i = 0; i < set->num_filters; ++i) {
+		free(set->names[i]);
+		freeFilter(set->filters[i]);
+		free(set->filters[i]);
+	}
+	free(set->names);
+	free(set->filters);
+	memset(set, 0, sizeof(FilterSet));
+}
+
+
+// Parse every `.csv` filter in `dir_path`, in name order
+Error loadFilterSet(FilterSet* const set, const char* dir_path) {
+	memset(set, 0, sizeof(FilterSet));
+	DIR* const dir = opendir(dir_path);
+	if (dir == NULL) return IO_ERR_NO_FILE;
+
+	Error err_code = SUCCESS;
+	struct dirent* entry;
+	while ((entry = readdir(dir)) != NULL && err_code == SUCCESS) {
+		const size_t length = strlen(entry->d_name);
+		if (length < 4 || strcmp(entry->d_name + length - 4, ".csv") != 0) continue;
+
+		char** const names = (char**)realloc(set->names, (set->num_filters + 1) * sizeof(char*));
+		if (names == NULL) {
+			err_code = IO_ERR_ALLOC;
+			break;
+		}
+		set->names = names;
+		set->names[set->num_filters] = (char*)malloc(length + 1);
+		if (set->names[set->num_filters] == NULL) {
+			err_code = IO_ERR_ALLOC;
+			break;
+		}
+		memcpy(set->names[set->num_filters], entry->d_name, length + 1);
+		set->num_filters++;
+	}
+	closedir(dir);
+	if (err_code != SUCCESS) {
+		freeFilterSet(set);
+		return err_code;
+	}
+
+	qsort(set->names, set->num_filters, sizeof(char*), compareNames);
+	set->filters = (Filter**)calloc(set->num_filters > 0 ? set->num_filters : 1, sizeof(Filter*));
+	if (set->filters == NULL) err_code = IO_ERR_ALLOC;
+	for (int i = 0; i < set->num_filters && err_code == SUCCESS; ++i) {
+		char path[BENCH_PATH_LENGTH];
+		snprintf(path, sizeof(path), "%s/%s", dir_path, set->names[i]);
+		err_code = initFilter(set->filters + i);
+		if (err_code == SUCCESS) err_code = parseFilter(set->filters[i], path);
+		if (err_code == SUCCESS) err_code = decomposeFilter(set->filters[i]);
+
+		// Report filters by name without the extension
+		set->names[i][strlen(set->names[i]) - 4] = '\0';
+	}
+	if (err_code != SUCCESS) freeFilterSet(set);
+
+	return err_code;
+}
+
+
+int compareSeconds(const void* a, const void* b) {
+	const double x = *(const double*)a;
+	const double y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+
+// Returns the `percent` percentile of sorted times by the nearest-rank method
+double getPercentile(const Timings* const timings, int percent) {
+	int rank = (percent * timings->num_runs + 99) / 100;
+	if (rank < 1) rank = 1;
+	return timings->seconds[rank - 1];
+}
+
+
+// Print one result as a JSON object, with throughput taken from the median time
+void printResult(const char* stage, int width, int height, int depth, Timings* const timings, int first) {
+	qsort(timings->seconds, timings->num_runs, sizeof(double), compareSeconds);
+	const double megapixels = (double)width * height * 1e-6;
+	const double median = getPercentile(timings, 50);
+
+	printf("%s\n    {\"stage\": \"%s\", \"width\": %d, \"height\": %d, \"bits\": %d, \"runs\": %d, ",
+		first ? "" : ",", stage, width, height, depth, timings->num_runs);
+	printf("\"ms\": {\"min\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f}, ",
+		timings->seconds[0] * 1e3, median * 1e3, getPercentile(timings, 90) * 1e3, getPercentile(timings, 99) * 1e3,
+		timings->seconds[timings->num_runs - 1] * 1e3);
+	printf("\"mp_per_s\": %.2f}", (median > 0.0) ? megapixels / median : 0.0);
+}
+
+
+// The stages timed on each image, each running one step on the state below
+typedef enum {
+	stage_open,
+	stage_read,
+	stage_deinterleave,
+	stage_extend_boundary,
+	stage_scale_rgb,
+	stage_filter,
+	stage_write
+} Stage;
+
+typedef struct {
+	const char* in_file;
+	const char* out_file;
+	Image* image;				// Image read without a border
+	Image* bordered;			// Image read with BENCH_BORDER on every side
+	const uint8_t** lines;		// Every line of `mapped`, for deinterleaving
+	BmpIn mapped;
+	const Filter* filter;
+} StageState;
+
+
+Error runStage(StageState* const state, Stage stage) {
+	switch (stage) {
+	case stage_open: {
+		BmpIn bmp_in;
+		Error err_code = bmpInOpen(&bmp_in, state->in_file);
+		if (err_code == SUCCESS) bmpInClose(&bmp_in);
+		return err_code;
+	}
+	case stage_read:
+		return readBmp(state->image, state->in_file, 0, 0);
+	case stage_deinterleave: {
+		const ImageComp* const components = state->image->components;
+		for (int r = 0; r < components[0].height; ++r) {
+			uint8_t* planes[BMP_MAX_COMPONENTS];
+			for (int p = 0; p < state->image->num_components; ++p) planes[p] = components[p].image + (size_t)r * components[p].stride;
+			deinterleaveLine(planes, state->lines[r], state->image->num_components, components[0].width);
+		}
+		return SUCCESS;
+	}
+	case stage_extend_boundary:
+		return extendBoundary(state->bordered);
+	case stage_scale_rgb:
+		return scaleRgb(state->image, 90, 95, 100);
+	case stage_filter:
+		return applyFilter(state->image, state->filter);
+	case stage_write:
+		return writeBmp(state->image, state->out_file);
+	}
+	return INVALID_COMMAND;
+}
+
+
+// Time `runs` runs of a stage after an untimed one that warms the caches and buffers
+Error timeStage(Timings* const timings, StageState* const state, Stage stage, int runs) {
+	Error err_code = runStage(state, stage);
+	timings->num_runs = 0;
+	for (int i = 0; i < runs && err_code == SUCCESS; ++i) {
+		const double start = getSeconds();
+		err_code = runStage(state, stage);
+		timings->seconds[timings->num_runs++] = getSeconds() - start;
+	}
+	return err_code;
+}
+
+
+// Generate an image and time every stage on it, printing a result for each
+Error benchImage(const Options* const options, const FilterSet* const filters, int width, int height, int depth,
+	Timings* const timings, int* const first) {
+	char in_file[BENCH_PATH_LENGTH];
+	char out_file[BENCH_PATH_LENGTH];
+	snprintf(in_file, sizeof(in_file), "%s/bmp_bench_%dx%d_%d.bmp", options->work_dir, width, height, depth);
+	snprintf(out_file, sizeof(out_file), "%s/bmp_bench_%dx%d_%d_out.bmp", options->work_dir, width, height, depth);
+
+	StageState state;
+	memset(&state, 0, sizeof(StageState));
+	state.in_file = in_file;
+	state.out_file = out_file;
+	Error err_code = writeSyntheticBmp(in_file, width, height, depth / 8);
+	if (err_code == SUCCESS) err_code = initImage(&state.image);
+	if (err_code == SUCCESS) err_code = initImage(&state.bordered);
+	if (err_code == SUCCESS) err_code = readBmp(state.image, in_file, 0, 0);
+	if (err_code == SUCCESS) err_code = readBmp(state.bordered, in_file, BENCH_BORDER, BENCH_BORDER);
+
+	// Keep the input mapped, with a pointer to each line, so deinterleaving is timed on its own
+	int mapped = 0;
+	if (err_code == SUCCESS) err_code = bmpInOpen(&state.mapped, in_file);
+	if (err_code == SUCCESS) {
+		mapped = 1;
+		state.lines = (const uint8_t**)malloc(height * sizeof(uint8_t*));
+		if (state.lines == NULL) err_code = IO_ERR_ALLOC;
+	}
+	for (int r = 0; r < height && err_code == SUCCESS; ++r) err_code = bmpInGetLineRef(&state.mapped, state.lines + r);
+
+	const Stage stages[] = { stage_open, stage_read, stage_deinterleave, stage_extend_boundary, stage_scale_rgb, stage_write };
+	const char* const names[] = { "open", "read", "deinterleave", "extend_boundary", "scale_rgb", "write" };
+	for (size_t i = 0; i < sizeof(stages) / sizeof(stages[0]) && err_code == SUCCESS; ++i) {
+		if (stages[i] == stage_scale_rgb && depth != 24) continue;
+		err_code = timeStage(timings, &state, stages[i], options->runs);
+		if (err_code == SUCCESS) printResult(names[i], width, height, depth, timings, *first);
+		*first = 0;
+	}
+
+	for (int f = 0; f < filters->num_filters && err_code == SUCCESS; ++f) {
+		char name[BENCH_PATH_LENGTH];
+		snprintf(name, sizeof(name), "filter:%s", filters->names[f]);
+		state.filter = filters->filters[f];
+		err_code = timeStage(timings, &state, stage_filter, options->runs);
+		if (err_code == SUCCESS) printResult(name, width, height, depth, timings, *first);
+	}
+
+	if (mapped) bmpInClose(&state.mapped);
+	free(state.lines);
+	freeImage(state.image);
+	freeImage(state.bordered);
+	free(state.image);
+	free(state.bordered);
+	remove(in_file);
+	remove(out_file);
+
+	return err_code;
+}
+
+
+int main(int argc, char* argv[]) {
+	Options options;
+	if (parseOptions(&options, argc, argv) != 0) {
+		printUsage(argv[0]);
+		return -1;
+	}
+
+	Error err_code = setSimdLevel(options.simd);
+	if (err_code == SUCCESS) err_code = setNumThreads(options.threads);
+
+	FilterSet filters;
+	memset(&filters, 0, sizeof(FilterSet));
+	if (err_code == SUCCESS) err_code = loadFilterSet(&filters, options.filter_dir);
+
+	Timings timings;
+	timings.seconds = (double*)malloc(options.runs * sizeof(double));
+	if (timings.seconds == NULL && err_code == SUCCESS) err_code = IO_ERR_ALLOC;
+	if (err_code != SUCCESS) {
+		printErrorString(err_code);
+		freeFilterSet(&filters);
+		free(timings.seconds);
+		return err_code;
+	}
+
+	printf("{\n  \"simd\": \"%s\",\n  \"threads\": %d,\n  \"runs\": %d,\n  \"results\": [", getSimdName(),
+		getNumThreads(), options.runs);
+	int first = 1;
+	for (int s = 0; s < options.num_sizes && err_code == SUCCESS; ++s) {
+		for (int d = 0; d < options.num_depths && err_code == SUCCESS; ++d) {
+			err_code = benchImage(&options, &filters, options.widths[s], options.heights[s], options.depths[d], &timings, &first);
+		}
+	}
+	printf("\n  ]\n}\n");
+
+	freeFilterSet(&filters);
+	free(timings.seconds);
+	if (err_code != SUCCESS) {
+		printErrorString(err_code);
+		return err_code;
+	}
+
+	return 0;
+}
@@ -0,0 +1,51 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "stddef.h"
+#include "stdint.h"
+#include "error.h"
+
+// Alignment of every allocation from an arena, matching the cache line size
+#define ARENA_ALIGNMENT 64
+
+// A single block of memory handed out by bumping an offset. Allocations are not freed individually:
+// temporaries are released back to a mark, and the whole arena is reset or freed at once.
+typedef struct {
+	uint8_t* base;
+	size_t capacity;
+	size_t used;
+} Arena;
+
+// Rounds `size` up to the arena alignment, for working out the capacity a set of allocations needs
+static inline size_t arenaAlignSize(const size_t size) {
+	return (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+}
+
+// Allocates an arena able to hold `capacity` bytes (an empty arena if 0)
+Error initArena(Arena* const arena, size_t capacity);
+
+// Frees the block of an arena, leaving it empty
+void freeArena(Arena* const arena);
+
+// Returns `size` bytes aligned to ARENA_ALIGNMENT, or NULL if the arena has no room
+void* arenaAlloc(Arena* const arena, size_t size);
+
+// Returns a mark to which later allocations can be released with `arenaRelease`
+static inline size_t arenaMark(const Arena* const arena) {
+	return arena->used;
+}
+
+// Releases every allocation made since `mark` was taken
+static inline void arenaRelease(Arena* const arena, const size_t mark) {
+	arena->used = mark;
+}
+
+// Releases every allocation, keeping the block for reuse
+static inline void resetArena(Arena* const arena) {
+	arena->used = 0;
+}
+
+// Backs arenas of at least one huge page with transparent huge pages where the system supports them
+void setArenaHugePages(int enabled);
+
+#endif // ARENA_H
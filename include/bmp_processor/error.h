@@ -23,6 +23,13 @@ typedef enum {
 	INVALID_RADIUS_FORMAT,		// Invalid radius format
 	NEGATIVE_RADIUS,			// Negative radius
 	BORDER_TOO_LARGE,			// Border too large
+	INVALID_THREAD_COUNT,		// Negative thread count
+	THREAD_ERR_CREATE,			// Worker thread could not be started
+	NULL_PIPELINE,				// Pipeline is null
+	UNSUPPORTED_BORDER_MODE,	// Border mode cannot be used by the operation
+	SERVER_ERR_SOCKET,			// Server socket cannot be created, bound or connected to
+	SERVER_ERR_PROTOCOL,		// Request or reply does not follow the server protocol
+	BATCH_DUPLICATE_NAME,		// Two batch inputs would be written to the same output file
 } Error;
 
 // Error printing functions
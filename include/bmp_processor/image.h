@@ -3,6 +3,7 @@
 
 #include "stdint.h"
 #include "error.h"
+#include "arena.h"
 
 // A colour plane component containing values for a single colour channel
 typedef struct {
@@ -10,14 +11,27 @@ typedef struct {
 	int x_border;
 	int height;
 	int y_border;
-	uint8_t* image;	// First pixel of image data
-	uint8_t* data;	// Start of total data (source pixels + extra pixels for processing)
+	int stride;		// Bytes from one row to the next, a multiple of 64
+	uint8_t* image;	// First pixel of image data, aligned to 64 bytes
+	uint8_t* data;	// Start of total data (source pixels + extra pixels for processing, then padding)
 } ImageComp;
 
+// Alignment of component rows, matching the cache line size
+#define IMAGE_ROW_ALIGNMENT 64
+
+// How pixels beyond the edges of a component are made up when filtering
+typedef enum {
+	border_mirror = 0,	// Reflect across the edge, repeating the edge pixel, so row -1 is row 0
+	border_clamp = 1,	// Repeat the edge pixel
+	border_zero = 2,	// Zero
+	border_wrap = 3		// Continue from the opposite edge
+} BorderMode;
+
 // An image containing multiple colour plane components
 typedef struct {
 	int num_components;
 	ImageComp* components;
+	Arena arena;	// One block holding `components` and the data of each, 64-byte aligned
 } Image;
 
 // Allocates memory for an Image object
@@ -26,12 +40,64 @@ Error initImage(Image** image);
 // Frees all memory used by an Image object
 void freeImage(Image* const image);
 
-// Reads data from a bmp file into an Image object
+// Sets the size of a component and the padded layout of its data, returning the bytes of data it needs.
+// Each row starts with enough padding for the left border to end on an aligned boundary.
+size_t layoutImageComp(ImageComp* const component, int width, int height, int x_border, int y_border);
+
+// Points a component laid out by `layoutImageComp` at `data`, which must be aligned to IMAGE_ROW_ALIGNMENT
+void placeImageComp(ImageComp* const component, uint8_t* const data);
+
+// Returns the bytes of data a component laid out by `layoutImageComp` needs
+static inline size_t getImageCompSize(const ImageComp* const component) {
+	return (size_t)component->stride * (component->height + 2 * component->y_border);
+}
+
+// Allocates components of the given size for an image in a single block, keeping the current ones if they
+// already have that size
+Error allocImage(Image* const image, int num_components, int width, int height, int x_border, int y_border);
+
+// Reads data from a bmp file into an Image object, reusing its buffers if it already holds an image of the same size
 Error readBmp(Image* const image, const char* const in_file, int x_border, int y_border);
 
-// Extends the image boundary by reflecting pixel values across each edge
+// Sets how borders are made up by extendBoundary() and by filters applied to components without a border
+Error setBorderMode(BorderMode mode);
+
+// Returns the border mode set by setBorderMode(), border_mirror by default
+BorderMode getBorderMode(void);
+
+// Maps position `i` of a row or column extended beyond its `n` pixels onto the pixel it repeats under `mode`,
+// or returns -1 if it is zero or there are no pixels to repeat. Positions any distance outside are mapped, so
+// borders may exceed the image.
+static inline int getBorderIndex(int i, const int n, const BorderMode mode) {
+	if (i >= 0 && i < n) return i;
+	if (n <= 0) return -1;
+	switch (mode) {
+	case border_clamp:
+		return (i < 0) ? 0 : n - 1;
+	case border_zero:
+		return -1;
+	case border_wrap:
+		i %= n;
+		return (i < 0) ? i + n : i;
+	default:
+		i %= 2 * n;
+		if (i < 0) i += 2 * n;
+		return (i < n) ? i : 2 * n - 1 - i;
+	}
+}
+
+// Returns the value at column `x` of a `width` pixel row extended under `mode`
+static inline uint8_t getBorderSample(const uint8_t* const row, const int x, const int width, const BorderMode mode) {
+	const int i = getBorderIndex(x, width, mode);
+	return (i < 0) ? 0 : row[i];
+}
+
+// Extends the image boundary by the border mode, reflecting pixel values across each edge by default
 Error extendBoundary(Image* const image);
 
+// Extends the boundary of a single colour component by the border mode
+Error extendBoundaryComp(ImageComp* const component);
+
 // Writes data from an Image object to a bmp file
 Error writeBmp(const Image* const image, const char* const out_file);
 
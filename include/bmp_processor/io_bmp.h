@@ -11,6 +11,12 @@ static const int BITS_IN_BYTE = 8;
 static const size_t BMP_FILE_HEADER_SIZE = 14;
 static const size_t BMP_INFO_HEADER_SIZE = 40;
 static const int BMP_TOTAL_HEADER_SIZE = 54;
+#define BMP_MAX_COMPONENTS 3 // Most colour components in a supported file
+static const size_t BMP_OUT_BUFFER_SIZE = 4 << 20; // Largest chunk written to an output file at once
+static const size_t BMP_ASYNC_CHUNK_SIZE = 1 << 20; // Largest chunk moved by a reader or writer thread at once
+#define BMP_ASYNC_CHUNKS 4 // Chunks a reader or writer thread can run ahead or behind by
+
+struct IoRing;
 
 typedef struct InfoHeader {
 	uint32_t size; // Size of this structure: must be 40
@@ -41,12 +47,28 @@ typedef struct BmpIn {
 	int line_bytes; // Number of bytes in each line, excluding padding
 	int alignment_bytes; // Bytes at end of each line to make a multiple of 4.
 	FILE* in;
+	const uint8_t* map; // Whole file mapped into memory, or NULL if lines are read through `in'
+	size_t map_size;
+	const uint8_t* next_line; // Next unread line within `map'
+	uint8_t* buffer; // Line returned by `bmpInGetLineRef()' when the file is not mapped
+	struct IoRing* ring; // Reader thread filling chunks of whole lines ahead, or NULL
+	const uint8_t* chunk; // Unread part of the chunk taken from `ring'
+	size_t chunk_left;
+	long data_offset; // File offset of the first line
+	int regular; // Whether the input is a regular file, which `bmpInReadRows()' needs
 } BmpIn;
 
 int bmpInOpen(BmpIn* const bmp_in, const char* const fname);
 /*  Opens the image file with the indicated name, initializing the supplied
 	bmp_in structure to hold working state information for subsequent use
 	with `bmpInClose()' and `bmpInGetLine()'.
+	Regular files are memory-mapped once the header has been checked, so
+	that lines can be accessed in place with `bmpInGetLineRef()'; pipes and
+	other inputs which cannot be mapped are read through stdio instead.
+	With `setBmpAsyncIo()' on, a reader thread reads the file instead,
+	filling chunks of whole lines ahead of the caller.
+	A width of 0 or less, or a negative height, is a header error, so
+	callers can size buffers from `cols' and `rows' without checking.
 	If an error occurs, the function returns one of the error codes
 	`IO_ERR_NO_FILE', `IO_ERR_FILE_HEADER', `IO_ERR_FILE_TRUNC' or
 	`IO_ERR_UNSUPPORTED'. Otherwise, the function returns 0 for success. */
@@ -63,6 +85,24 @@ int bmpInGetLine(BmpIn* const bmp_in, uint8_t* const line);
 	file is not currently open, or the end has been reached, the
 	`IO_ERR_FILE_NOT_OPEN' error code is returned. */
 
+int bmpInGetLineRef(BmpIn* const bmp_in, const uint8_t** const line);
+/*  As for `bmpInGetLine()', but instead of copying the next line, sets
+	`line' to point at it. For a mapped file the pointer addresses the
+	mapping directly; otherwise it addresses a buffer owned by `bmp_in'.
+	Either way it remains valid only until the next call with the same
+	`bmp_in' structure, or until `bmpInClose()' is called. */
+
+int bmpInReadRows(const BmpIn* const bmp_in, const int first_row, const int num_rows, uint8_t* const buffer);
+/*  Reads `num_rows' lines, starting `first_row' lines into the file, into
+	`buffer' together with their padding, so that lines are `line_bytes' +
+	`alignment_bytes' apart. The lines are read with pread() at offsets
+	worked out from the header, which neither uses nor moves the position
+	of `bmpInGetLine()', so several threads may read different rows of the
+	same bmp_in at once.
+	Returns 0 if successful, `IO_ERR_UNSUPPORTED' if the input is not a
+	regular file (a pipe, say) or the system lacks pread(), or
+	`IO_ERR_FILE_TRUNC' if the file ends before the last of the lines. */
+
 typedef struct BmpOut {
 	int num_components;
 	int32_t rows;
@@ -70,7 +110,14 @@ typedef struct BmpOut {
 	int num_unwritten_rows;
 	int line_bytes; // Number of bytes in each line, not including padding
 	int alignment_bytes; // Number of 0's at end of each line.
-	FILE* out;
+	FILE* out; // Unbuffered, since `buffer' collects the output
+	uint8_t* buffer; // Header and padded lines waiting to be written
+	size_t buffer_size;
+	size_t buffer_used;
+	uint8_t* reserved_line; // Space handed out by `bmpOutGetLineRef()' for the next line, or NULL
+	struct IoRing* ring; // Writer thread draining filled buffers, which it owns, or NULL
+	long data_offset; // File offset of the first line
+	int regular; // Whether the output is a regular file, which `bmpOutWriteRows()' needs
 } BmpOut;
 
 int bmpOutOpen(BmpOut* const bmp_out, const char* const fname, const int width, const int height, const int num_components);
@@ -79,20 +126,63 @@ int bmpOutOpen(BmpOut* const bmp_out, const char* const fname, const int width,
 	subsequent use with `bmpOutClose()' and `bmpOutWriteLine()'.
 	The `num_components' value should be 1 for a monochrome image and 3
 	for a colour image.
+	The header, palette and padded lines are collected in a page-aligned
+	buffer of up to `BMP_OUT_BUFFER_SIZE' bytes, which is written with a
+	single call whenever it fills. On Linux the whole file is preallocated
+	up front, since its size is known from the header. With
+	`setBmpAsyncIo()' on, filled buffers of up to `BMP_ASYNC_CHUNK_SIZE'
+	bytes are handed to a writer thread instead, and the caller carries
+	on in the next free one.
 	The function returns 0 if successful, `IO_ERR_NO_FILE' if the file
-	cannot be opened, or else `IO_ERR_SUPPORTED' if an illegal combination
-	of parameters is supplied. */
+	cannot be opened, `IO_ERR_ALLOC' if the buffer cannot be allocated,
+	or else `IO_ERR_SUPPORTED' if an illegal combination of parameters is
+	supplied. */
 
-void bmpOutClose(BmpOut* const bmp_out);
+int bmpOutClose(BmpOut* const bmp_out);
+/*  Writes out anything still buffered, closes the file and frees the
+	buffers. Returns 0 if successful or `IO_ERR_FILE_TRUNC' if the
+	buffered bytes, such as the header of a file written with
+	`bmpOutWriteRows()', could not be written. */
 
 int bmpOutWriteLine(BmpOut* const bmp_out, const uint8_t* const line);
 /*  Writes the next line of image data to the file opened using the most
 	recent successful call to `bmpOutOpen' (with the same bmp_out
 	structure), writing the samples supplied via the `line' buffer.
 	ImageComps should be interleaved in BGR order within the `line' buffer.
+	Writing the last line flushes the output buffer, waiting for a writer
+	thread if there is one, so its result covers the whole file.
 	If successful, the function returns 0.  If the file cannot be written
 	(e.g., the disk may be full), the `IO_ERR_FILE_TRUNC' error code is
 	returned.  If the file is not currently open, or the end has been
 	reached, the `IO_ERR_FILE_NOT_OPEN' error code is returned. */
 
+int bmpOutGetLineRef(BmpOut* const bmp_out, uint8_t** const line);
+/*  Sets `line' to point at space for the next line within the output
+	buffer, so that it can be produced in place rather than copied. The
+	line is committed by passing the same pointer to `bmpOutWriteLine()',
+	which then only adds the padding; the pointer is invalidated by that
+	call and by `bmpOutClose()'.
+	Returns 0 if successful, `IO_ERR_FILE_TRUNC' if buffered output could
+	not be written to make room, or `IO_ERR_FILE_NOT_OPEN' if the file is
+	not open or all of its lines have been written. */
+
+int bmpOutWriteRows(const BmpOut* const bmp_out, const int first_row, const int num_rows, const uint8_t* const buffer);
+/*  The counterpart of `bmpInReadRows()': writes `num_rows' padded lines
+	from `buffer' at the place of line `first_row' in the file, with
+	pwrite(), so that several threads may write different rows at once.
+	The header is still written by `bmpOutClose()', whose result must be
+	checked. Files written this way must not also be given lines with
+	`bmpOutWriteLine()'.
+	Returns 0 if successful, `IO_ERR_FILE_TRUNC' if the file cannot be
+	written, or `IO_ERR_UNSUPPORTED' if the output is not a regular file
+	(a pipe, say) or the system lacks pwrite(). */
+
+void setBmpAsyncIo(int enabled);
+/*  Turns reader and writer threads on or off for files opened from then
+	on, so that file I/O overlaps the caller's processing of lines. Each
+	thread moves chunks of up to `BMP_ASYNC_CHUNK_SIZE' bytes through
+	`BMP_ASYNC_CHUNKS' buffers, so the caller waits only when a thread is
+	that far behind or ahead. Input read this way is copied rather than
+	mapped. If a thread cannot be started, the file is accessed directly. */
+
 #endif // IO_BMP_H
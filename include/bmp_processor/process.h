@@ -9,17 +9,51 @@ typedef enum {
 	colour_red = 2
 } Colour;
 
+// Instruction sets available to the convolution engine, in increasing order of width
+typedef enum {
+	simd_auto = 0,
+	simd_scalar = 1,
+	simd_sse41 = 2,
+	simd_avx2 = 3,
+	simd_avx512 = 4
+} SimdLevel;
+
 typedef struct {
 	int radius;
-	float* data;
+	float* data;	// Taps row by row, or NULL for a box filter, which needs only `box`
+	int rank;	// Number of separable terms used in place of `data` (0 if applied densely)
+	float* col;	// `rank` vertical factors of length 2 * radius + 1, laid out term by term
+	float* row;	// `rank` horizontal factors of length 2 * radius + 1, laid out term by term
+	float box;	// Value of every tap if they are all equal, so the filter can be applied by running sums (0 otherwise)
 } Filter;
 
+// One step of a Pipeline: a filter, or a point operation given as a table for each colour
+typedef struct {
+	Filter* filter;			// Filter applied by this stage, or NULL for a point operation
+	uint8_t luts[3][256];	// Output value for each input value of a point operation, in BGR order
+} PipelineStage;
+
+// A sequence of operations applied to an image held in memory
+typedef struct {
+	int num_stages;
+	PipelineStage* stages;
+} Pipeline;
+
+// Maximum reconstruction error of a separable decomposition, relative to the largest tap
+#define FILTER_SEPARABLE_TOLERANCE 1e-5
+
+// Largest filter diameter for which a separable decomposition is attempted
+#define FILTER_SEPARABLE_MAX_DIAMETER 255
+
 // Scales (multiplies) each pixel value of each colour component by its respective scaling factor
 Error scaleRgb(Image* const image, uint8_t scale_red, uint8_t scale_green, uint8_t scale_blue);
 
 // Scales (multiplies) each pixel value of a single colour component by `scale`
 Error scaleImageComp(Image* const image, const Colour colour, uint8_t scale);
 
+// Scales each colour component of a bmp file as for `scaleRgb`, mapping lines straight from the input to the output
+Error scaleRgbBmp(const char* const in_file, const char* const out_file, uint8_t scale_red, uint8_t scale_green, uint8_t scale_blue);
+
 // Allocates memory for a Filter object
 Error initFilter(Filter** filter);
 
@@ -29,11 +63,80 @@ void freeFilter(Filter* const filter);
 // Parses a filter from a file
 Error parseFilter(Filter* const filter, const char* const filepath);
 
-// Applies a filter to an image
+// Sets an empty filter to a (2 * radius + 1) x (2 * radius + 1) averaging kernel, kept as its radius and tap
+// alone so that any radius fits in memory
+Error initBoxFilter(Filter* const filter, int radius);
+
+// Decomposes a filter into a sum of separable terms when that needs fewer taps than the dense kernel
+Error decomposeFilter(Filter* const filter);
+
+// Limits the convolution kernels to at most `level` (simd_auto picks the best the CPU supports)
+Error setSimdLevel(SimdLevel level);
+
+// Returns the name of the convolution kernels in use
+const char* getSimdName(void);
+
+// Times the methods that suit each filter the first time it is used on a size of image, keeping the fastest in
+// `cache_file` for later runs to read back. Costs are estimated instead if `cache_file` is NULL, the default.
+Error setFilterTuning(const char* cache_file);
+
+// Prints the method chosen for each filter, and why, as it is prepared
+void setFilterExplain(int enabled);
+
+// Sets the number of threads used to process each image (0 uses one per online CPU, 1 disables worker threads)
+Error setNumThreads(int num_threads);
+
+// Returns the number of threads used to process each image
+int getNumThreads(void);
+
+// Applies a filter to an image, making up any border narrower than the filter radius by the border mode
 Error applyFilter(Image* const image, const Filter* const filter);
 
 // Applies a filter to a single colour component
 Error applyFilterComp(ImageComp* const image_comp, const Filter* const filter);
 
+// Allocates memory for an empty Pipeline object
+Error initPipeline(Pipeline** pipeline);
+
+// Frees memory used by a Pipeline object, including the filters of its stages
+void freePipeline(Pipeline* const pipeline);
+
+// Appends a stage scaling each colour component as for `scaleRgb`
+Error addScaleStage(Pipeline* const pipeline, uint8_t scale_red, uint8_t scale_green, uint8_t scale_blue);
+
+// Appends a stage applying `filter`, which is freed along with the pipeline
+Error addFilterStage(Pipeline* const pipeline, Filter* const filter);
+
+// Returns the largest filter radius in a pipeline. Images with this border are filtered from it throughout;
+// narrower borders are made up near the edges while filtering.
+int getPipelineRadius(const Pipeline* const pipeline);
+
+// Applies each stage of a pipeline to an image in turn, fusing point operations into the preceding filter
+Error applyPipeline(Image* const image, const Pipeline* const pipeline);
+
+// Applies a pipeline to each input file, writing the result to the matching output file. Files are spread
+// over the threads set by `setNumThreads`, each file processed by one thread that reuses its image and
+// filter buffers from one file to the next. The error for each file is stored in `results`, and the first
+// failure in file order is returned.
+Error processBatch(const Pipeline* const pipeline, const char* const* in_files, const char* const* out_files,
+	const int num_files, Error* const results);
+
+// Plans, image and buffers for applying one pipeline to files one after another, kept from one file to
+// the next so that files of a size already seen are processed without allocating or planning again
+typedef struct PipelineRunner PipelineRunner;
+
+// Creates a runner for `pipeline`, which must outlive it
+Error initPipelineRunner(PipelineRunner** runner, const Pipeline* const pipeline);
+
+// Frees a runner and everything it kept, but not its pipeline
+void freePipelineRunner(PipelineRunner* const runner);
+
+// Reads `in_file`, applies the runner's pipeline using every thread set by `setNumThreads` and writes the
+// result to `out_file`. Plans are made again only when the image size changes.
+Error runPipelineFile(PipelineRunner* const runner, const char* const in_file, const char* const out_file);
+
+// Applies a filter to a bmp file row by row, holding only a window of rows around the current block in memory
+Error filterBmp(const char* const in_file, const char* const out_file, const Filter* const filter);
+
 
 #endif // PROCESS_H
\ No newline at end of file
@@ -0,0 +1,68 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "stdint.h"
+
+// Stages of the library whose time is measured. Each stage covers only its own work, so nested
+// calls are never counted twice, and times are summed over all threads.
+typedef enum {
+	stats_stage_read = 0,		// Opening, reading and closing input files
+	stats_stage_deinterleave,	// Splitting interleaved lines into component planes
+	stats_stage_extend,			// Extending component borders
+	stats_stage_filter,			// Convolution, including borders made up while filtering
+	stats_stage_scale,			// Lookup tables applied by scaling stages
+	stats_stage_interleave,		// Merging component planes into interleaved lines
+	stats_stage_write,			// Opening, writing and closing output files
+} StatsStage;
+
+#define STATS_NUM_STAGES 7
+
+// Events counted for each stage once `setStatsEvents()' has turned them on, in user space only
+typedef enum {
+	stats_event_cycles = 0,
+	stats_event_instructions,
+	stats_event_cache_misses,	// Last-level cache misses
+	stats_event_l1d_misses,		// Level 1 data cache read misses
+	stats_event_branch_misses,
+	stats_event_page_faults,
+} StatsEvent;
+
+#define STATS_NUM_EVENTS 6
+
+// Totals collected since the program started or `resetStats()' was last called
+typedef struct {
+	int enabled;					// 0 if the library was built without BMP_PROCESSOR_STATS, leaving everything else 0
+	double seconds[STATS_NUM_STAGES];
+	uint64_t calls[STATS_NUM_STAGES];
+	uint64_t pixels[STATS_NUM_STAGES];	// Pixels handled by each stage, per component plane where planes are separate
+	uint64_t bytes_read;			// From input files, including headers and line padding
+	uint64_t bytes_written;			// To output files, including headers and line padding
+	uint64_t allocations;			// Arenas and file buffers allocated, which hold image, scratch and file data
+	uint64_t allocated_bytes;		// Total size of those buffers
+	uint64_t peak_resident_bytes;	// Highest resident set size of the process, or 0 where unknown
+	uint32_t event_mask;			// Bit `1 << e' set for each StatsEvent `e' being counted
+	uint64_t events[STATS_NUM_STAGES][STATS_NUM_EVENTS];
+} Stats;
+
+// Fills `stats' with the current totals
+void getStats(Stats* const stats);
+
+// Sets every total back to 0, apart from the peak resident size, which the system tracks
+void resetStats(void);
+
+// Returns a short name for `stage', used in reports, or "unknown" if it is out of range
+const char* getStatsStageName(StatsStage stage);
+
+/*  Turns per-stage event counting on or off, returning the mask of events
+	now being counted. Counters come from Linux perf events, opened for each
+	thread when it first enters a stage; events the system refuses (without
+	permission, under a hypervisor hiding the PMU, or on other systems) are
+	left out, and if none can be counted this returns 0 and nothing else
+	changes. Each probe then costs a system call, so per-line stages run
+	measurably slower while counting. */
+uint32_t setStatsEvents(int enabled);
+
+// Returns a short name for `event', used in reports, or "unknown" if it is out of range
+const char* getStatsEventName(StatsEvent event);
+
+#endif // STATS_H
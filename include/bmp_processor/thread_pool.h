@@ -0,0 +1,27 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include "error.h"
+
+// A pool of worker threads that run batches of independent tasks
+typedef struct ThreadPool ThreadPool;
+
+// Runs task number `task`; `worker` identifies the executing thread, from 0 to the pool size - 1
+typedef void (*TaskFunc)(void* context, int task, int worker);
+
+// Starts a pool of `num_threads` threads including the caller (0 uses one per online CPU)
+Error initThreadPool(ThreadPool** pool, int num_threads);
+
+// Stops the workers and frees the pool
+void freeThreadPool(ThreadPool* const pool);
+
+// Returns the number of threads that run tasks, including the calling thread
+int getThreadPoolSize(const ThreadPool* const pool);
+
+// Runs tasks 0 to `num_tasks` - 1 and returns once all have finished.
+// Each thread starts on its own contiguous share of the tasks and steals from the others once its share
+// is exhausted. If `pool` is NULL or already running tasks for another caller, the tasks run on the
+// calling thread as worker 0.
+void runThreadPool(ThreadPool* const pool, int num_tasks, TaskFunc func, void* context);
+
+#endif // THREAD_POOL_H
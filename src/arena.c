@@ -0,0 +1,63 @@
+#ifdef __linux__
+#define _GNU_SOURCE // For MADV_HUGEPAGE
+#include "sys/mman.h"
+#endif
+
+#include "stdlib.h"
+#include "string.h"
+#include "arena.h"
+#include "stats_hooks.h"
+
+// Size and alignment of a transparent huge page
+#define ARENA_HUGE_PAGE_SIZE ((size_t)2 << 20)
+
+static int use_huge_pages = 0;
+
+
+void setArenaHugePages(int enabled) {
+	use_huge_pages = enabled;
+}
+
+
+Error initArena(Arena* const arena, size_t capacity) {
+	memset(arena, 0, sizeof(Arena));
+	if (capacity == 0) return SUCCESS;
+
+	size_t alignment = ARENA_ALIGNMENT;
+	capacity = arenaAlignSize(capacity);
+#ifdef MADV_HUGEPAGE
+	if (use_huge_pages && capacity >= ARENA_HUGE_PAGE_SIZE) {
+		alignment = ARENA_HUGE_PAGE_SIZE;
+		capacity = (capacity + ARENA_HUGE_PAGE_SIZE - 1) & ~(ARENA_HUGE_PAGE_SIZE - 1);
+	}
+#endif
+
+	arena->base = (uint8_t*)aligned_alloc(alignment, capacity);
+	if (arena->base == NULL) return IO_ERR_ALLOC;
+	arena->capacity = capacity;
+	STATS_COUNT(stats_allocations, 1);
+	STATS_COUNT(stats_allocated_bytes, capacity);
+
+#ifdef MADV_HUGEPAGE
+	// Only a hint: the block is still usable if the kernel declines
+	if (alignment == ARENA_HUGE_PAGE_SIZE) madvise(arena->base, capacity, MADV_HUGEPAGE);
+#endif
+
+	return SUCCESS;
+}
+
+
+void freeArena(Arena* const arena) {
+	free(arena->base);
+	memset(arena, 0, sizeof(Arena));
+}
+
+
+void* arenaAlloc(Arena* const arena, size_t size) {
+	size = arenaAlignSize(size);
+	if (size > arena->capacity - arena->used) return NULL;
+
+	void* const block = arena->base + arena->used;
+	arena->used += size;
+	return block;
+}
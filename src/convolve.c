@@ -0,0 +1,146 @@
+#include "convolve.h"
+#include "stdatomic.h"
+
+
+// Dense kernel body for a radius fixed at compile time by its callers, so the tap loops unroll fully
+static inline __attribute__((always_inline)) void denseRowFixedScalar(uint8_t* dst, const uint8_t* src, ptrdiff_t stride,
+	const float* taps, const int radius, int width) {
+	const int diameter = 2 * radius + 1;
+	for (int c = 0; c < width; ++c) {
+		const uint8_t* const corner = src + c - radius * stride - radius;
+		float sum = 0;
+#pragma GCC unroll 9
+		for (int y = 0; y < diameter; ++y) {
+#pragma GCC unroll 9
+			for (int x = 0; x < diameter; ++x) {
+				sum += (float)corner[y * stride + x] * taps[y * diameter + x];
+			}
+		}
+		dst[c] = clampToByte(sum);
+	}
+}
+
+
+static void denseRowScalar(uint8_t* dst, const uint8_t* src, ptrdiff_t stride, const float* taps, int radius, int width) {
+	switch (radius) {
+		case 1: denseRowFixedScalar(dst, src, stride, taps, 1, width); return;
+		case 2: denseRowFixedScalar(dst, src, stride, taps, 2, width); return;
+		case 4: denseRowFixedScalar(dst, src, stride, taps, 4, width); return;
+		default: break;
+	}
+
+	const int diameter = 2 * radius + 1;
+	for (int c = 0; c < width; ++c) {
+		const uint8_t* const centre = src + c;
+		float sum = 0;
+		for (int y = -radius; y <= radius; ++y) {
+			const uint8_t* const row = centre + y * stride;
+			const float* const row_taps = taps + (y + radius) * diameter + radius;
+			for (int x = -radius; x <= radius; ++x) {
+				sum += (float)row[x] * row_taps[x];
+			}
+		}
+		dst[c] = clampToByte(sum);
+	}
+}
+
+
+static void horizRowScalar(float* dst, const uint8_t* src, const float* taps, int radius, int width) {
+	const float* const centre_tap = taps + radius;
+	for (int c = 0; c < width; ++c) {
+		float sum = 0;
+		for (int x = -radius; x <= radius; ++x) {
+			sum += (float)src[c + x] * centre_tap[x];
+		}
+		dst[c] = sum;
+	}
+}
+
+
+static void vertRowScalar(float* dst, const float* const* rows, const float* taps, int diameter, int width, int accumulate) {
+	for (int c = 0; c < width; ++c) {
+		float sum = 0;
+		for (int y = 0; y < diameter; ++y) {
+			sum += rows[y][c] * taps[y];
+		}
+		dst[c] = accumulate ? dst[c] + sum : sum;
+	}
+}
+
+
+static void storeRowScalar(uint8_t* dst, const float* src, int width) {
+	for (int c = 0; c < width; ++c) dst[c] = clampToByte(src[c]);
+}
+
+
+static void sparseRowScalar(uint8_t* dst, const uint8_t* src, const ptrdiff_t* offsets, const float* taps, int num_taps, int width) {
+	for (int c = 0; c < width; ++c) {
+		const uint8_t* const centre = src + c;
+		float sum = 0;
+		for (int t = 0; t < num_taps; ++t) {
+			sum += (float)centre[offsets[t]] * taps[t];
+		}
+		dst[c] = clampToByte(sum);
+	}
+}
+
+
+const ConvKernels conv_kernels_scalar = {
+	simd_scalar,
+	"scalar",
+	denseRowScalar,
+	horizRowScalar,
+	vertRowScalar,
+	storeRowScalar,
+	sparseRowScalar
+};
+
+
+static SimdLevel simd_limit = simd_auto;
+// Chosen on first use unless set first, possibly by several threads at once, so it is atomic
+static _Atomic(const ConvKernels*) selected_kernels = NULL;
+
+
+static const ConvKernels* selectConvKernels(const SimdLevel limit) {
+#ifdef CONV_HAVE_X86
+	__builtin_cpu_init();
+	const SimdLevel max_level = (limit == simd_auto) ? simd_avx512 : limit;
+	if (max_level >= simd_avx512 && __builtin_cpu_supports("avx512f")) return &conv_kernels_avx512;
+	if (max_level >= simd_avx2 && __builtin_cpu_supports("avx2")) return &conv_kernels_avx2;
+	if (max_level >= simd_sse41 && __builtin_cpu_supports("sse4.1")) return &conv_kernels_sse41;
+#else
+	(void)limit;
+#endif
+	return &conv_kernels_scalar;
+}
+
+
+const ConvKernels* getConvKernels(void) {
+	const ConvKernels* kernels = atomic_load_explicit(&selected_kernels, memory_order_acquire);
+	if (kernels != NULL) return kernels;
+
+	// Threads selecting at once choose the same kernels; a concurrent setSimdLevel() takes precedence
+	const ConvKernels* expected = NULL;
+	kernels = selectConvKernels(simd_limit);
+	if (!atomic_compare_exchange_strong_explicit(&selected_kernels, &expected, kernels, memory_order_acq_rel,
+		memory_order_acquire)) kernels = expected;
+	return kernels;
+}
+
+
+Error setSimdLevel(SimdLevel level) {
+	if (level < simd_auto || level > simd_avx512) return INVALID_COMMAND;
+	simd_limit = level;
+	atomic_store_explicit(&selected_kernels, selectConvKernels(level), memory_order_release);
+	return SUCCESS;
+}
+
+
+SimdLevel getSimdLimit(void) {
+	return simd_limit;
+}
+
+
+const char* getSimdName(void) {
+	return getConvKernels()->name;
+}
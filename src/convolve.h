@@ -0,0 +1,59 @@
+#ifndef CONVOLVE_H
+#define CONVOLVE_H
+
+#include "stddef.h"
+#include "stdint.h"
+#include "process.h"
+
+/*  Row kernels used by the convolution engine. All taps are in correlation
+	order, i.e. the tap for offset `x' is `taps[x + radius]', so a filter
+	read from a file must be reversed before it is passed in. Source row
+	pointers address the sample aligned with the first output pixel and must
+	be readable `radius' samples either side of the row.
+	Every implementation accumulates the products for a pixel in the same
+	order with separately rounded multiplies and adds, so all kernel sets
+	produce bit-identical results. */
+typedef struct ConvKernels {
+	SimdLevel level;
+	const char* name;
+
+	// Dense 2D convolution of one row: `taps' is a (2r+1) x (2r+1) matrix, rows of `src' are `stride' apart
+	void (*dense_row)(uint8_t* dst, const uint8_t* src, ptrdiff_t stride, const float* taps, int radius, int width);
+
+	// Horizontal 1D pass of one row into floats
+	void (*horiz_row)(float* dst, const uint8_t* src, const float* taps, int radius, int width);
+
+	// Vertical 1D pass over `diameter' float rows; adds to `dst' instead of overwriting it if `accumulate'
+	void (*vert_row)(float* dst, const float* const* rows, const float* taps, int diameter, int width, int accumulate);
+
+	// Converts a row of floats to pixels, saturating to the 8-bit range
+	void (*store_row)(uint8_t* dst, const float* src, int width);
+
+	// 2D convolution of one row by `num_taps' taps at byte `offsets' from each source pixel
+	void (*sparse_row)(uint8_t* dst, const uint8_t* src, const ptrdiff_t* offsets, const float* taps, int num_taps, int width);
+} ConvKernels;
+
+// Returns the kernel set selected for this CPU, limited by `setSimdLevel()'
+const ConvKernels* getConvKernels(void);
+
+// Returns the limit last passed to `setSimdLevel()', for other vectorised code to respect
+SimdLevel getSimdLimit(void);
+
+// Portable kernels, also used for the tails of rows by the vector kernels
+extern const ConvKernels conv_kernels_scalar;
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define CONV_HAVE_X86 1
+extern const ConvKernels conv_kernels_sse41;
+extern const ConvKernels conv_kernels_avx2;
+extern const ConvKernels conv_kernels_avx512;
+#endif
+
+// Converts a filtered value to a pixel, saturating values outside the 8-bit range
+static inline uint8_t clampToByte(const float value) {
+	if (!(value > 0.0f)) return 0;
+	if (value >= 255.0f) return 255;
+	return (uint8_t)value;
+}
+
+#endif // CONVOLVE_H
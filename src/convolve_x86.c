@@ -0,0 +1,191 @@
+#include "convolve.h"
+
+#ifdef CONV_HAVE_X86
+
+#include "string.h"
+#include "immintrin.h"
+
+
+// SSE4.1: 4 pixels per vector
+
+__attribute__((target("sse4.1")))
+static inline __m128 loadU8Sse41(const uint8_t* p) {
+	int32_t bytes;
+	memcpy(&bytes, p, sizeof(bytes));
+	return _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(bytes)));
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128i toIntSse41(__m128 v) {
+	return _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), _mm_set1_ps(255.0f)));
+}
+
+__attribute__((target("sse4.1")))
+static inline void storeU8Sse41(uint8_t* p, __m128 v) {
+	const __m128i words = _mm_packus_epi32(toIntSse41(v), _mm_setzero_si128());
+	const int32_t bytes = _mm_cvtsi128_si32(_mm_packus_epi16(words, words));
+	memcpy(p, &bytes, sizeof(bytes));
+}
+
+__attribute__((target("sse4.1")))
+static inline void storeU8x4Sse41(uint8_t* p, __m128 a, __m128 b, __m128 c, __m128 d) {
+	const __m128i ab = _mm_packus_epi32(toIntSse41(a), toIntSse41(b));
+	const __m128i cd = _mm_packus_epi32(toIntSse41(c), toIntSse41(d));
+	_mm_storeu_si128((__m128i*)p, _mm_packus_epi16(ab, cd));
+}
+
+#define KERNEL_TARGET __attribute__((target("sse4.1")))
+#define KERNEL_NAME(name) name##Sse41
+#define KERNEL_TABLE conv_kernels_sse41
+#define KERNEL_LEVEL simd_sse41
+#define KERNEL_LABEL "sse4.1"
+#define LANES 4
+#define VecF __m128
+#define vecZero() _mm_setzero_ps()
+#define vecSet1(v) _mm_set1_ps(v)
+#define vecAdd(a, b) _mm_add_ps(a, b)
+#define vecMul(a, b) _mm_mul_ps(a, b)
+#define vecLoadF(p) _mm_loadu_ps(p)
+#define vecStoreF(p, v) _mm_storeu_ps(p, v)
+#define vecLoadU8(p) loadU8Sse41(p)
+#define vecStoreU8(p, v) storeU8Sse41(p, v)
+#define vecStoreU8x4(p, a, b, c, d) storeU8x4Sse41(p, a, b, c, d)
+#include "convolve_x86_impl.h"
+#undef KERNEL_TARGET
+#undef KERNEL_NAME
+#undef KERNEL_TABLE
+#undef KERNEL_LEVEL
+#undef KERNEL_LABEL
+#undef LANES
+#undef VecF
+#undef vecZero
+#undef vecSet1
+#undef vecAdd
+#undef vecMul
+#undef vecLoadF
+#undef vecStoreF
+#undef vecLoadU8
+#undef vecStoreU8
+#undef vecStoreU8x4
+
+
+// AVX2: 8 pixels per vector
+
+__attribute__((target("avx2")))
+static inline __m256 loadU8Avx2(const uint8_t* p) {
+	return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)p)));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i toIntAvx2(__m256 v) {
+	return _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(v, _mm256_setzero_ps()), _mm256_set1_ps(255.0f)));
+}
+
+__attribute__((target("avx2")))
+static inline void storeU8Avx2(uint8_t* p, __m256 v) {
+	const __m256i ints = toIntAvx2(v);
+	const __m128i words = _mm_packus_epi32(_mm256_castsi256_si128(ints), _mm256_extracti128_si256(ints, 1));
+	_mm_storel_epi64((__m128i*)p, _mm_packus_epi16(words, words));
+}
+
+__attribute__((target("avx2")))
+static inline void storeU8x4Avx2(uint8_t* p, __m256 a, __m256 b, __m256 c, __m256 d) {
+	// Packing works within 128-bit lanes, so restore the pixel order with a final permute
+	const __m256i ab = _mm256_packus_epi32(toIntAvx2(a), toIntAvx2(b));
+	const __m256i cd = _mm256_packus_epi32(toIntAvx2(c), toIntAvx2(d));
+	const __m256i bytes = _mm256_packus_epi16(ab, cd);
+	const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+	_mm256_storeu_si256((__m256i*)p, _mm256_permutevar8x32_epi32(bytes, order));
+}
+
+#define KERNEL_TARGET __attribute__((target("avx2")))
+#define KERNEL_NAME(name) name##Avx2
+#define KERNEL_TABLE conv_kernels_avx2
+#define KERNEL_LEVEL simd_avx2
+#define KERNEL_LABEL "avx2"
+#define LANES 8
+#define VecF __m256
+#define vecZero() _mm256_setzero_ps()
+#define vecSet1(v) _mm256_set1_ps(v)
+#define vecAdd(a, b) _mm256_add_ps(a, b)
+#define vecMul(a, b) _mm256_mul_ps(a, b)
+#define vecLoadF(p) _mm256_loadu_ps(p)
+#define vecStoreF(p, v) _mm256_storeu_ps(p, v)
+#define vecLoadU8(p) loadU8Avx2(p)
+#define vecStoreU8(p, v) storeU8Avx2(p, v)
+#define vecStoreU8x4(p, a, b, c, d) storeU8x4Avx2(p, a, b, c, d)
+#include "convolve_x86_impl.h"
+#undef KERNEL_TARGET
+#undef KERNEL_NAME
+#undef KERNEL_TABLE
+#undef KERNEL_LEVEL
+#undef KERNEL_LABEL
+#undef LANES
+#undef VecF
+#undef vecZero
+#undef vecSet1
+#undef vecAdd
+#undef vecMul
+#undef vecLoadF
+#undef vecStoreF
+#undef vecLoadU8
+#undef vecStoreU8
+#undef vecStoreU8x4
+
+
+// AVX-512: 16 pixels per vector
+
+__attribute__((target("avx512f")))
+static inline __m512 loadU8Avx512(const uint8_t* p) {
+	return _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*)p)));
+}
+
+__attribute__((target("avx512f")))
+static inline void storeU8Avx512(uint8_t* p, __m512 v) {
+	const __m512 clamped = _mm512_min_ps(_mm512_max_ps(v, _mm512_setzero_ps()), _mm512_set1_ps(255.0f));
+	_mm_storeu_si128((__m128i*)p, _mm512_cvtepi32_epi8(_mm512_cvttps_epi32(clamped)));
+}
+
+__attribute__((target("avx512f")))
+static inline void storeU8x4Avx512(uint8_t* p, __m512 a, __m512 b, __m512 c, __m512 d) {
+	storeU8Avx512(p, a);
+	storeU8Avx512(p + 16, b);
+	storeU8Avx512(p + 32, c);
+	storeU8Avx512(p + 48, d);
+}
+
+#define KERNEL_TARGET __attribute__((target("avx512f")))
+#define KERNEL_NAME(name) name##Avx512
+#define KERNEL_TABLE conv_kernels_avx512
+#define KERNEL_LEVEL simd_avx512
+#define KERNEL_LABEL "avx512"
+#define LANES 16
+#define VecF __m512
+#define vecZero() _mm512_setzero_ps()
+#define vecSet1(v) _mm512_set1_ps(v)
+#define vecAdd(a, b) _mm512_add_ps(a, b)
+#define vecMul(a, b) _mm512_mul_ps(a, b)
+#define vecLoadF(p) _mm512_loadu_ps(p)
+#define vecStoreF(p, v) _mm512_storeu_ps(p, v)
+#define vecLoadU8(p) loadU8Avx512(p)
+#define vecStoreU8(p, v) storeU8Avx512(p, v)
+#define vecStoreU8x4(p, a, b, c, d) storeU8x4Avx512(p, a, b, c, d)
+#include "convolve_x86_impl.h"
+#undef KERNEL_TARGET
+#undef KERNEL_NAME
+#undef KERNEL_TABLE
+#undef KERNEL_LEVEL
+#undef KERNEL_LABEL
+#undef LANES
+#undef VecF
+#undef vecZero
+#undef vecSet1
+#undef vecAdd
+#undef vecMul
+#undef vecLoadF
+#undef vecStoreF
+#undef vecLoadU8
+#undef vecStoreU8
+#undef vecStoreU8x4
+
+#endif // CONV_HAVE_X86
@@ -0,0 +1,231 @@
+/*  Vector row kernels, instantiated once per instruction set by
+	`convolve_x86.c'. The including file defines:
+	KERNEL_TARGET, KERNEL_NAME(name), KERNEL_TABLE, KERNEL_LEVEL,
+	KERNEL_LABEL, LANES, VecF and the vec* primitives.
+	Each main loop keeps four accumulators (4 * LANES output pixels) in
+	registers, followed by a single-vector loop and the scalar kernel for
+	the remaining pixels. Dense rows of radius 1, 2 and 4 use fully
+	unrolled kernels, with the generic loops for other radii. Products
+	are accumulated in the same order as the scalar kernels so the
+	results are bit-identical. */
+
+/*  Dense kernel body for a radius that the wrappers below fix at compile
+	time. The loop along each tap row then unrolls fully with constant
+	offsets, and the row pointers are computed once per tap row. Unrolling
+	the rows as well spills the broadcast taps, which is slower. */
+KERNEL_TARGET
+static inline __attribute__((always_inline)) void KERNEL_NAME(denseRowFixed)(uint8_t* dst, const uint8_t* src, ptrdiff_t stride,
+	const float* taps, const int radius, int width) {
+	const int diameter = 2 * radius + 1;
+	int c = 0;
+	for (; c + 4 * LANES <= width; c += 4 * LANES) {
+		VecF sum0 = vecZero(), sum1 = vecZero(), sum2 = vecZero(), sum3 = vecZero();
+		for (int y = 0; y < diameter; ++y) {
+			const uint8_t* const row = src + (y - radius) * stride + c - radius;
+			const float* const row_taps = taps + y * diameter;
+#pragma GCC unroll 9
+			for (int x = 0; x < diameter; ++x) {
+				const VecF tap = vecSet1(row_taps[x]);
+				sum0 = vecAdd(sum0, vecMul(vecLoadU8(row + x), tap));
+				sum1 = vecAdd(sum1, vecMul(vecLoadU8(row + x + LANES), tap));
+				sum2 = vecAdd(sum2, vecMul(vecLoadU8(row + x + 2 * LANES), tap));
+				sum3 = vecAdd(sum3, vecMul(vecLoadU8(row + x + 3 * LANES), tap));
+			}
+		}
+		vecStoreU8x4(dst + c, sum0, sum1, sum2, sum3);
+	}
+	for (; c + LANES <= width; c += LANES) {
+		VecF sum = vecZero();
+		for (int y = 0; y < diameter; ++y) {
+			const uint8_t* const row = src + (y - radius) * stride + c - radius;
+			const float* const row_taps = taps + y * diameter;
+#pragma GCC unroll 9
+			for (int x = 0; x < diameter; ++x) {
+				sum = vecAdd(sum, vecMul(vecLoadU8(row + x), vecSet1(row_taps[x])));
+			}
+		}
+		vecStoreU8(dst + c, sum);
+	}
+	conv_kernels_scalar.dense_row(dst + c, src + c, stride, taps, radius, width - c);
+}
+
+
+KERNEL_TARGET
+static void KERNEL_NAME(denseRowR1)(uint8_t* dst, const uint8_t* src, ptrdiff_t stride, const float* taps, int width) {
+	KERNEL_NAME(denseRowFixed)(dst, src, stride, taps, 1, width);
+}
+
+
+KERNEL_TARGET
+static void KERNEL_NAME(denseRowR2)(uint8_t* dst, const uint8_t* src, ptrdiff_t stride, const float* taps, int width) {
+	KERNEL_NAME(denseRowFixed)(dst, src, stride, taps, 2, width);
+}
+
+
+KERNEL_TARGET
+static void KERNEL_NAME(denseRowR4)(uint8_t* dst, const uint8_t* src, ptrdiff_t stride, const float* taps, int width) {
+	KERNEL_NAME(denseRowFixed)(dst, src, stride, taps, 4, width);
+}
+
+
+KERNEL_TARGET
+static void KERNEL_NAME(denseRow)(uint8_t* dst, const uint8_t* src, ptrdiff_t stride, const float* taps, int radius, int width) {
+	switch (radius) {
+		case 1: KERNEL_NAME(denseRowR1)(dst, src, stride, taps, width); return;
+		case 2: KERNEL_NAME(denseRowR2)(dst, src, stride, taps, width); return;
+		case 4: KERNEL_NAME(denseRowR4)(dst, src, stride, taps, width); return;
+		default: break;
+	}
+
+	const int diameter = 2 * radius + 1;
+	int c = 0;
+	for (; c + 4 * LANES <= width; c += 4 * LANES) {
+		VecF sum0 = vecZero(), sum1 = vecZero(), sum2 = vecZero(), sum3 = vecZero();
+		for (int y = -radius; y <= radius; ++y) {
+			const uint8_t* const row = src + y * stride + c;
+			const float* const row_taps = taps + (y + radius) * diameter + radius;
+			for (int x = -radius; x <= radius; ++x) {
+				const VecF tap = vecSet1(row_taps[x]);
+				sum0 = vecAdd(sum0, vecMul(vecLoadU8(row + x), tap));
+				sum1 = vecAdd(sum1, vecMul(vecLoadU8(row + x + LANES), tap));
+				sum2 = vecAdd(sum2, vecMul(vecLoadU8(row + x + 2 * LANES), tap));
+				sum3 = vecAdd(sum3, vecMul(vecLoadU8(row + x + 3 * LANES), tap));
+			}
+		}
+		vecStoreU8x4(dst + c, sum0, sum1, sum2, sum3);
+	}
+	for (; c + LANES <= width; c += LANES) {
+		VecF sum = vecZero();
+		for (int y = -radius; y <= radius; ++y) {
+			const uint8_t* const row = src + y * stride + c;
+			const float* const row_taps = taps + (y + radius) * diameter + radius;
+			for (int x = -radius; x <= radius; ++x) {
+				sum = vecAdd(sum, vecMul(vecLoadU8(row + x), vecSet1(row_taps[x])));
+			}
+		}
+		vecStoreU8(dst + c, sum);
+	}
+	conv_kernels_scalar.dense_row(dst + c, src + c, stride, taps, radius, width - c);
+}
+
+
+KERNEL_TARGET
+static void KERNEL_NAME(horizRow)(float* dst, const uint8_t* src, const float* taps, int radius, int width) {
+	const float* const centre_tap = taps + radius;
+	int c = 0;
+	for (; c + 4 * LANES <= width; c += 4 * LANES) {
+		VecF sum0 = vecZero(), sum1 = vecZero(), sum2 = vecZero(), sum3 = vecZero();
+		for (int x = -radius; x <= radius; ++x) {
+			const uint8_t* const row = src + c + x;
+			const VecF tap = vecSet1(centre_tap[x]);
+			sum0 = vecAdd(sum0, vecMul(vecLoadU8(row), tap));
+			sum1 = vecAdd(sum1, vecMul(vecLoadU8(row + LANES), tap));
+			sum2 = vecAdd(sum2, vecMul(vecLoadU8(row + 2 * LANES), tap));
+			sum3 = vecAdd(sum3, vecMul(vecLoadU8(row + 3 * LANES), tap));
+		}
+		vecStoreF(dst + c, sum0);
+		vecStoreF(dst + c + LANES, sum1);
+		vecStoreF(dst + c + 2 * LANES, sum2);
+		vecStoreF(dst + c + 3 * LANES, sum3);
+	}
+	for (; c + LANES <= width; c += LANES) {
+		VecF sum = vecZero();
+		for (int x = -radius; x <= radius; ++x) {
+			sum = vecAdd(sum, vecMul(vecLoadU8(src + c + x), vecSet1(centre_tap[x])));
+		}
+		vecStoreF(dst + c, sum);
+	}
+	conv_kernels_scalar.horiz_row(dst + c, src + c, taps, radius, width - c);
+}
+
+
+KERNEL_TARGET
+static void KERNEL_NAME(vertRow)(float* dst, const float* const* rows, const float* taps, int diameter, int width, int accumulate) {
+	int c = 0;
+	for (; c + 4 * LANES <= width; c += 4 * LANES) {
+		VecF sum0 = vecZero(), sum1 = vecZero(), sum2 = vecZero(), sum3 = vecZero();
+		for (int y = 0; y < diameter; ++y) {
+			const float* const row = rows[y] + c;
+			const VecF tap = vecSet1(taps[y]);
+			sum0 = vecAdd(sum0, vecMul(vecLoadF(row), tap));
+			sum1 = vecAdd(sum1, vecMul(vecLoadF(row + LANES), tap));
+			sum2 = vecAdd(sum2, vecMul(vecLoadF(row + 2 * LANES), tap));
+			sum3 = vecAdd(sum3, vecMul(vecLoadF(row + 3 * LANES), tap));
+		}
+		if (accumulate) {
+			sum0 = vecAdd(vecLoadF(dst + c), sum0);
+			sum1 = vecAdd(vecLoadF(dst + c + LANES), sum1);
+			sum2 = vecAdd(vecLoadF(dst + c + 2 * LANES), sum2);
+			sum3 = vecAdd(vecLoadF(dst + c + 3 * LANES), sum3);
+		}
+		vecStoreF(dst + c, sum0);
+		vecStoreF(dst + c + LANES, sum1);
+		vecStoreF(dst + c + 2 * LANES, sum2);
+		vecStoreF(dst + c + 3 * LANES, sum3);
+	}
+	for (; c + LANES <= width; c += LANES) {
+		VecF sum = vecZero();
+		for (int y = 0; y < diameter; ++y) {
+			sum = vecAdd(sum, vecMul(vecLoadF(rows[y] + c), vecSet1(taps[y])));
+		}
+		if (accumulate) sum = vecAdd(vecLoadF(dst + c), sum);
+		vecStoreF(dst + c, sum);
+	}
+	for (; c < width; ++c) {
+		float sum = 0;
+		for (int y = 0; y < diameter; ++y) {
+			sum += rows[y][c] * taps[y];
+		}
+		dst[c] = accumulate ? dst[c] + sum : sum;
+	}
+}
+
+
+KERNEL_TARGET
+static void KERNEL_NAME(storeRow)(uint8_t* dst, const float* src, int width) {
+	int c = 0;
+	for (; c + 4 * LANES <= width; c += 4 * LANES) {
+		vecStoreU8x4(dst + c, vecLoadF(src + c), vecLoadF(src + c + LANES), vecLoadF(src + c + 2 * LANES), vecLoadF(src + c + 3 * LANES));
+	}
+	for (; c + LANES <= width; c += LANES) {
+		vecStoreU8(dst + c, vecLoadF(src + c));
+	}
+	conv_kernels_scalar.store_row(dst + c, src + c, width - c);
+}
+
+
+KERNEL_TARGET
+static void KERNEL_NAME(sparseRow)(uint8_t* dst, const uint8_t* src, const ptrdiff_t* offsets, const float* taps, int num_taps, int width) {
+	int c = 0;
+	for (; c + 4 * LANES <= width; c += 4 * LANES) {
+		VecF sum0 = vecZero(), sum1 = vecZero(), sum2 = vecZero(), sum3 = vecZero();
+		for (int t = 0; t < num_taps; ++t) {
+			const uint8_t* const row = src + c + offsets[t];
+			const VecF tap = vecSet1(taps[t]);
+			sum0 = vecAdd(sum0, vecMul(vecLoadU8(row), tap));
+			sum1 = vecAdd(sum1, vecMul(vecLoadU8(row + LANES), tap));
+			sum2 = vecAdd(sum2, vecMul(vecLoadU8(row + 2 * LANES), tap));
+			sum3 = vecAdd(sum3, vecMul(vecLoadU8(row + 3 * LANES), tap));
+		}
+		vecStoreU8x4(dst + c, sum0, sum1, sum2, sum3);
+	}
+	for (; c + LANES <= width; c += LANES) {
+		VecF sum = vecZero();
+		for (int t = 0; t < num_taps; ++t) {
+			sum = vecAdd(sum, vecMul(vecLoadU8(src + c + offsets[t]), vecSet1(taps[t])));
+		}
+		vecStoreU8(dst + c, sum);
+	}
+	conv_kernels_scalar.sparse_row(dst + c, src + c, offsets, taps, num_taps, width - c);
+}
+
+
+const ConvKernels KERNEL_TABLE = {
+	KERNEL_LEVEL,
+	KERNEL_LABEL,
+	KERNEL_NAME(denseRow),
+	KERNEL_NAME(horizRow),
+	KERNEL_NAME(vertRow),
+	KERNEL_NAME(storeRow),
+	KERNEL_NAME(sparseRow)
+};
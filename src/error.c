@@ -7,6 +7,8 @@ const char* getErrorString(Error error) {
             return "Success";
         case IO_ERR_NO_FILE:
             return "Cannot open supplied input or output file.";
+        case IO_ERR_FILE_HEADER:
+            return "Input has an invalid BMP header.";
         case IO_ERR_UNSUPPORTED:
             return "Input uses an unsupported BMP file format. Current simple example supports only 8-bit and 24-bit data.";
         case IO_ERR_FILE_TRUNC:
@@ -41,6 +43,20 @@ const char* getErrorString(Error error) {
             return "Radius must be non-negative.";
         case BORDER_TOO_LARGE:
             return "Border must be less than or equal to image dimensions.";
+        case INVALID_THREAD_COUNT:
+            return "Thread count must be non-negative.";
+        case THREAD_ERR_CREATE:
+            return "Failed to start worker thread.";
+        case NULL_PIPELINE:
+            return "Pipeline is null.";
+        case UNSUPPORTED_BORDER_MODE:
+            return "Border mode is not supported by this operation.";
+        case SERVER_ERR_SOCKET:
+            return "Cannot open or connect to the server socket.";
+        case SERVER_ERR_PROTOCOL:
+            return "Malformed server request or reply.";
+        case BATCH_DUPLICATE_NAME:
+            return "Batch inputs with the same file name would overwrite each other's output.";
         default:
             return "Unknown error";
     }
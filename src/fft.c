@@ -0,0 +1,202 @@
+#include "math.h"
+#include "stdlib.h"
+#include "string.h"
+#include "fft.h"
+
+// Side of the blocks swapped by `transposeSquare()`, small enough for both blocks to stay in L1
+#define FFT_TRANSPOSE_BLOCK 16
+
+
+Error initFftPlan(FftPlan* const plan, int size) {
+	memset(plan, 0, sizeof(FftPlan));
+	if (size < 2 || (size & (size - 1)) != 0) return INVALID_COMMAND;
+
+	plan->twiddle_re = (float*)malloc(size / 2 * sizeof(float));
+	plan->twiddle_im = (float*)malloc(size / 2 * sizeof(float));
+	if (plan->twiddle_re == NULL || plan->twiddle_im == NULL) {
+		freeFftPlan(plan);
+		return IO_ERR_ALLOC;
+	}
+
+	plan->size = size;
+	const double pi = acos(-1.0);
+	for (int k = 0; k < size / 2; ++k) {
+		plan->twiddle_re[k] = (float)cos(2.0 * pi * k / size);
+		plan->twiddle_im[k] = (float)-sin(2.0 * pi * k / size);
+	}
+
+	return SUCCESS;
+}
+
+
+void freeFftPlan(FftPlan* const plan) {
+	if (plan == NULL) return;
+	free(plan->twiddle_re);
+	free(plan->twiddle_im);
+	memset(plan, 0, sizeof(FftPlan));
+}
+
+
+// Twiddle factors of the two fused radix-2 stages applied to a group of four rows
+typedef struct {
+	float w0r, w0i;	// Outer stage, rows 0 and 2
+	float w1r, w1i;	// Outer stage, rows 1 and 3
+	float w2r, w2i;	// Inner stage, rows 0 and 1, and rows 2 and 3
+} FftTwiddles;
+
+
+// Radix-2 decimation-in-frequency butterfly: a' = a + b, b' = (a - b) w
+#define DIF_BUTTERFLY(ar, ai, br, bi, wr, wi) do { \
+		const float sr = ar - br, si = ai - bi; \
+		ar += br; ai += bi; \
+		br = sr * wr - si * wi; bi = sr * wi + si * wr; \
+	} while (0)
+
+// Radix-2 decimation-in-time butterfly: a' = a + b w, b' = a - b w
+#define DIT_BUTTERFLY(ar, ai, br, bi, wr, wi) do { \
+		const float tr = br * wr - bi * wi, ti = br * wi + bi * wr; \
+		br = ar - tr; bi = ai - ti; \
+		ar += tr; ai += ti; \
+	} while (0)
+
+
+// Two decimation-in-frequency stages over four rows of `n` values, the outer stage pairing rows 0 and 2, and 1 and 3
+static void difRows4(float* restrict r0, float* restrict i0, float* restrict r1, float* restrict i1,
+	float* restrict r2, float* restrict i2, float* restrict r3, float* restrict i3, const FftTwiddles w, const int n) {
+	for (int c = 0; c < n; ++c) {
+		float ar = r0[c], ai = i0[c], br = r1[c], bi = i1[c];
+		float cr = r2[c], ci = i2[c], dr = r3[c], di = i3[c];
+		DIF_BUTTERFLY(ar, ai, cr, ci, w.w0r, w.w0i);
+		DIF_BUTTERFLY(br, bi, dr, di, w.w1r, w.w1i);
+		DIF_BUTTERFLY(ar, ai, br, bi, w.w2r, w.w2i);
+		DIF_BUTTERFLY(cr, ci, dr, di, w.w2r, w.w2i);
+		r0[c] = ar; i0[c] = ai; r1[c] = br; i1[c] = bi;
+		r2[c] = cr; i2[c] = ci; r3[c] = dr; i3[c] = di;
+	}
+}
+
+
+// Inverse of `difRows4()`: the inner stage first, then the outer stage
+static void ditRows4(float* restrict r0, float* restrict i0, float* restrict r1, float* restrict i1,
+	float* restrict r2, float* restrict i2, float* restrict r3, float* restrict i3, const FftTwiddles w, const int n) {
+	for (int c = 0; c < n; ++c) {
+		float ar = r0[c], ai = i0[c], br = r1[c], bi = i1[c];
+		float cr = r2[c], ci = i2[c], dr = r3[c], di = i3[c];
+		DIT_BUTTERFLY(ar, ai, br, bi, w.w2r, w.w2i);
+		DIT_BUTTERFLY(cr, ci, dr, di, w.w2r, w.w2i);
+		DIT_BUTTERFLY(ar, ai, cr, ci, w.w0r, w.w0i);
+		DIT_BUTTERFLY(br, bi, dr, di, w.w1r, w.w1i);
+		r0[c] = ar; i0[c] = ai; r1[c] = br; i1[c] = bi;
+		r2[c] = cr; i2[c] = ci; r3[c] = dr; i3[c] = di;
+	}
+}
+
+
+// The radix-2 stage with unit twiddles left over when log2(size) is odd, as a sum and difference of row pairs
+static void sumDiffRows(float* restrict r0, float* restrict i0, float* restrict r1, float* restrict i1, const int n) {
+	for (int c = 0; c < n; ++c) {
+		const float ar = r0[c], ai = i0[c];
+		r0[c] = ar + r1[c];
+		i0[c] = ai + i1[c];
+		r1[c] = ar - r1[c];
+		i1[c] = ai - i1[c];
+	}
+}
+
+
+/*  Runs two radix-2 stages of length `len' and `len / 2' over every column
+	at once: each butterfly combines whole rows, so the inner loops run along
+	contiguous memory, and fusing the stages halves the passes over the
+	tile without changing the arithmetic. Twiddles are conjugated for the
+	inverse. */
+static void fftColumnStages(const FftPlan* const plan, float* re, float* im, const int len, const int inverse) {
+	const int n = plan->size;
+	const int quarter = len / 4;
+	const int step = n / len;
+	const float sign = inverse ? -1.0f : 1.0f;
+	for (int start = 0; start < n; start += len) {
+		for (int k = 0; k < quarter; ++k) {
+			FftTwiddles w;
+			w.w0r = plan->twiddle_re[k * step];
+			w.w0i = sign * plan->twiddle_im[k * step];
+			w.w1r = plan->twiddle_re[(k + quarter) * step];
+			w.w1i = sign * plan->twiddle_im[(k + quarter) * step];
+			w.w2r = plan->twiddle_re[2 * k * step];
+			w.w2i = sign * plan->twiddle_im[2 * k * step];
+
+			float* const rows_re[4] = { re + (size_t)(start + k) * n, re + (size_t)(start + k + quarter) * n,
+				re + (size_t)(start + k + 2 * quarter) * n, re + (size_t)(start + k + 3 * quarter) * n };
+			float* const rows_im[4] = { im + (size_t)(start + k) * n, im + (size_t)(start + k + quarter) * n,
+				im + (size_t)(start + k + 2 * quarter) * n, im + (size_t)(start + k + 3 * quarter) * n };
+			if (inverse) {
+				ditRows4(rows_re[0], rows_im[0], rows_re[1], rows_im[1], rows_re[2], rows_im[2], rows_re[3], rows_im[3], w, n);
+			} else {
+				difRows4(rows_re[0], rows_im[0], rows_re[1], rows_im[1], rows_re[2], rows_im[2], rows_re[3], rows_im[3], w, n);
+			}
+		}
+	}
+}
+
+
+// Decimation-in-frequency transform of every column, leaving the rows in bit-reversed order
+static void fftColumnsForward(const FftPlan* const plan, float* re, float* im) {
+	const int n = plan->size;
+	int len = n;
+	for (; len >= 4; len >>= 2) fftColumnStages(plan, re, im, len, 0);
+	if (len == 2) {
+		for (int r = 0; r < n; r += 2) {
+			sumDiffRows(re + (size_t)r * n, im + (size_t)r * n, re + (size_t)(r + 1) * n, im + (size_t)(r + 1) * n, n);
+		}
+	}
+}
+
+
+// Decimation-in-time inverse of `fftColumnsForward()`, taking rows in bit-reversed order
+static void fftColumnsInverse(const FftPlan* const plan, float* re, float* im) {
+	const int n = plan->size;
+	int len = 4;
+	while (len < n) len <<= 2;
+	if (len > n) {
+		for (int r = 0; r < n; r += 2) {
+			sumDiffRows(re + (size_t)r * n, im + (size_t)r * n, re + (size_t)(r + 1) * n, im + (size_t)(r + 1) * n, n);
+		}
+		len = 8;
+	} else {
+		len = 4;
+	}
+	for (; len <= n; len <<= 2) fftColumnStages(plan, re, im, len, 1);
+}
+
+
+// Transposes an `n` x `n` matrix in place, a pair of blocks at a time
+static void transposeSquare(float* const m, const int n) {
+	for (int bi = 0; bi < n; bi += FFT_TRANSPOSE_BLOCK) {
+		for (int bj = bi; bj < n; bj += FFT_TRANSPOSE_BLOCK) {
+			const int i_end = (bi + FFT_TRANSPOSE_BLOCK < n) ? bi + FFT_TRANSPOSE_BLOCK : n;
+			const int j_end = (bj + FFT_TRANSPOSE_BLOCK < n) ? bj + FFT_TRANSPOSE_BLOCK : n;
+			for (int i = bi; i < i_end; ++i) {
+				for (int j = (bi == bj) ? i + 1 : bj; j < j_end; ++j) {
+					const float t = m[(size_t)i * n + j];
+					m[(size_t)i * n + j] = m[(size_t)j * n + i];
+					m[(size_t)j * n + i] = t;
+				}
+			}
+		}
+	}
+}
+
+
+void fft2dForward(const FftPlan* const plan, float* re, float* im) {
+	fftColumnsForward(plan, re, im);
+	transposeSquare(re, plan->size);
+	transposeSquare(im, plan->size);
+	fftColumnsForward(plan, re, im);
+}
+
+
+void fft2dInverse(const FftPlan* const plan, float* re, float* im) {
+	fftColumnsInverse(plan, re, im);
+	transposeSquare(re, plan->size);
+	transposeSquare(im, plan->size);
+	fftColumnsInverse(plan, re, im);
+}
@@ -0,0 +1,29 @@
+#ifndef FFT_H
+#define FFT_H
+
+#include "error.h"
+
+// Twiddle factors for 2D transforms of `size' x `size' complex values, where `size' is a power of two
+typedef struct {
+	int size;
+	float* twiddle_re;	// cos(2 pi k / size) for k < size / 2
+	float* twiddle_im;	// -sin(2 pi k / size) for k < size / 2
+} FftPlan;
+
+// Prepares transforms of `size' x `size' values, failing with INVALID_COMMAND if `size' is not a power of two
+Error initFftPlan(FftPlan* const plan, int size);
+
+// Frees memory used by an FftPlan
+void freeFftPlan(FftPlan* const plan);
+
+/*  Transforms a matrix held as separate real and imaginary planes, rows
+	`size' values apart. The spectrum is left transposed and in bit-reversed
+	order on both axes, which saves the reordering passes a natural-order
+	transform needs: it is only meant to be multiplied point by point with
+	another spectrum from this function and passed to `fft2dInverse()'. */
+void fft2dForward(const FftPlan* const plan, float* re, float* im);
+
+// Inverts `fft2dForward()', scaling the result by `size' * `size'
+void fft2dInverse(const FftPlan* const plan, float* re, float* im);
+
+#endif // FFT_H
@@ -0,0 +1,651 @@
+#include "limits.h"
+#include "math.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "unistd.h"
+#include "filter_plan.h"
+#include "filter_tune.h"
+#include "convolve.h"
+
+
+// Reverses `count` taps into the correlation order expected by the row kernels
+static void reverseTaps(float* const dst, const float* const src, const int count) {
+	for (int i = 0; i < count; ++i) dst[i] = src[count - 1 - i];
+}
+
+
+// Returns the FFT size with the lowest estimated cost per output pixel for `radius`, or 0 if no
+// size up to FILTER_FFT_MAX_SIZE fits the filter, and stores that cost in `cost`
+static int chooseFftSize(const int radius, double* const cost) {
+	int best_size = 0;
+	*cost = HUGE_VAL;
+	for (int size = 16, log2_size = 4; size <= FILTER_FFT_MAX_SIZE; size *= 2, ++log2_size) {
+		const int tile = size - 2 * radius;
+		if (tile <= 0) continue;
+
+		// Two tiles share each forward and inverse transform, so a tile costs size * size * log2(size)
+		// butterfly elements, plus about two more passes to load, multiply, transpose and store it
+		const double tile_cost = FILTER_FFT_BUTTERFLY_COST * size * size * (log2_size + 2);
+		const double pixel_cost = tile_cost / ((double)tile * tile);
+		if (pixel_cost < *cost) {
+			*cost = pixel_cost;
+			best_size = size;
+		}
+	}
+	return best_size;
+}
+
+
+// Prepares `plan` to filter by overlap-save with transforms of `size` x `size`
+static Error initFftFilterPlan(FilterPlan* const plan, const Filter* const filter, const int size) {
+	Error err_code = initFftPlan(&plan->fft, size);
+	if (err_code != SUCCESS) return err_code;
+
+	plan->spectrum_re = (float*)calloc((size_t)size * size, sizeof(float));
+	plan->spectrum_im = (float*)calloc((size_t)size * size, sizeof(float));
+	if (plan->spectrum_re == NULL || plan->spectrum_im == NULL) return IO_ERR_ALLOC;
+
+	// The kernel wraps around the origin of the tile, so each output lines up with its centre pixel
+	const int radius = filter->radius;
+	const int diameter = 2 * radius + 1;
+	for (int y = -radius; y <= radius; ++y) {
+		for (int x = -radius; x <= radius; ++x) {
+			plan->spectrum_re[(size_t)((y + size) % size) * size + (x + size) % size] =
+				filter->data[(y + radius) * diameter + x + radius];
+		}
+	}
+	fft2dForward(&plan->fft, plan->spectrum_re, plan->spectrum_im);
+
+	const float gain = 1.0f / ((float)size * size);
+	for (size_t i = 0; i < (size_t)size * size; ++i) {
+		plan->spectrum_re[i] *= gain;
+		plan->spectrum_im[i] *= gain;
+	}
+
+	plan->tile = size - 2 * radius;
+	return SUCCESS;
+}
+
+
+int countNonZeroTaps(const Filter* const filter) {
+	if (filter->data == NULL) return 0;
+	const int num_taps = (2 * filter->radius + 1) * (2 * filter->radius + 1);
+	int count = 0;
+	for (int i = 0; i < num_taps; ++i) count += (filter->data[i] != 0.0f);
+	return count;
+}
+
+
+// Prepares `plan` to apply the `num_nonzero` non-zero taps of `filter` from a list. The taps are listed in
+// the order the dense kernels visit them, so skipping the zero products leaves every sum bit-identical.
+static Error initSparseFilterPlan(FilterPlan* const plan, const Filter* const filter, const int num_nonzero) {
+	plan->taps = (float*)malloc(num_nonzero * sizeof(float));
+	plan->sparse_rows = (int*)malloc(num_nonzero * sizeof(int));
+	plan->sparse_cols = (int*)malloc(num_nonzero * sizeof(int));
+	if (plan->taps == NULL || plan->sparse_rows == NULL || plan->sparse_cols == NULL) return IO_ERR_ALLOC;
+
+	const int radius = filter->radius;
+	const int diameter = 2 * radius + 1;
+	for (int y = -radius; y <= radius; ++y) {
+		for (int x = -radius; x <= radius; ++x) {
+			const float tap = filter->data[(radius - y) * diameter + radius - x];
+			if (tap == 0.0f) continue;
+			plan->taps[plan->num_sparse] = tap;
+			plan->sparse_rows[plan->num_sparse] = y;
+			plan->sparse_cols[plan->num_sparse] = x;
+			plan->num_sparse++;
+		}
+	}
+
+	return SUCCESS;
+}
+
+
+// Returns the size of the L2 cache, or FILTER_DEFAULT_CACHE_SIZE if it cannot be detected
+static size_t getCacheSize(void) {
+#ifdef _SC_LEVEL2_CACHE_SIZE
+	const long size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+	if (size > 0) return (size_t)size;
+#endif
+	return FILTER_DEFAULT_CACHE_SIZE;
+}
+
+
+// Sets the strip width from the bytes each output column keeps in use while the rows of a strip are
+// filtered: the window of source rows, the ring of horizontally filtered rows, or the box column sums.
+// Not used for FFT plans, whose tiles are already sized for the cache.
+static void setStripWidth(FilterPlan* const plan) {
+	const int diameter = 2 * plan->radius + 1;
+	size_t column_bytes;
+	if (plan->box != 0.0f) {
+		column_bytes = sizeof(uint64_t) + sizeof(float) + 2;
+	} else if (plan->num_sparse == 0 && plan->rank > 0) {
+		column_bytes = (size_t)(plan->rank * diameter + 1) * sizeof(float) + 1;
+	} else {
+		column_bytes = diameter + 1;
+	}
+
+	size_t strip_width = getCacheSize() / 2 / column_bytes / 64 * 64;
+	if (strip_width < FILTER_MIN_STRIP_WIDTH) strip_width = FILTER_MIN_STRIP_WIDTH;
+	plan->strip_width = (strip_width < INT_MAX) ? (int)strip_width : 0;
+}
+
+
+void getFilterMethodCosts(const Filter* const filter, double costs[FILTER_NUM_METHODS]) {
+	const int diameter = 2 * filter->radius + 1;
+	const int num_nonzero = countNonZeroTaps(filter);
+	costs[filter_method_dense] = (double)diameter * diameter;
+	costs[filter_method_separable] = (filter->rank > 0) ? 2.0 * filter->rank * diameter : HUGE_VAL;
+	costs[filter_method_sparse] = (num_nonzero > 0) ? FILTER_SPARSE_TAP_COST * num_nonzero : HUGE_VAL;
+	chooseFftSize(filter->radius, costs + filter_method_fft);
+	costs[filter_method_box] = (filter->box != 0.0f) ? 0.0 : HUGE_VAL;
+}
+
+
+FilterMethod estimateFilterMethod(const Filter* const filter, const double costs[FILTER_NUM_METHODS]) {
+	if (filter->box != 0.0f) return filter_method_box;
+
+	// Filters with separable terms are only applied densely when measured to be faster
+	FilterMethod method = (filter->rank > 0) ? filter_method_separable : filter_method_dense;
+	if (costs[filter_method_sparse] < costs[method]) method = filter_method_sparse;
+	if (costs[filter_method_fft] < costs[method]) method = filter_method_fft;
+	return method;
+}
+
+
+const char* getFilterMethodName(FilterMethod method) {
+	static const char* const names[FILTER_NUM_METHODS] = { "dense", "separable", "sparse", "fft", "box" };
+	return (method >= 0 && method < FILTER_NUM_METHODS) ? names[method] : "unknown";
+}
+
+
+Error initFilterPlanMethod(FilterPlan* const plan, const Filter* const filter, FilterMethod method) {
+	if (filter == NULL) return NULL_FILTER;
+	if (filter->data == NULL && (method != filter_method_box || filter->box == 0.0f)) return NULL_FILTER_DATA;
+
+	memset(plan, 0, sizeof(FilterPlan));
+	plan->radius = filter->radius;
+	plan->method = method;
+	Error err_code = SUCCESS;
+	switch (method) {
+	case filter_method_box:
+		if (filter->box == 0.0f) return INVALID_COMMAND;
+		plan->box = filter->box;
+		break;
+
+	case filter_method_fft: {
+		double fft_cost;
+		const int fft_size = chooseFftSize(filter->radius, &fft_cost);
+		err_code = (fft_size > 0) ? initFftFilterPlan(plan, filter, fft_size) : INVALID_COMMAND;
+		break;
+	}
+
+	case filter_method_sparse: {
+		const int num_nonzero = countNonZeroTaps(filter);
+		err_code = (num_nonzero > 0) ? initSparseFilterPlan(plan, filter, num_nonzero) : INVALID_COMMAND;
+		break;
+	}
+
+	case filter_method_separable:
+	case filter_method_dense: {
+		if (method == filter_method_separable && filter->rank == 0) return INVALID_COMMAND;
+		const int diameter = 2 * filter->radius + 1;
+		plan->rank = (method == filter_method_separable) ? filter->rank : 0;
+		const int num_taps = (plan->rank > 0) ? 2 * plan->rank * diameter : diameter * diameter;
+		plan->taps = (float*)malloc(num_taps * sizeof(float));
+		if (plan->taps == NULL) {
+			err_code = IO_ERR_ALLOC;
+			break;
+		}
+
+		if (plan->rank > 0) {
+			float* const row_taps = plan->taps;
+			float* const col_taps = plan->taps + plan->rank * diameter;
+			for (int k = 0; k < plan->rank; ++k) {
+				reverseTaps(row_taps + k * diameter, filter->row + k * diameter, diameter);
+				reverseTaps(col_taps + k * diameter, filter->col + k * diameter, diameter);
+			}
+		} else {
+			reverseTaps(plan->taps, filter->data, num_taps);
+		}
+		break;
+	}
+
+	default:
+		return INVALID_COMMAND;
+	}
+
+	if (err_code != SUCCESS) {
+		freeFilterPlan(plan);
+		return err_code;
+	}
+	if (method != filter_method_fft) setStripWidth(plan);
+
+	return SUCCESS;
+}
+
+
+// Whether initFilterPlan() prints the method it chooses
+static int explain_plans = 0;
+
+
+void setFilterExplain(int enabled) {
+	explain_plans = enabled;
+}
+
+
+// Prints the method chosen for `filter` and the estimates or measurements it was chosen by
+static void explainFilterMethod(const Filter* const filter, int width, int height, FilterMethod method,
+	const double costs[FILTER_NUM_METHODS], const FilterTuning* const tuning) {
+	const int diameter = 2 * filter->radius + 1;
+	if (filter->data == NULL) {
+		printf("Box filter radius %d", filter->radius);
+	} else {
+		printf("Filter radius %d (%d taps, %d non-zero", filter->radius, diameter * diameter, countNonZeroTaps(filter));
+		if (filter->rank > 0) printf(", rank %d", filter->rank);
+		printf(")");
+	}
+	if (width > 0) printf(" on %d x %d pixels", width, height);
+	printf(" with %s kernels: %s, ", getConvKernels()->name, getFilterMethodName(method));
+
+	if (method == filter_method_box) {
+		printf("as every tap is equal\n");
+	} else if (tuning != NULL && tuning->cached) {
+		printf("measured earlier at %.3g ns per pixel (tuning cache)\n", tuning->ns[method]);
+	} else if (tuning != NULL) {
+		printf("fastest measured in ns per pixel (");
+		const char* separator = "";
+		for (int m = 0; m < FILTER_NUM_METHODS; ++m) {
+			if (tuning->ns[m] <= 0.0) continue;
+			printf("%s%s %.3g", separator, getFilterMethodName(m), tuning->ns[m]);
+			separator = ", ";
+		}
+		printf(")\n");
+	} else {
+		printf("cheapest estimated in multiply-adds per pixel (");
+		const char* separator = "";
+		for (int m = 0; m < FILTER_NUM_METHODS; ++m) {
+			if (costs[m] == HUGE_VAL || m == filter_method_box) continue;
+			printf("%s%s %.3g", separator, getFilterMethodName(m), costs[m]);
+			separator = ", ";
+		}
+		printf(")\n");
+	}
+}
+
+
+Error initFilterPlan(FilterPlan* const plan, const Filter* const filter, int width, int height) {
+	if (filter == NULL) return NULL_FILTER;
+	if (filter->data == NULL && filter->box == 0.0f) return NULL_FILTER_DATA;
+
+	// Use whichever method is estimated to be cheapest, or measured to be fastest if tuning is enabled
+	double costs[FILTER_NUM_METHODS];
+	getFilterMethodCosts(filter, costs);
+	FilterMethod method = estimateFilterMethod(filter, costs);
+
+	FilterTuning tuning;
+	const int tuned = (method != filter_method_box && width > 0 && height > 0 && isFilterTuningEnabled());
+	if (tuned) {
+		Error err_code = tuneFilterMethod(&tuning, filter, width, height, costs);
+		if (err_code != SUCCESS) return err_code;
+		method = tuning.method;
+	}
+	if (explain_plans) explainFilterMethod(filter, width, height, method, costs, tuned ? &tuning : NULL);
+
+	return initFilterPlanMethod(plan, filter, method);
+}
+
+
+void freeFilterPlan(FilterPlan* const plan) {
+	if (plan == NULL) return;
+	free(plan->taps);
+	free(plan->sparse_rows);
+	free(plan->sparse_cols);
+	free(plan->spectrum_re);
+	free(plan->spectrum_im);
+	freeFftPlan(&plan->fft);
+	memset(plan, 0, sizeof(FilterPlan));
+}
+
+
+// Rows of the patch `filterRowsVirtual()` fills: enough output rows that the border rows around them stay a
+// small overhead, in whole FFT tiles, together with the border rows
+static int getPatchRows(const FilterPlan* const plan) {
+	const int multiple = getFilterBandRows(plan);
+	int rows = (plan->radius > FILTER_PATCH_MIN_ROWS) ? plan->radius : FILTER_PATCH_MIN_ROWS;
+	rows = (rows + multiple - 1) / multiple * multiple;
+	return rows + 2 * plan->radius;
+}
+
+
+// Arena capacity of the working memory of the method `plan` uses
+static size_t getMethodScratchSize(const FilterPlan* const plan, int width) {
+	if (plan->box != 0.0f) {
+		return arenaAlignSize((size_t)(width + 2 * plan->radius) * sizeof(uint64_t)) + arenaAlignSize(width * sizeof(float));
+	}
+	if (plan->num_sparse > 0) return arenaAlignSize(plan->num_sparse * sizeof(ptrdiff_t));
+	if (plan->tile > 0) return 2 * arenaAlignSize((size_t)plan->fft.size * plan->fft.size * sizeof(float));
+	if (plan->rank == 0) return 0;
+
+	const int diameter = 2 * plan->radius + 1;
+	return arenaAlignSize((size_t)plan->rank * diameter * width * sizeof(float)) +
+		arenaAlignSize(width * sizeof(float)) + arenaAlignSize(diameter * sizeof(float*));
+}
+
+
+size_t getFilterScratchSize(const FilterPlan* const plan, int width) {
+	const size_t patch_stride = arenaAlignSize(width + 2 * plan->radius);
+	return arenaAlignSize(patch_stride * getPatchRows(plan)) + getMethodScratchSize(plan, width);
+}
+
+
+Error initFilterScratch(FilterScratch* const scratch, const FilterPlan* const plan, int width, Arena* const arena) {
+	memset(scratch, 0, sizeof(FilterScratch));
+	scratch->width = width;
+	scratch->patch_stride = (int)arenaAlignSize(width + 2 * plan->radius);
+	scratch->patch_rows = getPatchRows(plan);
+	scratch->patch = (uint8_t*)arenaAlloc(arena, (size_t)scratch->patch_stride * scratch->patch_rows);
+	if (scratch->patch == NULL) return IO_ERR_ALLOC;
+
+	if (plan->box != 0.0f) {
+		scratch->col_sums = (uint64_t*)arenaAlloc(arena, (size_t)(width + 2 * plan->radius) * sizeof(uint64_t));
+		scratch->sum = (float*)arenaAlloc(arena, width * sizeof(float));
+		return (scratch->col_sums == NULL || scratch->sum == NULL) ? IO_ERR_ALLOC : SUCCESS;
+	}
+	if (plan->num_sparse > 0) {
+		scratch->offsets = (ptrdiff_t*)arenaAlloc(arena, plan->num_sparse * sizeof(ptrdiff_t));
+		return (scratch->offsets == NULL) ? IO_ERR_ALLOC : SUCCESS;
+	}
+	if (plan->tile > 0) {
+		const size_t tile_size = (size_t)plan->fft.size * plan->fft.size * sizeof(float);
+		scratch->tile_re = (float*)arenaAlloc(arena, tile_size);
+		scratch->tile_im = (float*)arenaAlloc(arena, tile_size);
+		return (scratch->tile_re == NULL || scratch->tile_im == NULL) ? IO_ERR_ALLOC : SUCCESS;
+	}
+	if (plan->rank == 0) return SUCCESS;
+
+	const int diameter = 2 * plan->radius + 1;
+	scratch->ring = (float*)arenaAlloc(arena, (size_t)plan->rank * diameter * width * sizeof(float));
+	scratch->sum = (float*)arenaAlloc(arena, width * sizeof(float));
+	scratch->rows = (const float**)arenaAlloc(arena, diameter * sizeof(float*));
+	if (scratch->ring == NULL || scratch->sum == NULL || scratch->rows == NULL) return IO_ERR_ALLOC;
+
+	return SUCCESS;
+}
+
+
+// Each source row is filtered horizontally once into a ring of `diameter` rows per term, from
+// which each output row is produced by a vertical pass.
+static void filterRowsSeparable(const FilterPlan* const plan, const uint8_t* src, ptrdiff_t src_stride,
+	uint8_t* dst, ptrdiff_t dst_stride, int width, int num_rows, FilterScratch* const scratch) {
+	const ConvKernels* const kernels = getConvKernels();
+	const int radius = plan->radius;
+	const int diameter = 2 * radius + 1;
+	const int rank = plan->rank;
+	const float* const row_taps = plan->taps;
+	const float* const col_taps = plan->taps + rank * diameter;
+
+	for (int r = -radius; r < num_rows + radius; ++r) {
+		// Horizontal pass of source row `r`
+		const int slot = (r + radius) % diameter;
+		for (int k = 0; k < rank; ++k) {
+			float* const out = scratch->ring + ((size_t)k * diameter + slot) * width;
+			kernels->horiz_row(out, src + r * src_stride, row_taps + k * diameter, radius, width);
+		}
+
+		// Vertical pass once all rows of the window for output row `r - radius` are available
+		const int out_row = r - radius;
+		if (out_row < 0) continue;
+		for (int k = 0; k < rank; ++k) {
+			for (int y = 0; y < diameter; ++y) {
+				scratch->rows[y] = scratch->ring + ((size_t)k * diameter + (out_row + y) % diameter) * width;
+			}
+			kernels->vert_row(scratch->sum, scratch->rows, col_taps + k * diameter, diameter, width, k > 0);
+		}
+		kernels->store_row(dst + out_row * dst_stride, scratch->sum, width);
+	}
+}
+
+
+// Loads the source pixels for the FFT tile whose first output pixel is (`x`, `y`) into `tile`. Pixels
+// beyond the readable border only reach outputs outside the block, which are discarded, so they are zeroed.
+static void loadFftTile(float* const tile, const FilterPlan* const plan, const uint8_t* src, ptrdiff_t src_stride,
+	int x, int y, int width, int num_rows) {
+	const int size = plan->fft.size;
+	const int radius = plan->radius;
+	int cols = width + 2 * radius - x;
+	if (cols > size) cols = size;
+	int rows = num_rows + 2 * radius - y;
+	if (rows > size) rows = size;
+
+	const uint8_t* const origin = src + (ptrdiff_t)(y - radius) * src_stride + (x - radius);
+	for (int r = 0; r < rows; ++r) {
+		const uint8_t* const in = origin + r * src_stride;
+		float* const out = tile + (size_t)r * size;
+		for (int c = 0; c < cols; ++c) out[c] = (float)in[c];
+		for (int c = cols; c < size; ++c) out[c] = 0.0f;
+	}
+	memset(tile + (size_t)rows * size, 0, (size_t)(size - rows) * size * sizeof(float));
+}
+
+
+// Stores the valid outputs of an FFT tile, dropping those the circular convolution wrapped around
+static void storeFftTile(uint8_t* dst, ptrdiff_t dst_stride, const float* const tile, const FilterPlan* const plan,
+	int x, int y, int width, int num_rows) {
+	const int size = plan->fft.size;
+	const int radius = plan->radius;
+	int cols = width - x;
+	if (cols > plan->tile) cols = plan->tile;
+	int rows = num_rows - y;
+	if (rows > plan->tile) rows = plan->tile;
+
+	for (int r = 0; r < rows; ++r) {
+		const float* const in = tile + (size_t)(r + radius) * size + radius;
+		uint8_t* const out = dst + (ptrdiff_t)(y + r) * dst_stride + x;
+		for (int c = 0; c < cols; ++c) out[c] = clampToByte(in[c]);
+	}
+}
+
+
+// Filters the block by overlap-save in tiles of `tile` x `tile` outputs. The kernel is real, so two
+// tiles are filtered by each transform, one in the real plane and one in the imaginary plane.
+static void filterRowsFft(const FilterPlan* const plan, const uint8_t* src, ptrdiff_t src_stride,
+	uint8_t* dst, ptrdiff_t dst_stride, int width, int num_rows, FilterScratch* const scratch) {
+	const int tile = plan->tile;
+	const size_t tile_len = (size_t)plan->fft.size * plan->fft.size;
+	const int tiles_x = (width + tile - 1) / tile;
+	const int num_tiles = tiles_x * ((num_rows + tile - 1) / tile);
+	float* const re = scratch->tile_re;
+	float* const im = scratch->tile_im;
+
+	for (int t = 0; t < num_tiles; t += 2) {
+		const int x0 = (t % tiles_x) * tile;
+		const int y0 = (t / tiles_x) * tile;
+		const int x1 = ((t + 1) % tiles_x) * tile;
+		const int y1 = ((t + 1) / tiles_x) * tile;
+		const int paired = (t + 1 < num_tiles);
+
+		loadFftTile(re, plan, src, src_stride, x0, y0, width, num_rows);
+		if (paired) loadFftTile(im, plan, src, src_stride, x1, y1, width, num_rows);
+		else memset(im, 0, tile_len * sizeof(float));
+
+		fft2dForward(&plan->fft, re, im);
+		for (size_t i = 0; i < tile_len; ++i) {
+			const float xr = re[i];
+			const float xi = im[i];
+			re[i] = xr * plan->spectrum_re[i] - xi * plan->spectrum_im[i];
+			im[i] = xr * plan->spectrum_im[i] + xi * plan->spectrum_re[i];
+		}
+		fft2dInverse(&plan->fft, re, im);
+
+		storeFftTile(dst, dst_stride, re, plan, x0, y0, width, num_rows);
+		if (paired) storeFftTile(dst, dst_stride, im, plan, x1, y1, width, num_rows);
+	}
+}
+
+
+// Adds a row to the column sums of a box filter
+static void addColumnSums(uint64_t* restrict sums, const uint8_t* restrict row, const int span) {
+	for (int x = 0; x < span; ++x) sums[x] += row[x];
+}
+
+
+// Moves the column sums of a box filter down a row
+static void slideColumnSums(uint64_t* restrict sums, const uint8_t* restrict entering, const uint8_t* restrict leaving,
+	const int span) {
+	for (int x = 0; x < span; ++x) sums[x] = sums[x] + entering[x] - leaving[x];
+}
+
+
+// Each column sum covers the window's rows and slides down a row per output row, and each output is a
+// running sum of column sums along the row, so the cost per pixel does not depend on the radius. The sums
+// are exact integers, so the only rounding is in scaling them by the tap.
+static void filterRowsBox(const FilterPlan* const plan, const uint8_t* src, ptrdiff_t src_stride,
+	uint8_t* dst, ptrdiff_t dst_stride, int width, int num_rows, FilterScratch* const scratch) {
+	const ConvKernels* const kernels = getConvKernels();
+	const int radius = plan->radius;
+	const int diameter = 2 * radius + 1;
+	const int span = width + 2 * radius;
+	uint64_t* const sums = scratch->col_sums;
+	float* const values = scratch->sum;
+
+	memset(sums, 0, span * sizeof(uint64_t));
+	for (int y = -radius; y <= radius; ++y) addColumnSums(sums, src + y * src_stride - radius, span);
+
+	for (int r = 0; r < num_rows; ++r) {
+		if (r > 0) {
+			slideColumnSums(sums, src + (r + radius) * src_stride - radius, src + (r - radius - 1) * src_stride - radius, span);
+		}
+
+		// The running sum is the only serial step; the vector store kernel converts the row to pixels
+		// 64 bits hold 255 * (2 * radius + 1)^2 for any radius, which 32 bits do not beyond about 2000
+		uint64_t sum = 0;
+		for (int x = 0; x < diameter - 1; ++x) sum += sums[x];
+		for (int c = 0; c < width; ++c) {
+			sum += sums[c + diameter - 1];
+			values[c] = (float)sum * plan->box;
+			sum -= sums[c];
+		}
+		kernels->store_row(dst + r * dst_stride, values, width);
+	}
+}
+
+
+// Applies the listed taps, whose row offsets are resolved against the source stride once per call
+static void filterRowsSparse(const FilterPlan* const plan, const uint8_t* src, ptrdiff_t src_stride,
+	uint8_t* dst, ptrdiff_t dst_stride, int width, int num_rows, FilterScratch* const scratch) {
+	const ConvKernels* const kernels = getConvKernels();
+	for (int t = 0; t < plan->num_sparse; ++t) {
+		scratch->offsets[t] = plan->sparse_rows[t] * src_stride + plan->sparse_cols[t];
+	}
+	for (int r = 0; r < num_rows; ++r) {
+		kernels->sparse_row(dst + r * dst_stride, src + r * src_stride, scratch->offsets, plan->taps, plan->num_sparse, width);
+	}
+}
+
+
+// Filters one column strip with the method chosen for the plan
+static void filterStrip(const FilterPlan* const plan, const uint8_t* src, ptrdiff_t src_stride,
+	uint8_t* dst, ptrdiff_t dst_stride, int width, int num_rows, FilterScratch* const scratch) {
+	if (plan->box != 0.0f) {
+		filterRowsBox(plan, src, src_stride, dst, dst_stride, width, num_rows, scratch);
+		return;
+	}
+	if (plan->num_sparse > 0) {
+		filterRowsSparse(plan, src, src_stride, dst, dst_stride, width, num_rows, scratch);
+		return;
+	}
+	if (plan->tile > 0) {
+		filterRowsFft(plan, src, src_stride, dst, dst_stride, width, num_rows, scratch);
+		return;
+	}
+	if (plan->rank > 0) {
+		filterRowsSeparable(plan, src, src_stride, dst, dst_stride, width, num_rows, scratch);
+		return;
+	}
+
+	const ConvKernels* const kernels = getConvKernels();
+	for (int r = 0; r < num_rows; ++r) {
+		kernels->dense_row(dst + r * dst_stride, src + r * src_stride, src_stride, plan->taps, plan->radius, width);
+	}
+}
+
+
+void filterRows(const FilterPlan* const plan, const uint8_t* src, ptrdiff_t src_stride,
+	uint8_t* dst, ptrdiff_t dst_stride, int width, int num_rows, FilterScratch* const scratch) {
+	const int strip_width = (plan->strip_width > 0) ? plan->strip_width : width;
+	for (int x = 0; x < width; x += strip_width) {
+		const int strip = (width - x < strip_width) ? width - x : strip_width;
+		filterStrip(plan, src + x, src_stride, dst + x, dst_stride, strip, num_rows, scratch);
+	}
+}
+
+
+// Fills the patch with columns `x0` to `x0 + cols - 1` of plane rows `y0` to `y0 + rows - 1`, making up those
+// outside the plane by `mode`
+static void loadPatch(FilterScratch* const scratch, const uint8_t* plane, ptrdiff_t stride, int width, int height,
+	BorderMode mode, int x0, int y0, int cols, int rows) {
+	const int x_end = x0 + cols;
+	const int copy_end = (x_end < width) ? x_end : width;
+	for (int r = 0; r < rows; ++r) {
+		uint8_t* const out = scratch->patch + (size_t)r * scratch->patch_stride;
+		const int y = getBorderIndex(y0 + r, height, mode);
+		if (y < 0) {
+			memset(out, 0, cols);
+			continue;
+		}
+
+		const uint8_t* const src = plane + y * stride;
+		int x = x0;
+		for (; x < x_end && x < 0; ++x) out[x - x0] = getBorderSample(src, x, width, mode);
+		if (x < copy_end) {
+			memcpy(out + (x - x0), src + x, copy_end - x);
+			x = copy_end;
+		}
+		for (; x < x_end; ++x) out[x - x0] = getBorderSample(src, x, width, mode);
+	}
+}
+
+
+// Filters the `cols` x `rows` block of output pixels at (`x`, `y`) from a patch
+static void filterPatch(const FilterPlan* const plan, const uint8_t* plane, ptrdiff_t stride, int width, int height,
+	BorderMode mode, uint8_t* dst, ptrdiff_t dst_stride, int x, int y, int cols, int rows, FilterScratch* const scratch) {
+	const int radius = plan->radius;
+	const int patch_stride = scratch->patch_stride;
+	loadPatch(scratch, plane, stride, width, height, mode, x - radius, y - radius, cols + 2 * radius, rows + 2 * radius);
+	filterRows(plan, scratch->patch + (size_t)radius * patch_stride + radius, patch_stride,
+		dst + y * dst_stride + x, dst_stride, cols, rows, scratch);
+}
+
+
+// Rows whose source lies inside the plane have their middle columns filtered in place, leaving only the
+// columns within `radius` of the sides to patches; other rows are filtered from patches across the width.
+// FFT plans take every row from patches across the width instead: a patch narrower than a tile costs a whole
+// transform, while copying rows costs little beside one.
+void filterRowsVirtual(const FilterPlan* const plan, const uint8_t* plane, ptrdiff_t stride, int width, int height,
+	BorderMode mode, uint8_t* dst, ptrdiff_t dst_stride, int first_row, int num_rows, FilterScratch* const scratch) {
+	const int radius = plan->radius;
+	const int chunk = scratch->patch_rows - 2 * radius;
+	const int has_middle = plan->tile == 0 && width > 2 * radius;
+	const int end = first_row + num_rows;
+
+	for (int y = first_row; y < end;) {
+		if (has_middle && y >= radius && y < height - radius) {
+			const int y_end = (height - radius < end) ? height - radius : end;
+			filterRows(plan, plane + y * stride + radius, stride, dst + y * dst_stride + radius, dst_stride,
+				width - 2 * radius, y_end - y, scratch);
+			for (; y < y_end && radius > 0; y += chunk) {
+				const int rows = (y_end - y < chunk) ? y_end - y : chunk;
+				filterPatch(plan, plane, stride, width, height, mode, dst, dst_stride, 0, y, radius, rows, scratch);
+				filterPatch(plan, plane, stride, width, height, mode, dst, dst_stride, width - radius, y, radius, rows, scratch);
+			}
+			y = y_end;
+		} else {
+			int y_end = (end - y < chunk) ? end : y + chunk;
+			if (has_middle && y < radius && y_end > radius) y_end = radius;
+			filterPatch(plan, plane, stride, width, height, mode, dst, dst_stride, 0, y, width, y_end - y, scratch);
+			y = y_end;
+		}
+	}
+}
@@ -0,0 +1,133 @@
+#ifndef FILTER_PLAN_H
+#define FILTER_PLAN_H
+
+#include "stddef.h"
+#include "stdint.h"
+#include "process.h"
+#include "image.h"
+#include "arena.h"
+#include "fft.h"
+
+// Largest FFT tile side; the two float planes of a 256 x 256 tile take 512 KiB, which stays in L2
+#define FILTER_FFT_MAX_SIZE 256
+
+// Cache size assumed for sizing column strips when the L2 size cannot be detected
+#define FILTER_DEFAULT_CACHE_SIZE (1024 * 1024)
+
+// Narrowest column strip, so the columns re-read at strip edges stay a small overhead
+#define FILTER_MIN_STRIP_WIDTH 256
+
+// Fewest output rows filtered from one patch of source pixels with a made-up border
+#define FILTER_PATCH_MIN_ROWS 16
+
+// Cost of a tap applied from a list of non-zero taps relative to one of a dense kernel, as measured
+#define FILTER_SPARSE_TAP_COST 1.25
+
+// Cost of a radix-2 butterfly on one element relative to a multiply-add of the widest direct kernels, as measured
+#define FILTER_FFT_BUTTERFLY_COST 12.0
+
+// Ways a FilterPlan can apply a filter
+typedef enum {
+	filter_method_dense = 0,	// The full kernel
+	filter_method_separable,	// Horizontal then vertical passes of each separable term
+	filter_method_sparse,		// A list of the non-zero taps
+	filter_method_fft,			// Overlap-save in the frequency domain
+	filter_method_box			// Running sums, for filters whose taps are all equal
+} FilterMethod;
+
+#define FILTER_NUM_METHODS 5
+
+/*  A filter prepared for the row kernels, with taps reversed into
+	correlation order, as running sums if every tap is equal, or as the
+	list of its non-zero taps or for overlap-save filtering in the
+	frequency domain when either is estimated to be cheaper. An FFT tile covers `tile' x `tile'
+	output pixels from a square of `tile + 2 * radius' source pixels.
+	Rounding in the single-precision transforms can move an output pixel
+	by one level from the result of filtering directly. */
+typedef struct {
+	int radius;
+	FilterMethod method;
+	int rank;			// Number of separable terms, or 0 to apply `taps' as a dense kernel
+	float* taps;		// Dense taps, the horizontal taps of every term followed by the vertical taps, or the listed taps
+	int num_sparse;		// Number of non-zero taps listed in correlation order, or 0 if the taps are not listed
+	int* sparse_rows;	// Row offset of each listed tap from the output pixel
+	int* sparse_cols;	// Column offset of each listed tap
+	int tile;			// Output pixels along each side of an FFT tile, or 0 to filter directly
+	FftPlan fft;		// Transform over a tile's source pixels
+	float* spectrum_re;	// Spectrum of the kernel from `fft2dForward()', divided by the inverse's gain
+	float* spectrum_im;
+	float box;			// Tap shared by every pixel of a uniform filter applied by running sums, or 0
+	int strip_width;	// Widest column strip whose working rows fit in half the L2 cache, or 0 for no limit
+} FilterPlan;
+
+// Per-thread working memory for `filterRows()'
+typedef struct {
+	int width;
+	float* ring;		// Horizontally filtered rows, `diameter' rows per separable term
+	float* sum;			// One row of accumulated separable terms, or of scaled box sums
+	const float** rows;	// Row pointers into `ring' for the vertical pass
+	float* tile_re;		// Real and imaginary planes of an FFT tile
+	float* tile_im;
+	ptrdiff_t* offsets;	// Byte offset of each listed tap for the source stride of the current call
+	uint64_t* col_sums;	// Sums down the window of each column a box filter reads, `width + 2 * radius' wide
+	uint8_t* patch;		// Source pixels of a block near an edge of an unbordered plane, `width + 2 * radius' wide
+	int patch_stride;
+	int patch_rows;		// Rows `patch' holds, the block's rows and `radius' rows above and below it
+} FilterScratch;
+
+/*  Prepares `filter' for use with `filterRows()' on images of `width' x
+	`height' pixels, by the method estimated to be cheapest or, if tuning
+	is enabled and the size is given, the one measured to be fastest for
+	filters and images like these. Uniform filters always use running
+	sums, which are exact. Pass 0 for a size that is not known. */
+Error initFilterPlan(FilterPlan* const plan, const Filter* const filter, int width, int height);
+
+// Prepares `filter' to be applied by `method', failing with INVALID_COMMAND if the method does not suit it
+Error initFilterPlanMethod(FilterPlan* const plan, const Filter* const filter, FilterMethod method);
+
+// Estimates the cost per output pixel of each method for `filter', in multiply-adds of the widest kernels,
+// storing HUGE_VAL for methods that do not suit it
+void getFilterMethodCosts(const Filter* const filter, double costs[FILTER_NUM_METHODS]);
+
+// Returns the number of non-zero taps in `filter', or 0 for a box filter, which keeps no taps
+int countNonZeroTaps(const Filter* const filter);
+
+// Returns the method with the lowest of the estimated `costs'
+FilterMethod estimateFilterMethod(const Filter* const filter, const double costs[FILTER_NUM_METHODS]);
+
+// Returns the name of `method', as used by `--explain' and the tuning cache
+const char* getFilterMethodName(FilterMethod method);
+
+// Returns the number of rows a band should be a multiple of for `filterRows()' to use a plan efficiently
+static inline int getFilterBandRows(const FilterPlan* const plan) {
+	return (plan->tile > 0) ? plan->tile : 1;
+}
+
+// Frees memory used by a FilterPlan
+void freeFilterPlan(FilterPlan* const plan);
+
+// Returns the arena capacity `initFilterScratch()' needs for rows of up to `width' pixels
+size_t getFilterScratchSize(const FilterPlan* const plan, int width);
+
+// Allocates scratch memory for filtering rows of up to `width' pixels from `arena', which owns it
+Error initFilterScratch(FilterScratch* const scratch, const FilterPlan* const plan, int width, Arena* const arena);
+
+/*  Filters `num_rows' rows of `width' pixels from `src' into `dst', where
+	both point at the first pixel of their first row and successive rows
+	are `src_stride' and `dst_stride' bytes apart. `src' must be readable
+	`radius' rows and columns beyond the block on every side, and must not
+	overlap `dst'. Wide blocks are filtered in column strips of at most
+	`strip_width' pixels, so the rows a strip works on stay in cache. */
+void filterRows(const FilterPlan* const plan, const uint8_t* src, ptrdiff_t src_stride,
+	uint8_t* dst, ptrdiff_t dst_stride, int width, int num_rows, FilterScratch* const scratch);
+
+/*  Filters rows `first_row' to `first_row + num_rows - 1' of a `width' x
+	`height' plane that has no border into `dst', which points at row 0 of
+	the output. Pixels whose source lies inside the plane are filtered in
+	place; those near an edge are filtered from a patch of `scratch'
+	holding their source pixels with the border made up by `mode', so the
+	radius may exceed the plane. */
+void filterRowsVirtual(const FilterPlan* const plan, const uint8_t* plane, ptrdiff_t stride, int width, int height,
+	BorderMode mode, uint8_t* dst, ptrdiff_t dst_stride, int first_row, int num_rows, FilterScratch* const scratch);
+
+#endif // FILTER_PLAN_H
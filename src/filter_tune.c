@@ -0,0 +1,227 @@
+#include "math.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "time.h"
+#include "filter_tune.h"
+#include "convolve.h"
+#include "arena.h"
+
+// Longest method or kernel name stored in the tuning cache
+#define TUNE_NAME_LENGTH 16
+
+// The fastest method measured for filters and images matching every field up to `method`
+typedef struct {
+	int radius;
+	int num_nonzero;
+	int rank;
+	int width_bits;		// Position of the highest set bit of the image width
+	int height_bits;
+	char kernels[TUNE_NAME_LENGTH];	// Name of the convolution kernels in use
+	FilterMethod method;
+	double ns;			// Time per output pixel of `method` when it was measured
+} TuneEntry;
+
+// Tuning cache, read from `cache_file` when tuning is enabled; later entries take precedence
+static char* cache_file = NULL;
+static TuneEntry* entries = NULL;
+static int num_entries = 0;
+static int entry_capacity = 0;
+
+
+int isFilterTuningEnabled(void) {
+	return cache_file != NULL;
+}
+
+
+static Error addEntry(const TuneEntry* const entry) {
+	if (num_entries == entry_capacity) {
+		const int capacity = (entry_capacity > 0) ? 2 * entry_capacity : 16;
+		TuneEntry* const grown = (TuneEntry*)realloc(entries, capacity * sizeof(TuneEntry));
+		if (grown == NULL) return IO_ERR_ALLOC;
+		entries = grown;
+		entry_capacity = capacity;
+	}
+	entries[num_entries++] = *entry;
+	return SUCCESS;
+}
+
+
+// Returns the latest entry with the key of `key`, or NULL
+static const TuneEntry* findEntry(const TuneEntry* const key) {
+	for (int i = num_entries - 1; i >= 0; --i) {
+		const TuneEntry* const entry = entries + i;
+		if (entry->radius == key->radius && entry->num_nonzero == key->num_nonzero && entry->rank == key->rank &&
+			entry->width_bits == key->width_bits && entry->height_bits == key->height_bits &&
+			strcmp(entry->kernels, key->kernels) == 0) return entry;
+	}
+	return NULL;
+}
+
+
+// Parses a line of the cache file, returning 0 if it is not an entry
+static int parseEntry(TuneEntry* const entry, const char* const line) {
+	char method[TUNE_NAME_LENGTH];
+	if (sscanf(line, "%d %d %d %d %d %15s %15s %lf", &entry->radius, &entry->num_nonzero, &entry->rank,
+		&entry->width_bits, &entry->height_bits, entry->kernels, method, &entry->ns) != 8) return 0;
+
+	for (int m = 0; m < FILTER_NUM_METHODS; ++m) {
+		if (strcmp(method, getFilterMethodName(m)) != 0) continue;
+		entry->method = m;
+		return 1;
+	}
+	return 0;
+}
+
+
+// Appends an entry to the cache file, writing a header first if the file is new. Failures are ignored, since
+// the entry is then only measured again by later runs.
+static void storeEntry(const TuneEntry* const entry) {
+	FILE* const file = fopen(cache_file, "a");
+	if (file == NULL) return;
+
+	if (ftell(file) == 0) fprintf(file, "# radius non-zero-taps rank log2(width) log2(height) kernels method ns-per-pixel\n");
+	fprintf(file, "%d %d %d %d %d %s %s %.4g\n", entry->radius, entry->num_nonzero, entry->rank,
+		entry->width_bits, entry->height_bits, entry->kernels, getFilterMethodName(entry->method), entry->ns);
+	fclose(file);
+}
+
+
+Error setFilterTuning(const char* const path) {
+	free(cache_file);
+	free(entries);
+	cache_file = NULL;
+	entries = NULL;
+	num_entries = 0;
+	entry_capacity = 0;
+	if (path == NULL) return SUCCESS;
+
+	const size_t length = strlen(path);
+	cache_file = (char*)malloc(length + 1);
+	if (cache_file == NULL) return IO_ERR_ALLOC;
+	memcpy(cache_file, path, length + 1);
+
+	// A missing file is created when the first result is stored
+	FILE* const file = fopen(path, "r");
+	if (file == NULL) return SUCCESS;
+
+	char line[256];
+	Error err_code = SUCCESS;
+	while (err_code == SUCCESS && fgets(line, sizeof(line), file) != NULL) {
+		TuneEntry entry;
+		if (line[0] != '#' && parseEntry(&entry, line)) err_code = addEntry(&entry);
+	}
+	fclose(file);
+
+	return err_code;
+}
+
+
+static int getHighestBit(unsigned int value) {
+	int bit = -1;
+	for (; value != 0; value >>= 1) ++bit;
+	return bit;
+}
+
+
+static double getSeconds(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+
+// Measures the time per output pixel of filtering a block `width` pixels wide by `method`
+static Error timeFilterMethod(double* const ns, const Filter* const filter, const FilterMethod method, const int width) {
+	FilterPlan plan;
+	Error err_code = initFilterPlanMethod(&plan, filter, method);
+	if (err_code != SUCCESS) return err_code;
+
+	const int radius = filter->radius;
+	int rows = getFilterBandRows(&plan);
+	if (rows < FILTER_TUNE_MIN_ROWS) rows = FILTER_TUNE_MIN_ROWS;
+	const size_t stride = arenaAlignSize(width + 2 * radius);
+	const size_t src_size = stride * (rows + 2 * radius);
+	const size_t dst_size = stride * rows;
+
+	Arena arena;
+	err_code = initArena(&arena, arenaAlignSize(src_size) + arenaAlignSize(dst_size) + getFilterScratchSize(&plan, width));
+	FilterScratch scratch;
+	if (err_code == SUCCESS) err_code = initFilterScratch(&scratch, &plan, width, &arena);
+	uint8_t* const src = (uint8_t*)arenaAlloc(&arena, src_size);
+	uint8_t* const dst = (uint8_t*)arenaAlloc(&arena, dst_size);
+	if (err_code == SUCCESS && (src == NULL || dst == NULL)) err_code = IO_ERR_ALLOC;
+
+	if (err_code == SUCCESS) {
+		// Pseudo-random pixels, so no method gains from runs of equal values
+		uint32_t seed = 1;
+		for (size_t i = 0; i < src_size; ++i) {
+			seed = seed * 1664525u + 1013904223u;
+			src[i] = (uint8_t)(seed >> 24);
+		}
+
+		double best = HUGE_VAL;
+		for (int run = 0; run <= FILTER_TUNE_RUNS; ++run) {
+			const double start = getSeconds();
+			filterRows(&plan, src + radius * stride + radius, stride, dst, stride, width, rows, &scratch);
+			const double seconds = getSeconds() - start;
+			if (run > 0 && seconds < best) best = seconds;
+		}
+		*ns = best * 1e9 / ((double)width * rows);
+	}
+
+	freeArena(&arena);
+	freeFilterPlan(&plan);
+
+	return err_code;
+}
+
+
+Error tuneFilterMethod(FilterTuning* const tuning, const Filter* const filter, int width, int height,
+	const double costs[FILTER_NUM_METHODS]) {
+	memset(tuning, 0, sizeof(FilterTuning));
+
+	TuneEntry key;
+	memset(&key, 0, sizeof(TuneEntry));
+	key.radius = filter->radius;
+	key.num_nonzero = countNonZeroTaps(filter);
+	key.rank = filter->rank;
+	key.width_bits = getHighestBit(width);
+	key.height_bits = getHighestBit(height);
+	snprintf(key.kernels, sizeof(key.kernels), "%s", getConvKernels()->name);
+
+	const TuneEntry* const entry = findEntry(&key);
+	if (entry != NULL) {
+		tuning->method = entry->method;
+		tuning->cached = 1;
+		tuning->ns[entry->method] = entry->ns;
+		return SUCCESS;
+	}
+
+	// Time each method that could plausibly win
+	double cheapest = HUGE_VAL;
+	for (int m = 0; m < FILTER_NUM_METHODS; ++m) {
+		if (costs[m] < cheapest) cheapest = costs[m];
+	}
+
+	const int block_width = (width < FILTER_TUNE_MAX_WIDTH) ? width : FILTER_TUNE_MAX_WIDTH;
+	key.method = estimateFilterMethod(filter, costs);
+	key.ns = HUGE_VAL;
+	for (int m = 0; m < FILTER_NUM_METHODS; ++m) {
+		if (costs[m] == HUGE_VAL || costs[m] > FILTER_TUNE_COST_RANGE * cheapest) continue;
+
+		Error err_code = timeFilterMethod(tuning->ns + m, filter, m, block_width);
+		if (err_code != SUCCESS) return err_code;
+		if (tuning->ns[m] < key.ns) {
+			key.method = m;
+			key.ns = tuning->ns[m];
+		}
+	}
+	tuning->method = key.method;
+
+	Error err_code = addEntry(&key);
+	if (err_code != SUCCESS) return err_code;
+	storeEntry(&key);
+
+	return SUCCESS;
+}
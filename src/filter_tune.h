@@ -0,0 +1,37 @@
+#ifndef FILTER_TUNE_H
+#define FILTER_TUNE_H
+
+#include "filter_plan.h"
+
+// Widest block timed for each method; wider images are timed on a block of this width
+#define FILTER_TUNE_MAX_WIDTH 1024
+
+// Fewest rows timed for each method, or a row of FFT tiles if more
+#define FILTER_TUNE_MIN_ROWS 16
+
+// Timed runs of each method, after one that warms the caches, of which the fastest counts
+#define FILTER_TUNE_RUNS 3
+
+// Methods estimated to cost more than this many times the cheapest are not timed
+#define FILTER_TUNE_COST_RANGE 8.0
+
+// Outcome of tuning the method for a filter
+typedef struct {
+	FilterMethod method;
+	int cached;						// Whether `method' was read from the tuning cache rather than measured
+	double ns[FILTER_NUM_METHODS];	// Measured time per output pixel of each method, or 0 if not timed
+} FilterTuning;
+
+// Returns whether `setFilterTuning()' has enabled tuning
+int isFilterTuningEnabled(void);
+
+/*  Picks the fastest method for `filter' on images of `width' x `height'
+	pixels. The choice is read from the tuning cache if a filter with the
+	same radius, number of non-zero taps and separable terms has been tuned
+	for images of the same power-of-two size class with the same kernels;
+	otherwise every method within FILTER_TUNE_COST_RANGE of the cheapest of
+	`costs' is timed, and the fastest is added to the cache. */
+Error tuneFilterMethod(FilterTuning* const tuning, const Filter* const filter, int width, int height,
+	const double costs[FILTER_NUM_METHODS]);
+
+#endif // FILTER_TUNE_H
@@ -1,6 +1,20 @@
 #include "io_bmp.h"
 #include "image.h"
 #include "error.h"
+#include "interleave.h"
+#include "stats_hooks.h"
+#include "shared_pool.h"
+#include "string.h"
+#include "stddef.h"
+
+// Least pixel data worth reading or writing on several threads
+#define PARALLEL_IO_MIN_BYTES ((size_t)4 << 20)
+
+// Most bytes each thread reads or writes at once, small enough to stay in L2 while the lines are converted
+#define PARALLEL_IO_CHUNK_BYTES ((size_t)256 << 10)
+
+// Row ranges to create per thread so that threads finishing early can steal work from the others
+#define PARALLEL_IO_TASKS_PER_THREAD 4
 
 
 Error initImage(Image** image) {
@@ -15,146 +29,324 @@ Error initImage(Image** image) {
 void freeImage(Image* const image) {
 	if (image == NULL) return;
 
-	if (image->components != NULL) {
-		for (int p = 0; p < image->num_components; ++p) {
-			free(image->components[p].data);
-		}
-		free(image->components);
-	}
+	freeArena(&image->arena);
 	image->components = NULL;
 	image->num_components = 0;
 }
 
 
-Error readBmp(Image* const image, const char* const in_file, int x_border, int y_border) {
-	int err_code;
+size_t layoutImageComp(ImageComp* const component, int width, int height, int x_border, int y_border) {
+	const int lead = (x_border + IMAGE_ROW_ALIGNMENT - 1) / IMAGE_ROW_ALIGNMENT * IMAGE_ROW_ALIGNMENT;
+	component->width = width;
+	component->height = height;
+	component->x_border = x_border;
+	component->y_border = y_border;
+	component->stride = (lead + width + x_border + IMAGE_ROW_ALIGNMENT - 1) / IMAGE_ROW_ALIGNMENT * IMAGE_ROW_ALIGNMENT;
+	component->data = NULL;
+	component->image = NULL;
+	return getImageCompSize(component);
+}
 
-	// Read the input image header
-	BmpIn bmp_in;
-	err_code = bmpInOpen(&bmp_in, in_file);
-	if (err_code != SUCCESS) return err_code;
 
-	// Allocate memory for a row of pixel data
-	const int width = bmp_in.cols;
-	const int height = bmp_in.rows;
-	const int total_width = width + 2 * x_border;
-	const int total_height = height + 2 * y_border;
-	const int num_components = bmp_in.num_components;
-	uint8_t* const line = (uint8_t*)malloc(num_components * width * sizeof(uint8_t));
-	if (line == NULL) {
-		bmpInClose(&bmp_in);
-		err_code = IO_ERR_ALLOC;
-		return err_code;
-	}
+void placeImageComp(ImageComp* const component, uint8_t* const data) {
+	const int lead = (component->x_border + IMAGE_ROW_ALIGNMENT - 1) / IMAGE_ROW_ALIGNMENT * IMAGE_ROW_ALIGNMENT;
+	component->data = data;
+	component->image = data + (size_t)component->y_border * component->stride + lead;
+}
+
+
+Error allocImage(Image* const image, int num_components, int width, int height, int x_border, int y_border) {
+	if (image == NULL) return NULL_IMAGE;
+
+	// Keep the buffers of an image of the same size, so that images can be read one after another without
+	// reallocating; otherwise start afresh
+	if (image->components != NULL && image->num_components == num_components &&
+		image->components[0].width == width && image->components[0].height == height &&
+		image->components[0].x_border == x_border && image->components[0].y_border == y_border) return SUCCESS;
+	freeImage(image);
+
+	// Allocate one block for the components and their data
+	ImageComp layout;
+	const size_t data_size = layoutImageComp(&layout, width, height, x_border, y_border);
+	Error err_code = initArena(&image->arena, arenaAlignSize(num_components * sizeof(ImageComp)) + num_components * arenaAlignSize(data_size));
+	if (err_code != SUCCESS) return err_code;
 
-	// Allocate memory for Image components
+	image->components = (ImageComp*)arenaAlloc(&image->arena, num_components * sizeof(ImageComp));
 	image->num_components = num_components;
-	image->components = (ImageComp*)malloc(num_components * sizeof(ImageComp));
-	if (image->components == NULL) {
-		err_code = IO_ERR_ALLOC;
-		bmpInClose(&bmp_in);
-		free(line);
-		return err_code;
+	for (int p = 0; p < num_components; ++p) {
+		image->components[p] = layout;
+		placeImageComp(image->components + p, (uint8_t*)arenaAlloc(&image->arena, data_size));
 	}
 
-	// Allocate memory for Image data
-	for (int p = 0; p < num_components; ++p) {
-		ImageComp* component = image->components + p;
-		component->width = width;
-		component->height = height;
-		component->x_border = x_border;
-		component->y_border = y_border;
-
-		component->data = (uint8_t*)malloc(total_width * total_height * sizeof(uint8_t));
-		if (component->data == NULL) {
-			err_code = IO_ERR_ALLOC;
-
-			// Ensure only allocated components are freed in freeImage()
-			image->num_components = p;
-
-			bmpInClose(&bmp_in);
-			free(line);
-			return err_code;
+	return SUCCESS;
+}
+
+
+// Rows of an image read or written as separate ranges, each by whichever thread takes it
+typedef struct {
+	Image* image;
+	const BmpIn* bmp_in;
+	const BmpOut* bmp_out;
+	int task_rows;
+	int chunk_rows;			// Rows converted at once, filling the chunk of the executing worker
+	size_t chunk_bytes;
+	uint8_t* chunks;		// One per worker
+	Error err_code;			// Set by any task that fails
+} RowIoJob;
+
+
+// Whether an image of `height` lines of `padded_line_bytes` is worth splitting into row ranges
+static int isParallelIo(const int height, const size_t padded_line_bytes) {
+	return getThreadPoolSize(getSharedThreadPool()) > 1 && (size_t)height * padded_line_bytes >= PARALLEL_IO_MIN_BYTES;
+}
+
+
+// Prepares `job` to split the image into ranges of rows, returning the number of tasks
+static int initRowIoJob(RowIoJob* const job, Arena* const arena, Image* const image, const int height, const size_t padded_line_bytes) {
+	const int num_threads = getThreadPoolSize(getSharedThreadPool());
+	memset(job, 0, sizeof(RowIoJob));
+	job->image = image;
+	job->chunk_rows = (padded_line_bytes < PARALLEL_IO_CHUNK_BYTES) ? (int)(PARALLEL_IO_CHUNK_BYTES / padded_line_bytes) : 1;
+	job->chunk_bytes = (size_t)job->chunk_rows * padded_line_bytes;
+
+	const int num_tasks = num_threads * PARALLEL_IO_TASKS_PER_THREAD;
+	job->task_rows = (height + num_tasks - 1) / num_tasks;
+	if (job->task_rows < job->chunk_rows) job->task_rows = job->chunk_rows;
+
+	if (initArena(arena, num_threads * arenaAlignSize(job->chunk_bytes)) != SUCCESS) return 0;
+	job->chunks = (uint8_t*)arenaAlloc(arena, num_threads * arenaAlignSize(job->chunk_bytes));
+	return (height + job->task_rows - 1) / job->task_rows;
+}
+
+
+static void readRowsTask(void* context, int task, int worker) {
+	RowIoJob* const job = (RowIoJob*)context;
+	const BmpIn* const bmp_in = job->bmp_in;
+	const int num_components = bmp_in->num_components;
+	const size_t padded_line_bytes = (size_t)(bmp_in->line_bytes + bmp_in->alignment_bytes);
+	uint8_t* const chunk = job->chunks + (size_t)worker * arenaAlignSize(job->chunk_bytes);
+
+	const int last = (task + 1) * job->task_rows < bmp_in->rows ? (task + 1) * job->task_rows : bmp_in->rows;
+	for (int first = task * job->task_rows; first < last; first += job->chunk_rows) {
+		const int num_rows = (last - first < job->chunk_rows) ? last - first : job->chunk_rows;
+		const Error err_code = bmpInReadRows(bmp_in, first, num_rows, chunk);
+		if (err_code != SUCCESS) {
+			__atomic_store_n(&job->err_code, err_code, __ATOMIC_RELAXED);
+			return;
+		}
+
+		for (int r = 0; r < num_rows; ++r) {
+			uint8_t* planes[BMP_MAX_COMPONENTS];
+			for (int p = 0; p < num_components; ++p) planes[p] = job->image->components[p].image + (size_t)(first + r) * job->image->components[p].stride;
+			deinterleaveLine(planes, chunk + r * padded_line_bytes, num_components, bmp_in->cols);
 		}
-		component->image = component->data + y_border * total_width + x_border;
 	}
+}
 
-	// Copy BMP pixel data into colour components of Image object
-	for (int r = 0; r < height; ++r) {
-		// Read the input image data into array
-		err_code = bmpInGetLine(&bmp_in, line);
+
+static void writeRowsTask(void* context, int task, int worker) {
+	RowIoJob* const job = (RowIoJob*)context;
+	const BmpOut* const bmp_out = job->bmp_out;
+	const int num_components = bmp_out->num_components;
+	const size_t padded_line_bytes = (size_t)(bmp_out->line_bytes + bmp_out->alignment_bytes);
+	uint8_t* const chunk = job->chunks + (size_t)worker * arenaAlignSize(job->chunk_bytes);
+
+	const int last = (task + 1) * job->task_rows < bmp_out->rows ? (task + 1) * job->task_rows : bmp_out->rows;
+	for (int first = task * job->task_rows; first < last; first += job->chunk_rows) {
+		const int num_rows = (last - first < job->chunk_rows) ? last - first : job->chunk_rows;
+		for (int r = 0; r < num_rows; ++r) {
+			uint8_t* const line = chunk + r * padded_line_bytes;
+			const uint8_t* planes[BMP_MAX_COMPONENTS];
+			for (int p = 0; p < num_components; ++p) planes[p] = job->image->components[p].image + (size_t)(first + r) * job->image->components[p].stride;
+			interleaveLine(line, planes, num_components, bmp_out->cols);
+			memset(line + bmp_out->line_bytes, 0, (size_t)bmp_out->alignment_bytes);
+		}
+
+		const Error err_code = bmpOutWriteRows(bmp_out, first, num_rows, chunk);
 		if (err_code != SUCCESS) {
-			bmpInClose(&bmp_in);
-			free(line);
-			return err_code;
+			__atomic_store_n(&job->err_code, err_code, __ATOMIC_RELAXED);
+			return;
 		}
+	}
+}
 
-		// Read data from array into colour components
-		for (int p = 0; p < num_components; ++p) {
-			uint8_t* src = line + p;
-			uint8_t* const dst = image->components[p].image + r * total_width;
 
-			for (int c = 0; c < width; ++c) {
-				dst[c] = *src;
-				src += num_components;
-			}
-		}
+// Reads every line of `bmp_in` into `image` with row ranges spread over the shared threads
+static Error readRowsParallel(Image* const image, const BmpIn* const bmp_in) {
+	RowIoJob job;
+	Arena arena;
+	const int num_tasks = initRowIoJob(&job, &arena, image, bmp_in->rows, (size_t)(bmp_in->line_bytes + bmp_in->alignment_bytes));
+	if (job.chunks == NULL) {
+		freeArena(&arena);
+		return IO_ERR_ALLOC;
 	}
 
-	// Perform boundary extension
-	err_code = extendBoundary(image);
+	job.bmp_in = bmp_in;
+	runThreadPool(getSharedThreadPool(), num_tasks, readRowsTask, &job);
+	freeArena(&arena);
+	return job.err_code;
+}
+
+
+// Writes every line of `image` to `bmp_out` with row ranges spread over the shared threads
+static Error writeRowsParallel(const Image* const image, const BmpOut* const bmp_out) {
+	RowIoJob job;
+	Arena arena;
+	const int num_tasks = initRowIoJob(&job, &arena, (Image*)image, bmp_out->rows, (size_t)(bmp_out->line_bytes + bmp_out->alignment_bytes));
+	if (job.chunks == NULL) {
+		freeArena(&arena);
+		return IO_ERR_ALLOC;
+	}
+
+	job.bmp_out = bmp_out;
+	runThreadPool(getSharedThreadPool(), num_tasks, writeRowsTask, &job);
+	freeArena(&arena);
+	return job.err_code;
+}
+
+
+// Reads every line of `bmp_in` into `image` in file order on the calling thread
+static Error readRowsInOrder(Image* const image, BmpIn* const bmp_in) {
+	for (int r = 0; r < bmp_in->rows; ++r) {
+		// Access the next line of input image data in place
+		const uint8_t* line;
+		const Error err_code = bmpInGetLineRef(bmp_in, &line);
+		if (err_code != SUCCESS) return err_code;
+
+		// Read data from line into colour components
+		uint8_t* planes[BMP_MAX_COMPONENTS];
+		for (int p = 0; p < image->num_components; ++p) planes[p] = image->components[p].image + (size_t)r * image->components[p].stride;
+		deinterleaveLine(planes, line, image->num_components, bmp_in->cols);
+	}
+
+	return SUCCESS;
+}
+
+
+Error readBmp(Image* const image, const char* const in_file, int x_border, int y_border) {
+	int err_code;
+
+	// Read the input image header
+	BmpIn bmp_in;
+	err_code = bmpInOpen(&bmp_in, in_file);
+	if (err_code != SUCCESS) return err_code;
+
+	const int width = bmp_in.cols;
+	const int height = bmp_in.rows;
+	const int num_components = bmp_in.num_components;
+
+	// Allocate memory for Image components and data
+	err_code = allocImage(image, num_components, width, height, x_border, y_border);
 	if (err_code != SUCCESS) {
 		bmpInClose(&bmp_in);
-		free(line);
 		return err_code;
 	}
 
+	// Copy BMP pixel data into colour components of Image object. Large images are read by row ranges on
+	// every thread, unless a reader thread is already streaming the file.
+	const size_t padded_line_bytes = (size_t)(bmp_in.line_bytes + bmp_in.alignment_bytes);
+	if (bmp_in.regular && bmp_in.ring == NULL && isParallelIo(height, padded_line_bytes)) {
+		err_code = readRowsParallel(image, &bmp_in);
+	} else {
+		err_code = readRowsInOrder(image, &bmp_in);
+	}
+
+	// Perform boundary extension
+	if (err_code == SUCCESS) err_code = extendBoundary(image);
+
 	// Close the input image
 	bmpInClose(&bmp_in);
 
-	free(line);
+	return err_code;
+}
+
+
+// Border mode used by extendBoundary() and by filters reading past the edges of unbordered components
+static BorderMode border_mode = border_mirror;
 
+
+Error setBorderMode(BorderMode mode) {
+	if (mode < border_mirror || mode > border_wrap) return INVALID_COMMAND;
+	border_mode = mode;
 	return SUCCESS;
 }
 
 
+BorderMode getBorderMode(void) {
+	return border_mode;
+}
+
+
 Error extendBoundary(Image* const image) {
 	if (image == NULL) return NULL_IMAGE;
+	if (image->components == NULL) return NULL_IMAGE_COMP;
 
-	const int num_components = image->num_components;
-	const int width = image->components[0].width;
-	const int x_border = image->components[0].x_border;
-	const int total_width = width + 2 * x_border;
-	const int height = image->components[0].height;
-	const int y_border = image->components[0].y_border;
+	for (int p = 0; p < image->num_components; ++p) {
+		Error err_code = extendBoundaryComp(image->components + p);
+		if (err_code != SUCCESS) return err_code;
+	}
+
+	return SUCCESS;
+}
 
-	if (x_border > width || y_border > height) return BORDER_TOO_LARGE;
 
-	for (int p = 0; p < num_components; ++p) {
-		ImageComp* component = image->components + p;
-		if (component == NULL) return NULL_IMAGE_COMP;
-
-		// Extend horizontally
-		for (int r = 0; r < height; ++r) {
-			uint8_t* left_edge = image->components[p].image + r * total_width - 1;
-			uint8_t* right_edge = left_edge + width + 1;
-			for (int c = 0; c < x_border; ++c) {
-				left_edge[-c] = left_edge[c + 1];
-				right_edge[c] = right_edge[-1 - c];
-			}
-		}
+Error extendBoundaryComp(ImageComp* const component) {
+	if (component == NULL) return NULL_IMAGE_COMP;
+
+	const int width = component->width;
+	const int x_border = component->x_border;
+	const int stride = component->stride;
+	const int height = component->height;
+	const int y_border = component->y_border;
+	const BorderMode mode = border_mode;
+	STATS_START(timer);
 
-		// Extend vertically
-		for (int c = 0; c < total_width; ++c) {
-			uint8_t* bottom_edge = image->components[p].data + (y_border - 1) * total_width + c;
-			uint8_t* top_edge = bottom_edge + (height + 1) * total_width;
-			for (int r = 0; r < y_border; ++r) {
-				bottom_edge[-r * total_width] = bottom_edge[(r + 1) * total_width];
-				top_edge[r * total_width] = top_edge[(-1 - r) * total_width];
-			}
+	// Extend horizontally
+	for (int r = 0; r < height; ++r) {
+		uint8_t* const row = component->image + (size_t)r * stride;
+		for (int c = 1; c <= x_border; ++c) {
+			row[-c] = getBorderSample(row, -c, width, mode);
+			row[width - 1 + c] = getBorderSample(row, width - 1 + c, width, mode);
 		}
 	}
 
+	// Extend vertically, a whole row including its horizontal border at a time
+	uint8_t* const first_row = component->image - x_border;
+	const size_t row_bytes = (size_t)(width + 2 * x_border);
+	for (int r = 1; r <= y_border; ++r) {
+		const int above = getBorderIndex(-r, height, mode);
+		const int below = getBorderIndex(height - 1 + r, height, mode);
+		uint8_t* const above_row = first_row - (ptrdiff_t)r * stride;
+		uint8_t* const below_row = first_row + (ptrdiff_t)(height - 1 + r) * stride;
+		if (above < 0) memset(above_row, 0, row_bytes);
+		else memcpy(above_row, first_row + (ptrdiff_t)above * stride, row_bytes);
+		if (below < 0) memset(below_row, 0, row_bytes);
+		else memcpy(below_row, first_row + (ptrdiff_t)below * stride, row_bytes);
+	}
+
+	// Only the border samples are written
+	STATS_STOP(timer, stats_stage_extend, (uint64_t)(width + 2 * x_border) * (height + 2 * y_border) - (uint64_t)width * height);
+	return SUCCESS;
+}
+
+
+// Writes every line of `image` to `bmp_out` in order on the calling thread, building each in place in the output buffer
+static Error writeRowsInOrder(const Image* const image, BmpOut* const bmp_out) {
+	for (int r = 0; r < bmp_out->rows; ++r) {
+		// Copy from plane-separated image object to interleaved BGR array, in place in the output buffer
+		uint8_t* line;
+		Error err_code = bmpOutGetLineRef(bmp_out, &line);
+		if (err_code != SUCCESS) return err_code;
+
+		const uint8_t* planes[BMP_MAX_COMPONENTS];
+		for (int p = 0; p < image->num_components; ++p) planes[p] = image->components[p].image + (size_t)r * image->components[p].stride;
+		interleaveLine(line, planes, image->num_components, bmp_out->cols);
+
+		// Write data from array into output image
+		err_code = bmpOutWriteLine(bmp_out, line);
+		if (err_code != SUCCESS) return err_code;
+	}
+
 	return SUCCESS;
 }
 
@@ -165,42 +357,24 @@ Error writeBmp(const Image* const image, const char* const out_file) {
 	// Retrieve image component properties
 	const int width = image->components[0].width;
 	const int height = image->components[0].height;
-	const int total_width = width + 2 * image->components[0].x_border;
 	const int num_components = image->num_components;
 
 	BmpOut bmp_out;
 	err_code = bmpOutOpen(&bmp_out, out_file, width, height, num_components);
 	if (err_code != SUCCESS) return err_code;
 
-	uint8_t* const line = (uint8_t*)malloc(num_components * width * sizeof(uint8_t));
-	if (line == NULL) {
-		err_code = IO_ERR_ALLOC;
-		return err_code;
+	// Large images are written by row ranges on every thread, unless the output is a pipe or a writer thread is
+	// taking it in order
+	const size_t padded_line_bytes = (size_t)(bmp_out.line_bytes + bmp_out.alignment_bytes);
+	if (bmp_out.regular && bmp_out.ring == NULL && isParallelIo(height, padded_line_bytes)) {
+		err_code = writeRowsParallel(image, &bmp_out);
+	} else {
+		err_code = writeRowsInOrder(image, &bmp_out);
 	}
 
-	for (int r = 0; r < height; ++r) {
-		// Copy from plane-separated image object to interleaved BGR array
-		for (int p = 0; p < num_components; ++p) {
-			uint8_t* const src = image->components[p].image + r * total_width;
-			uint8_t* dst = line + p;
-
-			for (int c = 0; c < width; ++c) {
-				*dst = src[c];
-				dst += num_components;
-			}
-		}
+	// The header, and any lines still buffered, are written on closing
+	const Error close_err = bmpOutClose(&bmp_out);
+	if (err_code == SUCCESS) err_code = close_err;
 
-		// Write data from array into output image
-		err_code = bmpOutWriteLine(&bmp_out, line);
-		if (err_code != SUCCESS) {
-			free(line);
-			bmpOutClose(&bmp_out);
-			return err_code;
-		}
-	}
-
-	bmpOutClose(&bmp_out);
-	free(line);
-
-	return SUCCESS;
-}
\ No newline at end of file
+	return err_code;
+}
@@ -0,0 +1,225 @@
+#include "string.h"
+#include "interleave.h"
+#include "convolve.h"
+#include "stats_hooks.h"
+
+
+static void deinterleaveScalar(uint8_t* const* planes, const uint8_t* line, int num_components, int first, int width) {
+	for (int p = 0; p < num_components; ++p) {
+		const uint8_t* src = line + first * num_components + p;
+		uint8_t* const dst = planes[p];
+		for (int c = first; c < width; ++c) {
+			dst[c] = *src;
+			src += num_components;
+		}
+	}
+}
+
+
+static void interleaveScalar(uint8_t* line, const uint8_t* const* planes, int num_components, int first, int width) {
+	for (int p = 0; p < num_components; ++p) {
+		const uint8_t* const src = planes[p];
+		uint8_t* dst = line + first * num_components + p;
+		for (int c = first; c < width; ++c) {
+			*dst = src[c];
+			dst += num_components;
+		}
+	}
+}
+
+
+#ifdef CONV_HAVE_X86
+
+#include "pthread.h"
+#include "immintrin.h"
+
+// Shuffle controls for three-component lines, built once by initInterleave()
+static int8_t ssse3_split[3][3][16];	// [plane][input vector]: pshufb control selecting the plane's samples
+static int8_t ssse3_merge[3][3][16];	// [output vector][plane]: pshufb control placing the plane's samples
+static uint8_t vbmi_split[3][2][64];	// [plane][step]: vpermi2b indices gathering from two then three vectors
+static uint8_t vbmi_merge[3][2][64];	// [output vector][step]: as above, from the blue and green then red planes
+static int has_ssse3 = 0;
+static int has_vbmi = 0;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+
+static void initInterleave(void) {
+	__builtin_cpu_init();
+	has_ssse3 = __builtin_cpu_supports("ssse3");
+	has_vbmi = __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vbmi");
+
+	// Byte `i` of plane `p` is byte 3i + p of the line
+	for (int p = 0; p < 3; ++p) {
+		for (int v = 0; v < 3; ++v) {
+			for (int i = 0; i < 16; ++i) {
+				const int src = 3 * i + p - 16 * v;
+				ssse3_split[p][v][i] = (src >= 0 && src < 16) ? (int8_t)src : (int8_t)-128;
+			}
+		}
+		for (int i = 0; i < 64; ++i) {
+			const int src = 3 * i + p;
+			vbmi_split[p][0][i] = (src < 128) ? (uint8_t)src : 0;
+			vbmi_split[p][1][i] = (src < 128) ? (uint8_t)i : (uint8_t)(64 + src - 128);
+		}
+	}
+
+	// Byte `j` of the line is byte j / 3 of plane j % 3
+	for (int k = 0; k < 3; ++k) {
+		for (int q = 0; q < 3; ++q) {
+			for (int j = 0; j < 16; ++j) {
+				const int dst = 16 * k + j;
+				ssse3_merge[k][q][j] = (dst % 3 == q) ? (int8_t)(dst / 3) : (int8_t)-128;
+			}
+		}
+		for (int j = 0; j < 64; ++j) {
+			const int dst = 64 * k + j;
+			const int i = dst / 3;
+			vbmi_merge[k][0][j] = (dst % 3 == 0) ? (uint8_t)i : (dst % 3 == 1) ? (uint8_t)(64 + i) : 0;
+			vbmi_merge[k][1][j] = (dst % 3 == 2) ? (uint8_t)(64 + i) : (uint8_t)j;
+		}
+	}
+}
+
+
+__attribute__((target("ssse3")))
+static int deinterleave3Ssse3(uint8_t* const* planes, const uint8_t* line, int width) {
+	__m128i masks[3][3];
+	for (int p = 0; p < 3; ++p) {
+		for (int v = 0; v < 3; ++v) masks[p][v] = _mm_loadu_si128((const __m128i*)ssse3_split[p][v]);
+	}
+
+	int c = 0;
+	for (; c + 16 <= width; c += 16) {
+		const __m128i a = _mm_loadu_si128((const __m128i*)(line + 3 * c));
+		const __m128i b = _mm_loadu_si128((const __m128i*)(line + 3 * c + 16));
+		const __m128i d = _mm_loadu_si128((const __m128i*)(line + 3 * c + 32));
+		for (int p = 0; p < 3; ++p) {
+			const __m128i ab = _mm_or_si128(_mm_shuffle_epi8(a, masks[p][0]), _mm_shuffle_epi8(b, masks[p][1]));
+			_mm_storeu_si128((__m128i*)(planes[p] + c), _mm_or_si128(ab, _mm_shuffle_epi8(d, masks[p][2])));
+		}
+	}
+	return c;
+}
+
+
+__attribute__((target("ssse3")))
+static int interleave3Ssse3(uint8_t* line, const uint8_t* const* planes, int width) {
+	__m128i masks[3][3];
+	for (int k = 0; k < 3; ++k) {
+		for (int q = 0; q < 3; ++q) masks[k][q] = _mm_loadu_si128((const __m128i*)ssse3_merge[k][q]);
+	}
+
+	int c = 0;
+	for (; c + 16 <= width; c += 16) {
+		const __m128i blue = _mm_loadu_si128((const __m128i*)(planes[0] + c));
+		const __m128i green = _mm_loadu_si128((const __m128i*)(planes[1] + c));
+		const __m128i red = _mm_loadu_si128((const __m128i*)(planes[2] + c));
+		for (int k = 0; k < 3; ++k) {
+			const __m128i bg = _mm_or_si128(_mm_shuffle_epi8(blue, masks[k][0]), _mm_shuffle_epi8(green, masks[k][1]));
+			_mm_storeu_si128((__m128i*)(line + 3 * c + 16 * k), _mm_or_si128(bg, _mm_shuffle_epi8(red, masks[k][2])));
+		}
+	}
+	return c;
+}
+
+
+__attribute__((target("avx512f,avx512bw,avx512vbmi")))
+static int deinterleave3Vbmi(uint8_t* const* planes, const uint8_t* line, int width) {
+	__m512i indices[3][2];
+	for (int p = 0; p < 3; ++p) {
+		for (int s = 0; s < 2; ++s) indices[p][s] = _mm512_loadu_si512(vbmi_split[p][s]);
+	}
+
+	int c = 0;
+	for (; c + 64 <= width; c += 64) {
+		const __m512i a = _mm512_loadu_si512(line + 3 * c);
+		const __m512i b = _mm512_loadu_si512(line + 3 * c + 64);
+		const __m512i d = _mm512_loadu_si512(line + 3 * c + 128);
+		for (int p = 0; p < 3; ++p) {
+			const __m512i ab = _mm512_permutex2var_epi8(a, indices[p][0], b);
+			_mm512_storeu_si512(planes[p] + c, _mm512_permutex2var_epi8(ab, indices[p][1], d));
+		}
+	}
+	return c;
+}
+
+
+__attribute__((target("avx512f,avx512bw,avx512vbmi")))
+static int interleave3Vbmi(uint8_t* line, const uint8_t* const* planes, int width) {
+	__m512i indices[3][2];
+	for (int k = 0; k < 3; ++k) {
+		for (int s = 0; s < 2; ++s) indices[k][s] = _mm512_loadu_si512(vbmi_merge[k][s]);
+	}
+
+	int c = 0;
+	for (; c + 64 <= width; c += 64) {
+		const __m512i blue = _mm512_loadu_si512(planes[0] + c);
+		const __m512i green = _mm512_loadu_si512(planes[1] + c);
+		const __m512i red = _mm512_loadu_si512(planes[2] + c);
+		for (int k = 0; k < 3; ++k) {
+			const __m512i bg = _mm512_permutex2var_epi8(blue, indices[k][0], green);
+			_mm512_storeu_si512(line + 3 * c + 64 * k, _mm512_permutex2var_epi8(bg, indices[k][1], red));
+		}
+	}
+	return c;
+}
+
+#endif // CONV_HAVE_X86
+
+
+static void splitLine(uint8_t* const* planes, const uint8_t* line, int num_components, int width) {
+	if (num_components == 1) {
+		memcpy(planes[0], line, (size_t)width);
+		return;
+	}
+
+	int first = 0;
+#ifdef CONV_HAVE_X86
+	if (num_components == 3) {
+		pthread_once(&init_once, initInterleave);
+		const SimdLevel limit = getSimdLimit();
+		if (has_vbmi && (limit == simd_auto || limit >= simd_avx512)) first = deinterleave3Vbmi(planes, line, width);
+		if (has_ssse3 && (limit == simd_auto || limit >= simd_sse41)) {
+			uint8_t* const rest[3] = { planes[0] + first, planes[1] + first, planes[2] + first };
+			first += deinterleave3Ssse3(rest, line + 3 * first, width - first);
+		}
+	}
+#endif
+	deinterleaveScalar(planes, line, num_components, first, width);
+}
+
+
+void deinterleaveLine(uint8_t* const* planes, const uint8_t* line, int num_components, int width) {
+	STATS_START(timer);
+	splitLine(planes, line, num_components, width);
+	STATS_STOP(timer, stats_stage_deinterleave, width);
+}
+
+
+static void mergeLine(uint8_t* line, const uint8_t* const* planes, int num_components, int width) {
+	if (num_components == 1) {
+		memcpy(line, planes[0], (size_t)width);
+		return;
+	}
+
+	int first = 0;
+#ifdef CONV_HAVE_X86
+	if (num_components == 3) {
+		pthread_once(&init_once, initInterleave);
+		const SimdLevel limit = getSimdLimit();
+		if (has_vbmi && (limit == simd_auto || limit >= simd_avx512)) first = interleave3Vbmi(line, planes, width);
+		if (has_ssse3 && (limit == simd_auto || limit >= simd_sse41)) {
+			const uint8_t* const rest[3] = { planes[0] + first, planes[1] + first, planes[2] + first };
+			first += interleave3Ssse3(line + 3 * first, rest, width - first);
+		}
+	}
+#endif
+	interleaveScalar(line, planes, num_components, first, width);
+}
+
+
+void interleaveLine(uint8_t* line, const uint8_t* const* planes, int num_components, int width) {
+	STATS_START(timer);
+	mergeLine(line, planes, num_components, width);
+	STATS_STOP(timer, stats_stage_interleave, width);
+}
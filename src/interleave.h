@@ -0,0 +1,17 @@
+#ifndef INTERLEAVE_H
+#define INTERLEAVE_H
+
+#include "stdint.h"
+
+/*  Conversion between interleaved BMP lines and separate colour planes.
+	Three-component lines use byte-shuffle kernels (SSSE3 pshufb, or
+	AVX-512 VBMI vpermb where available, subject to `setSimdLevel()') that
+	split or merge every plane in a single pass over the line. */
+
+// Splits a line of `width` pixels with `num_components` interleaved samples into `planes`
+void deinterleaveLine(uint8_t* const* planes, const uint8_t* line, int num_components, int width);
+
+// Merges `width` pixels from `num_components` planes into an interleaved line
+void interleaveLine(uint8_t* line, const uint8_t* const* planes, int num_components, int width);
+
+#endif // INTERLEAVE_H
@@ -1,6 +1,32 @@
+#ifdef __linux__
+#define _GNU_SOURCE // For fallocate()
+#include "fcntl.h"
+#endif
+
 #include "string.h"
 #include "io_bmp.h"
 #include "error.h"
+#include "stats_hooks.h"
+#include "io_ring.h"
+
+// Alignment of the output buffer, matching the page size so chunks can be handed to the kernel directly
+#define BMP_OUT_ALIGNMENT 4096
+
+#if defined(__unix__) || defined(__APPLE__)
+#define BMP_HAVE_MMAP 1
+#define BMP_HAVE_PREAD 1
+#include "sys/mman.h"
+#include "sys/stat.h"
+#include "unistd.h"
+#endif
+
+// Whether files are opened with reader and writer threads
+static int use_async_io = 0;
+
+
+void setBmpAsyncIo(int enabled) {
+	use_async_io = enabled;
+}
 
 static void toLittleEndian(int32_t* words, int num_words) {
 	const int32_t test = 1; // 4-byte value
@@ -15,13 +41,42 @@ static void toLittleEndian(int32_t* words, int num_words) {
 			((tmp << 8) & 0x00FF0000) +
 			((tmp << 24) & 0xFF000000);
 		++words;
+		--num_words;
 	}
 }
 
-int bmpInOpen(BmpIn* const bmp_in, const char* const fname) {
-	// Reset everything
-	memset(bmp_in, 0, sizeof(BmpIn));
+// Skips `num_bytes` bytes of input without seeking, so that pipes can be read
+static int skipBytes(FILE* const in, long num_bytes) {
+	uint8_t buf[256];
+	while (num_bytes > 0) {
+		const size_t chunk = (num_bytes < (long)sizeof(buf)) ? (size_t)num_bytes : sizeof(buf);
+		if (fread(buf, 1, chunk, in) != chunk) return IO_ERR_FILE_TRUNC;
+		num_bytes -= (long)chunk;
+	}
+	return SUCCESS;
+}
+
+// Maps the whole input file if it is a regular file, leaving `bmp_in->map` NULL otherwise
+static void mapInput(BmpIn* const bmp_in, const long offset) {
+#ifdef BMP_HAVE_MMAP
+	const int fd = fileno(bmp_in->in);
+	struct stat info;
+	if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode) || info.st_size < offset) return;
 
+	void* const map = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) return;
+	madvise(map, (size_t)info.st_size, MADV_SEQUENTIAL);
+
+	bmp_in->map = (const uint8_t*)map;
+	bmp_in->map_size = (size_t)info.st_size;
+	bmp_in->next_line = bmp_in->map + offset;
+#else
+	(void)bmp_in;
+	(void)offset;
+#endif
+}
+
+static int openBmpIn(BmpIn* const bmp_in, const char* const fname) {
 	// Open file in read-binary mode
 	bmp_in->in = fopen(fname, "rb");
 	if (bmp_in->in == NULL) return(IO_ERR_NO_FILE);
@@ -40,6 +95,7 @@ int bmpInOpen(BmpIn* const bmp_in, const char* const fname) {
 	toLittleEndian((int32_t*)&info_header, 10);
 	bmp_in->cols = info_header.width;
 	bmp_in->rows = info_header.height;
+	if (bmp_in->cols <= 0 || bmp_in->rows < 0) return(IO_ERR_FILE_HEADER); // Top-down images are not supported
 	int bit_count = (info_header.planes_bits >> 16);
 	if (bit_count == 24) bmp_in->num_components = 3;
 	else if (bit_count == 8) bmp_in->num_components = 1;
@@ -57,25 +113,104 @@ int bmpInOpen(BmpIn* const bmp_in, const char* const fname) {
 	offset <<= BITS_IN_BYTE; offset += file_header[11];
 	offset <<= BITS_IN_BYTE; offset += file_header[10];
 	if (offset < header_size) return(IO_ERR_FILE_HEADER);
-	if (palette_entries_used) fseek(bmp_in->in, palette_entries_used * 4, SEEK_CUR); // Skip over palette
-	if (offset > header_size) fseek(bmp_in->in, offset - header_size, SEEK_CUR);
+	STATS_COUNT(stats_bytes_read, offset);
+	bmp_in->data_offset = offset;
+#ifdef BMP_HAVE_PREAD
+	struct stat info;
+	bmp_in->regular = fstat(fileno(bmp_in->in), &info) == 0 && S_ISREG(info.st_mode);
+#endif
 	bmp_in->num_unread_rows = bmp_in->rows;
 	bmp_in->line_bytes = bmp_in->num_components * bmp_in->cols;
 	bmp_in->alignment_bytes = (4 - bmp_in->line_bytes) & 3; // Pad to a multiple of 4 bytes
+
+	// Access lines in place if possible, otherwise skip over the palette and any gap to the first line
+	if (!use_async_io) mapInput(bmp_in, offset);
+	if (bmp_in->map != NULL) return SUCCESS;
+	const int err_code = skipBytes(bmp_in->in, offset - BMP_TOTAL_HEADER_SIZE);
+	if (err_code != SUCCESS) return err_code;
+
+	// Chunks of whole lines, so that lines never straddle two chunks
+	if (use_async_io && bmp_in->rows > 0 && bmp_in->line_bytes > 0) {
+		const size_t padded_line_bytes = (size_t)(bmp_in->line_bytes + bmp_in->alignment_bytes);
+		const size_t chunk_lines = (padded_line_bytes < BMP_ASYNC_CHUNK_SIZE) ? BMP_ASYNC_CHUNK_SIZE / padded_line_bytes : 1;
+		startIoReader(&bmp_in->ring, bmp_in->in, chunk_lines * padded_line_bytes, BMP_ASYNC_CHUNKS,
+			(size_t)bmp_in->rows * padded_line_bytes);
+		if (bmp_in->ring != NULL) return SUCCESS;
+	}
+
+	bmp_in->buffer = (uint8_t*)malloc((size_t)bmp_in->line_bytes);
+	if (bmp_in->buffer == NULL) return(IO_ERR_ALLOC);
+	STATS_COUNT(stats_allocations, 1);
+	STATS_COUNT(stats_allocated_bytes, bmp_in->line_bytes);
 	return SUCCESS;
 }
 
 
+int bmpInOpen(BmpIn* const bmp_in, const char* const fname) {
+	// Reset everything
+	memset(bmp_in, 0, sizeof(BmpIn));
+
+	STATS_START(timer);
+	const int err_code = openBmpIn(bmp_in, fname);
+	if (err_code != SUCCESS) bmpInClose(bmp_in);
+	STATS_STOP(timer, stats_stage_read, 0);
+	return err_code;
+}
+
+
 void bmpInClose(BmpIn* const bmp_in) {
+	STATS_START(timer);
+	stopIoRing(bmp_in->ring);
+#ifdef BMP_HAVE_MMAP
+	if (bmp_in->map != NULL) munmap((void*)bmp_in->map, bmp_in->map_size);
+#endif
 	if (bmp_in->in != NULL) fclose(bmp_in->in);
+	free(bmp_in->buffer);
 	memset(bmp_in, 0, sizeof(BmpIn));
+	STATS_STOP(timer, stats_stage_read, 0);
 }
 
-int bmpInGetLine(BmpIn* const bmp_in, uint8_t* const line) {
-	// Read next line
+static int readBmpInLine(BmpIn* const bmp_in, const uint8_t** const line) {
 	if ((bmp_in->in == NULL) || (line == NULL) || (bmp_in->num_unread_rows <= 0)) return(IO_ERR_FILE_NOT_OPEN);
 	bmp_in->num_unread_rows--;
-	if (fread(line, 1, (size_t)bmp_in->line_bytes, bmp_in->in) != (size_t)bmp_in->line_bytes) return(IO_ERR_FILE_TRUNC);
+
+	// Point into the mapping
+	if (bmp_in->map != NULL) {
+		const size_t remaining = (size_t)(bmp_in->map + bmp_in->map_size - bmp_in->next_line);
+		if (remaining < (size_t)bmp_in->line_bytes) return(IO_ERR_FILE_TRUNC);
+		*line = bmp_in->next_line;
+		bmp_in->next_line += bmp_in->line_bytes;
+
+		// Skip padding
+		if (bmp_in->num_unread_rows > 0) {
+			if (remaining - bmp_in->line_bytes < (size_t)bmp_in->alignment_bytes) return(IO_ERR_FILE_TRUNC);
+			bmp_in->next_line += bmp_in->alignment_bytes;
+		}
+		return SUCCESS;
+	}
+
+	// Take the next line from the reader thread's chunk, moving to its next chunk once this one is used up
+	if (bmp_in->ring != NULL) {
+		if (bmp_in->chunk_left < (size_t)bmp_in->line_bytes) {
+			bmp_in->chunk_left = takeIoChunk(bmp_in->ring, &bmp_in->chunk);
+			if (bmp_in->chunk_left < (size_t)bmp_in->line_bytes) return(IO_ERR_FILE_TRUNC);
+		}
+		*line = bmp_in->chunk;
+		bmp_in->chunk += bmp_in->line_bytes;
+		bmp_in->chunk_left -= bmp_in->line_bytes;
+
+		// Skip padding, which the last line may lack
+		if (bmp_in->num_unread_rows > 0) {
+			if (bmp_in->chunk_left < (size_t)bmp_in->alignment_bytes) return(IO_ERR_FILE_TRUNC);
+			bmp_in->chunk += bmp_in->alignment_bytes;
+			bmp_in->chunk_left -= bmp_in->alignment_bytes;
+		}
+		return SUCCESS;
+	}
+
+	// Read next line
+	if (fread(bmp_in->buffer, 1, (size_t)bmp_in->line_bytes, bmp_in->in) != (size_t)bmp_in->line_bytes) return(IO_ERR_FILE_TRUNC);
+	*line = bmp_in->buffer;
 
 	// Read padding
 	if (bmp_in->alignment_bytes > 0) {
@@ -85,11 +220,109 @@ int bmpInGetLine(BmpIn* const bmp_in, uint8_t* const line) {
 	return SUCCESS;
 }
 
-int bmpOutOpen(BmpOut* const bmp_out, const char* const fname, const int width, const int height, const int num_components) {
+int bmpInGetLineRef(BmpIn* const bmp_in, const uint8_t** const line) {
+	STATS_START(timer);
+	const int err_code = readBmpInLine(bmp_in, line);
+	if (err_code == SUCCESS) STATS_COUNT(stats_bytes_read, bmp_in->line_bytes + bmp_in->alignment_bytes);
+	STATS_STOP(timer, stats_stage_read, (err_code == SUCCESS) ? bmp_in->cols : 0);
+	return err_code;
+}
 
-	// Reset everything
-	memset(bmp_out, 0, sizeof(BmpOut));
+#ifdef BMP_HAVE_PREAD
+// Reads `num_bytes` at `offset` with as many pread() calls as it takes, returning the bytes read
+static size_t readAt(const int fd, uint8_t* buffer, size_t num_bytes, off_t offset) {
+	size_t done = 0;
+	while (done < num_bytes) {
+		const ssize_t n = pread(fd, buffer + done, num_bytes - done, offset + (off_t)done);
+		if (n <= 0) break;
+		done += (size_t)n;
+	}
+	return done;
+}
+#endif
+
+static int readBmpInRows(const BmpIn* const bmp_in, const int first_row, const int num_rows, uint8_t* const buffer) {
+	if ((bmp_in->in == NULL) || (buffer == NULL) || (first_row < 0) || (num_rows < 0) || (first_row + num_rows > bmp_in->rows)) return(IO_ERR_FILE_NOT_OPEN);
+	if (!bmp_in->regular) return(IO_ERR_UNSUPPORTED);
+#ifdef BMP_HAVE_PREAD
+	const size_t padded_line_bytes = (size_t)(bmp_in->line_bytes + bmp_in->alignment_bytes);
+	const size_t num_bytes = (size_t)num_rows * padded_line_bytes;
+	const off_t offset = (off_t)bmp_in->data_offset + (off_t)first_row * (off_t)padded_line_bytes;
+	const size_t num_read = readAt(fileno(bmp_in->in), buffer, num_bytes, offset);
+
+	// The padding of the last line may be missing
+	const int has_last_row = first_row + num_rows == bmp_in->rows;
+	if (num_read < num_bytes - (has_last_row ? (size_t)bmp_in->alignment_bytes : 0)) return(IO_ERR_FILE_TRUNC);
+	STATS_COUNT(stats_bytes_read, num_read);
+	return SUCCESS;
+#else
+	return(IO_ERR_UNSUPPORTED);
+#endif
+}
+
+int bmpInReadRows(const BmpIn* const bmp_in, const int first_row, const int num_rows, uint8_t* const buffer) {
+	STATS_START(timer);
+	const int err_code = readBmpInRows(bmp_in, first_row, num_rows, buffer);
+	STATS_STOP(timer, stats_stage_read, (err_code == SUCCESS) ? (uint64_t)num_rows * bmp_in->cols : 0);
+	return err_code;
+}
 
+int bmpInGetLine(BmpIn* const bmp_in, uint8_t* const line) {
+	if (line == NULL) return(IO_ERR_FILE_NOT_OPEN);
+
+	const uint8_t* src;
+	const int err_code = bmpInGetLineRef(bmp_in, &src);
+	if (err_code != SUCCESS) return err_code;
+
+	memcpy(line, src, (size_t)bmp_in->line_bytes);
+	return SUCCESS;
+}
+
+// Writes out everything collected in the output buffer
+static int flushBmpOut(BmpOut* const bmp_out) {
+	const size_t num_bytes = bmp_out->buffer_used;
+	bmp_out->buffer_used = 0;
+	if (num_bytes == 0) return SUCCESS;
+
+	// Hand the buffer to the writer thread and carry on in the next free one
+	if (bmp_out->ring != NULL) {
+		const int err_code = submitIoBuffer(bmp_out->ring, num_bytes);
+		bmp_out->buffer = getIoBuffer(bmp_out->ring);
+		if (err_code != SUCCESS) return err_code;
+		STATS_COUNT(stats_bytes_written, num_bytes);
+		return SUCCESS;
+	}
+
+	if (fwrite(bmp_out->buffer, 1, num_bytes, bmp_out->out) != num_bytes) return IO_ERR_FILE_TRUNC;
+	STATS_COUNT(stats_bytes_written, num_bytes);
+	return SUCCESS;
+}
+
+// Allocates the output buffer, of `bmp_out->buffer_size` bytes
+static int allocBmpOutBuffer(BmpOut* const bmp_out) {
+	bmp_out->buffer = (uint8_t*)aligned_alloc(BMP_OUT_ALIGNMENT, bmp_out->buffer_size);
+	if (bmp_out->buffer == NULL) return(IO_ERR_ALLOC);
+	STATS_COUNT(stats_allocations, 1);
+	STATS_COUNT(stats_allocated_bytes, bmp_out->buffer_size);
+	return SUCCESS;
+}
+
+// Whether the output buffer must be written out to make room for another line
+static int isBmpOutFull(const BmpOut* const bmp_out) {
+	const size_t padded_line_bytes = (size_t)(bmp_out->line_bytes + bmp_out->alignment_bytes);
+	return bmp_out->buffer_used + padded_line_bytes > bmp_out->buffer_size;
+}
+
+// Makes room for the next line and its padding, returning where it goes
+static int reserveBmpOutLine(BmpOut* const bmp_out, uint8_t** const line) {
+	if (isBmpOutFull(bmp_out)) {
+		if (flushBmpOut(bmp_out) != SUCCESS) return IO_ERR_FILE_TRUNC;
+	}
+	*line = bmp_out->buffer + bmp_out->buffer_used;
+	return SUCCESS;
+}
+
+static int openBmpOut(BmpOut* const bmp_out, const char* const fname, const int width, const int height, const int num_components) {
 	bmp_out->num_components = num_components;
 	bmp_out->rows = bmp_out->num_unwritten_rows = height;
 	bmp_out->cols = width;
@@ -99,12 +332,14 @@ int bmpOutOpen(BmpOut* const bmp_out, const char* const fname, const int width,
 	assert(header_bytes == BMP_TOTAL_HEADER_SIZE);
 	if (num_components == 1) header_bytes += 1024; // Include colour lookup table
 	else if (num_components != 3) return(IO_ERR_UNSUPPORTED);
+	if (width <= 0 || height < 0) return(IO_ERR_UNSUPPORTED); // Negative sizes would wrap the buffer size below
 
 	bmp_out->line_bytes = num_components * width;
 	bmp_out->alignment_bytes = (4 - bmp_out->line_bytes) & 3;
+	bmp_out->data_offset = header_bytes;
 
-	// Prepare file header
-	const int file_bytes = header_bytes + (bmp_out->line_bytes + bmp_out->alignment_bytes) * bmp_out->rows;
+	// Prepare file header. Files of 4 GiB or more keep only the low 32 bits of their size, which readers ignore.
+	const uint64_t file_bytes = (uint64_t)header_bytes + (uint64_t)(bmp_out->line_bytes + bmp_out->alignment_bytes) * (uint64_t)bmp_out->rows;
 	file_header[0] = 'B'; file_header[1] = 'M';
 	file_header[2] = (uint8_t)file_bytes;
 	file_header[3] = (uint8_t)(file_bytes >> 8);
@@ -126,41 +361,160 @@ int bmpOutOpen(BmpOut* const bmp_out, const char* const fname, const int width,
 	info_header.num_colours_used = info_header.num_colours_important = 0;
 	toLittleEndian((int32_t*)&info_header, 10);
 
+	// Size the buffer to hold the header and at least one line, but no more than the whole file. A writer
+	// thread gets smaller buffers, so that it starts sooner and the caller waits less for a free one.
+	const size_t padded_line_bytes = (size_t)(bmp_out->line_bytes + bmp_out->alignment_bytes);
+	const size_t chunk_size = use_async_io ? BMP_ASYNC_CHUNK_SIZE : BMP_OUT_BUFFER_SIZE;
+	size_t buffer_size = (file_bytes < (uint64_t)chunk_size) ? (size_t)file_bytes : chunk_size;
+	if (buffer_size < (size_t)header_bytes) buffer_size = (size_t)header_bytes;
+	if (buffer_size < padded_line_bytes) buffer_size = padded_line_bytes;
+	buffer_size = (buffer_size + BMP_OUT_ALIGNMENT - 1) & ~(size_t)(BMP_OUT_ALIGNMENT - 1);
+	bmp_out->buffer_size = buffer_size;
+	if (!use_async_io && allocBmpOutBuffer(bmp_out) != SUCCESS) return(IO_ERR_ALLOC);
+
 	// Open file in write-binary mode
 	bmp_out->out = fopen(fname, "wb");
-	if (bmp_out->out == NULL) return(IO_ERR_NO_FILE);
+	if (bmp_out->out == NULL) {
+		free(bmp_out->buffer);
+		bmp_out->buffer = NULL;
+		return(IO_ERR_NO_FILE);
+	}
+	setvbuf(bmp_out->out, NULL, _IONBF, 0);
+#ifdef BMP_HAVE_PREAD
+	struct stat info;
+	bmp_out->regular = fstat(fileno(bmp_out->out), &info) == 0 && S_ISREG(info.st_mode);
+#endif
+#ifdef __linux__
+	fallocate(fileno(bmp_out->out), 0, 0, (off_t)file_bytes); // Only a hint: fails harmlessly on pipes and some file systems
+#endif
+
+	// Fill the writer thread's buffers, or write directly if it cannot be started
+	if (use_async_io) {
+		startIoWriter(&bmp_out->ring, bmp_out->out, buffer_size, BMP_ASYNC_CHUNKS);
+		if (bmp_out->ring != NULL) bmp_out->buffer = getIoBuffer(bmp_out->ring);
+		else if (allocBmpOutBuffer(bmp_out) != SUCCESS) {
+			fclose(bmp_out->out);
+			bmp_out->out = NULL;
+			return(IO_ERR_ALLOC);
+		}
+	}
 
-	// Write header
-	fwrite(file_header, 1, BMP_FILE_HEADER_SIZE, bmp_out->out);
-	fwrite(&info_header, 1, BMP_INFO_HEADER_SIZE, bmp_out->out);
+	// Collect header
+	memcpy(bmp_out->buffer, file_header, BMP_FILE_HEADER_SIZE);
+	memcpy(bmp_out->buffer + BMP_FILE_HEADER_SIZE, &info_header, BMP_INFO_HEADER_SIZE);
+	bmp_out->buffer_used = BMP_TOTAL_HEADER_SIZE;
 
-	// Write grey-scale palette
+	// Collect grey-scale palette
 	if (num_components == 1) {
+		uint8_t* const palette = bmp_out->buffer + bmp_out->buffer_used;
 		for (int n = 0; n < 256; n++) {
-			fputc(n, bmp_out->out);
-			fputc(n, bmp_out->out);
-			fputc(n, bmp_out->out);
-			fputc(0, bmp_out->out);
+			palette[4 * n] = palette[4 * n + 1] = palette[4 * n + 2] = (uint8_t)n;
+			palette[4 * n + 3] = 0;
 		}
+		bmp_out->buffer_used += 1024;
 	}
 	return SUCCESS;
 }
 
-void bmpOutClose(BmpOut* const bmp_out) {
-	if (bmp_out->out != NULL) fclose(bmp_out->out);
+int bmpOutOpen(BmpOut* const bmp_out, const char* const fname, const int width, const int height, const int num_components) {
+
+	// Reset everything
 	memset(bmp_out, 0, sizeof(BmpOut));
+
+	STATS_START(timer);
+	const int err_code = openBmpOut(bmp_out, fname, width, height, num_components);
+	STATS_STOP(timer, stats_stage_write, 0);
+	return err_code;
 }
 
-int bmpOutWriteLine(BmpOut* const bmp_out, const uint8_t* const line) {
-	// Write next line
+int bmpOutClose(BmpOut* const bmp_out) {
+	STATS_START(timer);
+	int err_code = SUCCESS;
+	if (bmp_out->out != NULL && bmp_out->buffer != NULL) err_code = flushBmpOut(bmp_out);
+
+	// The writer thread finishes what it was given and takes its buffers with it
+	if (bmp_out->ring != NULL) {
+		if (err_code == SUCCESS) err_code = drainIoRing(bmp_out->ring);
+		stopIoRing(bmp_out->ring);
+		bmp_out->buffer = NULL;
+	}
+	if (bmp_out->out != NULL && fclose(bmp_out->out) != 0 && err_code == SUCCESS) err_code = IO_ERR_FILE_TRUNC;
+	free(bmp_out->buffer);
+	memset(bmp_out, 0, sizeof(BmpOut));
+	STATS_STOP(timer, stats_stage_write, 0);
+	return err_code;
+}
+
+static int writeBmpOutLine(BmpOut* const bmp_out, const uint8_t* const line) {
 	if ((bmp_out->out == NULL) || (line == NULL) || (bmp_out->num_unwritten_rows <= 0)) return(IO_ERR_FILE_NOT_OPEN);
 	bmp_out->num_unwritten_rows--;
-	if (fwrite(line, 1, (size_t)bmp_out->line_bytes, bmp_out->out) != (size_t)bmp_out->line_bytes) return IO_ERR_FILE_TRUNC;
 
-	// Write padding
-	if (bmp_out->alignment_bytes > 0) {
-		const uint8_t buf[3] = { 0,0,0 };
-		fwrite(buf, 1, (size_t)bmp_out->alignment_bytes, bmp_out->out);
+	// Collect next line and padding, unless it was filled in place
+	uint8_t* dst;
+	if (line == bmp_out->reserved_line) {
+		dst = bmp_out->reserved_line;
+	} else {
+		if (reserveBmpOutLine(bmp_out, &dst) != SUCCESS) return IO_ERR_FILE_TRUNC;
+		memcpy(dst, line, (size_t)bmp_out->line_bytes);
+	}
+	memset(dst + bmp_out->line_bytes, 0, (size_t)bmp_out->alignment_bytes);
+	bmp_out->reserved_line = NULL;
+	bmp_out->buffer_used += (size_t)(bmp_out->line_bytes + bmp_out->alignment_bytes);
+
+	// Write everything out after the last line
+	if (bmp_out->num_unwritten_rows > 0) return SUCCESS;
+	const int err_code = flushBmpOut(bmp_out);
+	if (err_code != SUCCESS || bmp_out->ring == NULL) return err_code;
+	return drainIoRing(bmp_out->ring);
+}
+
+int bmpOutWriteLine(BmpOut* const bmp_out, const uint8_t* const line) {
+	STATS_START(timer);
+	const int err_code = writeBmpOutLine(bmp_out, line);
+	STATS_STOP(timer, stats_stage_write, (err_code == SUCCESS) ? bmp_out->cols : 0);
+	return err_code;
+}
+
+int bmpOutGetLineRef(BmpOut* const bmp_out, uint8_t** const line) {
+	if ((bmp_out->out == NULL) || (line == NULL) || (bmp_out->num_unwritten_rows <= 0)) return(IO_ERR_FILE_NOT_OPEN);
+	if (bmp_out->reserved_line == NULL && isBmpOutFull(bmp_out)) {
+		// Making room writes out the buffer, which counts as writing
+		STATS_START(timer);
+		const int err_code = flushBmpOut(bmp_out);
+		STATS_STOP(timer, stats_stage_write, 0);
+		if (err_code != SUCCESS) return IO_ERR_FILE_TRUNC;
+	}
+	if (bmp_out->reserved_line == NULL) {
+		if (reserveBmpOutLine(bmp_out, &bmp_out->reserved_line) != SUCCESS) return IO_ERR_FILE_TRUNC;
 	}
+	*line = bmp_out->reserved_line;
 	return SUCCESS;
-}
\ No newline at end of file
+}
+
+static int writeBmpOutRows(const BmpOut* const bmp_out, const int first_row, const int num_rows, const uint8_t* const buffer) {
+	if ((bmp_out->out == NULL) || (buffer == NULL) || (first_row < 0) || (num_rows < 0) || (first_row + num_rows > bmp_out->rows)) return(IO_ERR_FILE_NOT_OPEN);
+	if (!bmp_out->regular) return(IO_ERR_UNSUPPORTED);
+#ifdef BMP_HAVE_PREAD
+	const size_t padded_line_bytes = (size_t)(bmp_out->line_bytes + bmp_out->alignment_bytes);
+	const size_t num_bytes = (size_t)num_rows * padded_line_bytes;
+	const off_t offset = (off_t)bmp_out->data_offset + (off_t)first_row * (off_t)padded_line_bytes;
+	const int fd = fileno(bmp_out->out);
+	size_t done = 0;
+	while (done < num_bytes) {
+		const ssize_t n = pwrite(fd, buffer + done, num_bytes - done, offset + (off_t)done);
+		if (n <= 0) return(IO_ERR_FILE_TRUNC);
+		done += (size_t)n;
+	}
+	STATS_COUNT(stats_bytes_written, num_bytes);
+	return SUCCESS;
+#else
+	return(IO_ERR_UNSUPPORTED);
+#endif
+}
+
+int bmpOutWriteRows(const BmpOut* const bmp_out, const int first_row, const int num_rows, const uint8_t* const buffer) {
+	STATS_START(timer);
+	const int err_code = writeBmpOutRows(bmp_out, first_row, num_rows, buffer);
+	STATS_STOP(timer, stats_stage_write, (err_code == SUCCESS) ? (uint64_t)num_rows * bmp_out->cols : 0);
+	return err_code;
+}
@@ -0,0 +1,222 @@
+#include "stdlib.h"
+#include "pthread.h"
+#include "io_ring.h"
+#include "stats_hooks.h"
+
+// Alignment of the buffers, matching the page size so they can be handed to the kernel directly
+#define IO_RING_ALIGNMENT 4096
+
+struct IoRing {
+	pthread_t thread;
+	FILE* file;
+	int num_slots;
+	size_t slot_size;
+	uint8_t** slots;
+	size_t* sizes;			// Bytes held by each full slot
+
+	pthread_mutex_t lock;	// Protects the fields below
+	pthread_cond_t filled;	// Signalled when a slot becomes full
+	pthread_cond_t emptied;	// Signalled when a slot becomes free
+	int head;				// Oldest full slot
+	int num_full;
+	int holding;			// Reader: the caller still holds the slot at `head`
+	int finished;			// Reader: no more slots will be filled
+	int failed;				// Writer: a write has failed
+	int stopping;
+	size_t remaining;		// Reader: bytes still to be read
+};
+
+
+static void* readerMain(void* arg) {
+	IoRing* const ring = (IoRing*)arg;
+	int tail = 0;
+
+	pthread_mutex_lock(&ring->lock);
+	while (!ring->finished) {
+		while (ring->num_full == ring->num_slots && !ring->stopping) pthread_cond_wait(&ring->emptied, &ring->lock);
+		if (ring->stopping) break;
+		const size_t wanted = (ring->remaining < ring->slot_size) ? ring->remaining : ring->slot_size;
+		pthread_mutex_unlock(&ring->lock);
+
+		// The caller never touches a slot that is not full
+		const size_t num_read = fread(ring->slots[tail], 1, wanted, ring->file);
+
+		pthread_mutex_lock(&ring->lock);
+		ring->sizes[tail] = num_read;
+		ring->remaining -= num_read;
+		if (num_read < wanted || ring->remaining == 0) ring->finished = 1;
+		if (num_read > 0) {
+			tail = (tail + 1) % ring->num_slots;
+			ring->num_full++;
+		}
+		pthread_cond_signal(&ring->filled);
+	}
+	ring->finished = 1;
+	pthread_cond_signal(&ring->filled);
+	pthread_mutex_unlock(&ring->lock);
+
+	return NULL;
+}
+
+
+static void* writerMain(void* arg) {
+	IoRing* const ring = (IoRing*)arg;
+
+	pthread_mutex_lock(&ring->lock);
+	for (;;) {
+		while (ring->num_full == 0 && !ring->stopping) pthread_cond_wait(&ring->filled, &ring->lock);
+		if (ring->num_full == 0) break;
+		const int slot = ring->head;
+		const int failed = ring->failed;
+		pthread_mutex_unlock(&ring->lock);
+
+		// Once a write fails the rest are dropped, since the file is incomplete anyway
+		const size_t num_bytes = ring->sizes[slot];
+		const int ok = failed || fwrite(ring->slots[slot], 1, num_bytes, ring->file) == num_bytes;
+
+		pthread_mutex_lock(&ring->lock);
+		if (!ok) ring->failed = 1;
+		ring->head = (ring->head + 1) % ring->num_slots;
+		ring->num_full--;
+		pthread_cond_signal(&ring->emptied);
+	}
+	pthread_mutex_unlock(&ring->lock);
+
+	return NULL;
+}
+
+
+static void freeIoRing(IoRing* const ring) {
+	if (ring->slots != NULL) {
+		for (int s = 0; s < ring->num_slots; ++s) free(ring->slots[s]);
+	}
+	free(ring->slots);
+	free(ring->sizes);
+	free(ring);
+}
+
+
+static Error startIoRing(IoRing** ring, FILE* file, size_t slot_size, int num_slots, size_t total, void* (*thread_main)(void*)) {
+	*ring = NULL;
+	IoRing* const temp = (IoRing*)calloc(1, sizeof(IoRing));
+	if (temp == NULL) return IO_ERR_ALLOC;
+
+	temp->file = file;
+	temp->num_slots = num_slots;
+	temp->slot_size = slot_size;
+	temp->remaining = total;
+	temp->finished = (total == 0);
+	temp->slots = (uint8_t**)calloc(num_slots, sizeof(uint8_t*));
+	temp->sizes = (size_t*)calloc(num_slots, sizeof(size_t));
+	if (temp->slots == NULL || temp->sizes == NULL) {
+		freeIoRing(temp);
+		return IO_ERR_ALLOC;
+	}
+
+	const size_t aligned_size = (slot_size + IO_RING_ALIGNMENT - 1) & ~(size_t)(IO_RING_ALIGNMENT - 1);
+	for (int s = 0; s < num_slots; ++s) {
+		temp->slots[s] = (uint8_t*)aligned_alloc(IO_RING_ALIGNMENT, aligned_size);
+		if (temp->slots[s] == NULL) {
+			freeIoRing(temp);
+			return IO_ERR_ALLOC;
+		}
+	}
+	STATS_COUNT(stats_allocations, num_slots);
+	STATS_COUNT(stats_allocated_bytes, (size_t)num_slots * aligned_size);
+
+	pthread_mutex_init(&temp->lock, NULL);
+	pthread_cond_init(&temp->filled, NULL);
+	pthread_cond_init(&temp->emptied, NULL);
+	if (pthread_create(&temp->thread, NULL, thread_main, temp) != 0) {
+		pthread_cond_destroy(&temp->emptied);
+		pthread_cond_destroy(&temp->filled);
+		pthread_mutex_destroy(&temp->lock);
+		freeIoRing(temp);
+		return THREAD_ERR_CREATE;
+	}
+
+	*ring = temp;
+	return SUCCESS;
+}
+
+
+Error startIoReader(IoRing** ring, FILE* file, size_t slot_size, int num_slots, size_t total) {
+	return startIoRing(ring, file, slot_size, num_slots, total, readerMain);
+}
+
+
+Error startIoWriter(IoRing** ring, FILE* file, size_t slot_size, int num_slots) {
+	return startIoRing(ring, file, slot_size, num_slots, 0, writerMain);
+}
+
+
+size_t takeIoChunk(IoRing* const ring, const uint8_t** const chunk) {
+	pthread_mutex_lock(&ring->lock);
+	if (ring->holding) {
+		ring->head = (ring->head + 1) % ring->num_slots;
+		ring->num_full--;
+		ring->holding = 0;
+		pthread_cond_signal(&ring->emptied);
+	}
+
+	while (ring->num_full == 0 && !ring->finished) pthread_cond_wait(&ring->filled, &ring->lock);
+	size_t num_bytes = 0;
+	if (ring->num_full > 0) {
+		*chunk = ring->slots[ring->head];
+		num_bytes = ring->sizes[ring->head];
+		ring->holding = 1;
+	}
+	pthread_mutex_unlock(&ring->lock);
+
+	return num_bytes;
+}
+
+
+uint8_t* getIoBuffer(IoRing* const ring) {
+	pthread_mutex_lock(&ring->lock);
+	while (ring->num_full == ring->num_slots) pthread_cond_wait(&ring->emptied, &ring->lock);
+	uint8_t* const buffer = ring->slots[(ring->head + ring->num_full) % ring->num_slots];
+	pthread_mutex_unlock(&ring->lock);
+
+	return buffer;
+}
+
+
+Error submitIoBuffer(IoRing* const ring, size_t num_bytes) {
+	pthread_mutex_lock(&ring->lock);
+	const int tail = (ring->head + ring->num_full) % ring->num_slots;
+	ring->sizes[tail] = num_bytes;
+	ring->num_full++;
+	pthread_cond_signal(&ring->filled);
+	const int failed = ring->failed;
+	pthread_mutex_unlock(&ring->lock);
+
+	return failed ? IO_ERR_FILE_TRUNC : SUCCESS;
+}
+
+
+Error drainIoRing(IoRing* const ring) {
+	pthread_mutex_lock(&ring->lock);
+	while (ring->num_full > 0) pthread_cond_wait(&ring->emptied, &ring->lock);
+	const int failed = ring->failed;
+	pthread_mutex_unlock(&ring->lock);
+
+	return failed ? IO_ERR_FILE_TRUNC : SUCCESS;
+}
+
+
+void stopIoRing(IoRing* const ring) {
+	if (ring == NULL) return;
+
+	pthread_mutex_lock(&ring->lock);
+	ring->stopping = 1;
+	pthread_cond_broadcast(&ring->filled);
+	pthread_cond_broadcast(&ring->emptied);
+	pthread_mutex_unlock(&ring->lock);
+	pthread_join(ring->thread, NULL);
+
+	pthread_cond_destroy(&ring->emptied);
+	pthread_cond_destroy(&ring->filled);
+	pthread_mutex_destroy(&ring->lock);
+	freeIoRing(ring);
+}
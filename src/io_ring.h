@@ -0,0 +1,42 @@
+#ifndef IO_RING_H
+#define IO_RING_H
+
+#include "stddef.h"
+#include "stdint.h"
+#include "stdio.h"
+#include "error.h"
+
+/*  A thread moving a file through a bounded ring of equal-sized buffers,
+	so that reading or writing overlaps the caller's work on other
+	buffers. A reader ring fills buffers ahead of the caller, which takes
+	them in order; a writer ring writes out buffers behind the caller,
+	which fills them in order. Either way the caller blocks only when the
+	thread falls a whole ring behind or ahead. */
+typedef struct IoRing IoRing;
+
+// Starts a thread reading `total` bytes from the current position of `file` into `num_slots` buffers of
+// `slot_size` bytes. Returns IO_ERR_ALLOC or THREAD_ERR_CREATE, leaving `*ring` NULL, on failure.
+Error startIoReader(IoRing** ring, FILE* file, size_t slot_size, int num_slots, size_t total);
+
+// Starts a thread writing buffers handed to it with `submitIoBuffer()` to `file`, with failures as for
+// `startIoReader()`
+Error startIoWriter(IoRing** ring, FILE* file, size_t slot_size, int num_slots);
+
+// Reader: releases the buffer returned by the previous call and waits for the next one, returning
+// its size. Buffers are full apart from the last; 0 means the file ended or the read failed.
+size_t takeIoChunk(IoRing* const ring, const uint8_t** const chunk);
+
+// Writer: waits for a free buffer of the slot size to fill
+uint8_t* getIoBuffer(IoRing* const ring);
+
+// Writer: queues the first `num_bytes` of the buffer from `getIoBuffer()` to be written, returning
+// IO_ERR_FILE_TRUNC if any earlier write has failed
+Error submitIoBuffer(IoRing* const ring, size_t num_bytes);
+
+// Writer: waits until every queued buffer is written, returning IO_ERR_FILE_TRUNC if any write failed
+Error drainIoRing(IoRing* const ring);
+
+// Stops the thread, abandoning unread data but finishing queued writes, and frees the ring
+void stopIoRing(IoRing* const ring);
+
+#endif // IO_RING_H
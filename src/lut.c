@@ -0,0 +1,102 @@
+#include "lut.h"
+#include "convolve.h"
+
+
+void buildScaleLut(uint8_t* lut, uint8_t scale) {
+	for (int v = 0; v < 256; ++v) {
+		const int value = (v * scale + 50) / 100;		// + 50 is for rounding
+		lut[v] = (value > 255) ? 255 : (uint8_t)value;
+	}
+}
+
+
+static void applyLutScalar(uint8_t* dst, const uint8_t* src, const uint8_t* const* luts, int num_components, int first, int width) {
+	if (num_components == 3) {
+		const uint8_t* const blue = luts[0];
+		const uint8_t* const green = luts[1];
+		const uint8_t* const red = luts[2];
+		for (int c = 3 * first; c < 3 * width; c += 3) {
+			dst[c] = blue[src[c]];
+			dst[c + 1] = green[src[c + 1]];
+			dst[c + 2] = red[src[c + 2]];
+		}
+		return;
+	}
+
+	for (int p = 0; p < num_components; ++p) {
+		const uint8_t* const lut = luts[p];
+		for (int c = first; c < width; ++c) {
+			const int i = c * num_components + p;
+			dst[i] = lut[src[i]];
+		}
+	}
+}
+
+
+#ifdef CONV_HAVE_X86
+
+#include "pthread.h"
+#include "immintrin.h"
+
+static int has_vbmi = 0;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+
+static void initLut(void) {
+	__builtin_cpu_init();
+	has_vbmi = __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vbmi");
+}
+
+
+// Looks up 64 samples in a table held in four registers, using the top bit of each sample to pick a half
+__attribute__((target("avx512f,avx512bw,avx512vbmi")))
+static inline __m512i lookupVbmi(const __m512i* table, const __m512i samples) {
+	const __m512i low = _mm512_permutex2var_epi8(table[0], samples, table[1]);
+	const __m512i high = _mm512_permutex2var_epi8(table[2], samples, table[3]);
+	return _mm512_mask_blend_epi8(_mm512_movepi8_mask(samples), low, high);
+}
+
+
+__attribute__((target("avx512f,avx512bw,avx512vbmi")))
+static int applyLutVbmi(uint8_t* dst, const uint8_t* src, const uint8_t* const* luts, int num_components, int width) {
+	if (num_components != 1 && num_components != 3) return 0;
+
+	__m512i tables[3][4];
+	for (int p = 0; p < num_components; ++p) {
+		for (int t = 0; t < 4; ++t) tables[p][t] = _mm512_loadu_si512(luts[p] + 64 * t);
+	}
+
+	int c = 0;
+	if (num_components == 1) {
+		for (; c + 64 <= width; c += 64) {
+			_mm512_storeu_si512(dst + c, lookupVbmi(tables[0], _mm512_loadu_si512(src + c)));
+		}
+		return c;
+	}
+
+	// Bytes j of a vector with j % 3 == s; vector `k` of a group of three starts on component k % 3
+	const __mmask64 phase[3] = { 0x9249249249249249ull, 0x2492492492492492ull, 0x4924924924924924ull };
+	for (; c + 64 <= width; c += 64) {
+		for (int k = 0; k < 3; ++k) {
+			const __m512i samples = _mm512_loadu_si512(src + 3 * c + 64 * k);
+			__m512i result = lookupVbmi(tables[0], samples);
+			result = _mm512_mask_blend_epi8(phase[(4 - k) % 3], result, lookupVbmi(tables[1], samples));
+			result = _mm512_mask_blend_epi8(phase[(5 - k) % 3], result, lookupVbmi(tables[2], samples));
+			_mm512_storeu_si512(dst + 3 * c + 64 * k, result);
+		}
+	}
+	return c;
+}
+
+#endif // CONV_HAVE_X86
+
+
+void applyLutLine(uint8_t* dst, const uint8_t* src, const uint8_t* const* luts, int num_components, int width) {
+	int first = 0;
+#ifdef CONV_HAVE_X86
+	pthread_once(&init_once, initLut);
+	const SimdLevel limit = getSimdLimit();
+	if (has_vbmi && (limit == simd_auto || limit >= simd_avx512)) first = applyLutVbmi(dst, src, luts, num_components, width);
+#endif
+	applyLutScalar(dst, src, luts, num_components, first, width);
+}
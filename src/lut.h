@@ -0,0 +1,17 @@
+#ifndef LUT_H
+#define LUT_H
+
+#include "stdint.h"
+
+/*  Point operations expressed as 256-entry lookup tables, one per colour
+	component, applied directly to interleaved BMP lines or to planes.
+	With AVX-512 VBMI (subject to `setSimdLevel()') 64 samples are looked
+	up at a time with a pair of vpermi2b instructions. */
+
+// Fills `lut` with the mapping from each sample to `scale` percent of its value, rounded to nearest
+void buildScaleLut(uint8_t* lut, uint8_t scale);
+
+// Maps `width` pixels of `num_components` interleaved samples through the table for each component; `dst` may equal `src`
+void applyLutLine(uint8_t* dst, const uint8_t* src, const uint8_t* const* luts, int num_components, int width);
+
+#endif // LUT_H
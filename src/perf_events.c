@@ -0,0 +1,168 @@
+#include "stdlib.h"
+#include "string.h"
+#include "perf_events.h"
+
+#ifdef __linux__
+#include "linux/perf_event.h"
+#include "sys/syscall.h"
+#include "unistd.h"
+#include "pthread.h"
+
+// Counters opened on one thread, read together through the group leader
+typedef struct {
+	int fds[STATS_NUM_EVENTS];	// The leader first, then its siblings
+	StatsEvent order[STATS_NUM_EVENTS];	// Event of each value returned by a group read
+	int num_open;
+	uint32_t mask;
+} PerfGroup;
+
+// Mask of events being counted, 0 while counting is off
+static uint32_t event_mask = 0;
+
+// Each thread's PerfGroup, or `no_group' if its counters could not be opened
+static pthread_key_t group_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static PerfGroup no_group;
+
+
+static void freePerfGroup(void* value) {
+	PerfGroup* const group = (PerfGroup*)value;
+	if (group == NULL || group == &no_group) return;
+	for (int i = group->num_open - 1; i >= 0; --i) close(group->fds[i]);
+	free(group);
+}
+
+
+static void initGroupKey(void) {
+	pthread_key_create(&group_key, freePerfGroup);
+}
+
+
+// Fills in the type and configuration of `event'
+static void setEventAttr(struct perf_event_attr* const attr, const StatsEvent event) {
+	switch (event) {
+	case stats_event_cycles:
+		attr->type = PERF_TYPE_HARDWARE;
+		attr->config = PERF_COUNT_HW_CPU_CYCLES;
+		break;
+	case stats_event_instructions:
+		attr->type = PERF_TYPE_HARDWARE;
+		attr->config = PERF_COUNT_HW_INSTRUCTIONS;
+		break;
+	case stats_event_cache_misses:
+		attr->type = PERF_TYPE_HARDWARE;
+		attr->config = PERF_COUNT_HW_CACHE_MISSES;
+		break;
+	case stats_event_l1d_misses:
+		attr->type = PERF_TYPE_HW_CACHE;
+		attr->config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+		break;
+	case stats_event_branch_misses:
+		attr->type = PERF_TYPE_HARDWARE;
+		attr->config = PERF_COUNT_HW_BRANCH_MISSES;
+		break;
+	case stats_event_page_faults:
+		attr->type = PERF_TYPE_SOFTWARE;
+		attr->config = PERF_COUNT_SW_PAGE_FAULTS;
+		break;
+	}
+}
+
+
+// Opens every event that can be counted on the calling thread, led by the first to open
+static PerfGroup* openPerfGroup(void) {
+	PerfGroup* const group = (PerfGroup*)calloc(1, sizeof(PerfGroup));
+	if (group == NULL) return &no_group;
+
+	for (int e = 0; e < STATS_NUM_EVENTS; ++e) {
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		setEventAttr(&attr, (StatsEvent)e);
+		attr.read_format = PERF_FORMAT_GROUP;
+		attr.exclude_kernel = 1;	// Allowed without privileges at the default `perf_event_paranoid' of 2
+		attr.exclude_hv = 1;
+
+		const int leader = (group->num_open > 0) ? group->fds[0] : -1;
+		const int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, leader, PERF_FLAG_FD_CLOEXEC);
+		if (fd < 0) continue;
+		group->fds[group->num_open] = fd;
+		group->order[group->num_open] = (StatsEvent)e;
+		group->num_open++;
+		group->mask |= 1u << e;
+	}
+
+	if (group->num_open == 0) {
+		free(group);
+		return &no_group;
+	}
+	return group;
+}
+
+
+uint32_t enablePerfEvents(void) {
+	__atomic_store_n(&event_mask, 0, __ATOMIC_RELAXED);
+	pthread_once(&key_once, initGroupKey);
+
+	PerfGroup* group = (PerfGroup*)pthread_getspecific(group_key);
+	if (group == NULL) {
+		group = openPerfGroup();
+		pthread_setspecific(group_key, group);
+	}
+
+	__atomic_store_n(&event_mask, group->mask, __ATOMIC_RELEASE);
+	return group->mask;
+}
+
+
+void disablePerfEvents(void) {
+	__atomic_store_n(&event_mask, 0, __ATOMIC_RELAXED);
+}
+
+
+uint32_t getPerfEventMask(void) {
+	return __atomic_load_n(&event_mask, __ATOMIC_ACQUIRE);
+}
+
+
+uint32_t readPerfEvents(uint64_t counts[STATS_NUM_EVENTS]) {
+	if (getPerfEventMask() == 0) return 0;
+
+	PerfGroup* group = (PerfGroup*)pthread_getspecific(group_key);
+	if (group == NULL) {
+		group = openPerfGroup();
+		pthread_setspecific(group_key, group);
+	}
+	if (group->num_open == 0) return 0;
+
+	// The number of values, then the values in the order the events were opened
+	uint64_t values[1 + STATS_NUM_EVENTS];
+	const ssize_t expected = (ssize_t)((1 + group->num_open) * sizeof(uint64_t));
+	if (read(group->fds[0], values, sizeof(values)) != expected) return 0;
+
+	for (int i = 0; i < group->num_open; ++i) counts[group->order[i]] = values[1 + i];
+	return group->mask;
+}
+
+#else
+
+uint32_t enablePerfEvents(void) {
+	return 0;
+}
+
+
+void disablePerfEvents(void) {
+}
+
+
+uint32_t getPerfEventMask(void) {
+	return 0;
+}
+
+
+uint32_t readPerfEvents(uint64_t counts[STATS_NUM_EVENTS]) {
+	(void)counts;
+	return 0;
+}
+
+#endif // __linux__
@@ -0,0 +1,29 @@
+#ifndef PERF_EVENTS_H
+#define PERF_EVENTS_H
+
+#include "stdint.h"
+#include "stats.h"
+
+/*  Hardware and software event counters for the stage probes, through
+	Linux perf_event_open(). Each thread counts its own user-space events
+	in one group opened on its first read, so a stage run by a worker is
+	charged to that worker's counters alone, and one read() returns every
+	count. Events the CPU, hypervisor or `perf_event_paranoid' setting
+	refuse are left out; if none can be opened, or on other systems,
+	counting stays off and reads return nothing. */
+
+// Opens the counters on the calling thread, returning a mask with bit `1 << e' set for each StatsEvent `e'
+// that could be counted. Counting is turned on only if the mask is not 0.
+uint32_t enablePerfEvents(void);
+
+// Turns counting off; counters already opened stay open for when it is turned on again
+void disablePerfEvents(void);
+
+// Returns the events counted since `enablePerfEvents()', or 0 if counting is off
+uint32_t getPerfEventMask(void);
+
+// Stores the counts of the calling thread in `counts', opening its counters on first use, and returns
+// the mask of events stored (0 if counting is off or the thread's counters could not be opened)
+uint32_t readPerfEvents(uint64_t counts[STATS_NUM_EVENTS]);
+
+#endif // PERF_EVENTS_H
@@ -1,9 +1,17 @@
 #include "process.h"
+#include "io_bmp.h"
+#include "filter_plan.h"
+#include "thread_pool.h"
+#include "shared_pool.h"
+#include "interleave.h"
+#include "lut.h"
+#include "stats_hooks.h"
 #include "string.h"
 #include "error.h"
 #include "stdio.h"
 #include "stdlib.h"
 #include "errno.h"
+#include "math.h"
 
 
 Error scaleRgb(Image* const image, uint8_t scale_red, uint8_t scale_green, uint8_t scale_blue) {
@@ -11,17 +19,14 @@ Error scaleRgb(Image* const image, uint8_t scale_red, uint8_t scale_green, uint8
 	if (image->num_components != 3) return INVALID_IMAGE_RGB;
 
 	if (scale_red < 100) {
-		printf("Scaling red colour plane to %d%%\n", scale_red);
 		Error err_code = scaleImageComp(image, colour_red, scale_red);
 		if (err_code != SUCCESS) return err_code;
 	}
 	if (scale_green < 100) {
-		printf("Scaling green colour plane to %d%%\n", scale_green);
 		Error err_code = scaleImageComp(image, colour_green, scale_green);
 		if (err_code != SUCCESS) return err_code;
 	}
 	if (scale_blue < 100) {
-		printf("Scaling blue colour plane to %d%%\n", scale_blue);
 		Error err_code = scaleImageComp(image, colour_blue, scale_blue);
 		if (err_code != SUCCESS) return err_code;
 	}
@@ -38,19 +43,72 @@ Error scaleImageComp(Image* const image, const Colour colour, uint8_t scale) {
 
 	if (scale > 100) return INVALID_SCALE;
 
-	size_t width = (size_t)image->components[colour].width;
-	size_t height = (size_t)image->components[colour].height;
+	uint8_t lut[256];
+	buildScaleLut(lut, scale);
+	const uint8_t* const luts[1] = { lut };
 
-	for (size_t j = 0; j < width * height; ++j) {
-		uint16_t value = image->components[colour].data[j];	// Larger data type for intermediate calculation
-		value = (value * scale + 50) / 100;					// + 50 is for rounding
-		image->components[colour].data[j] = (uint8_t)value;	// This is safe from overflow since 0 <= value <= 255
+	// Scale the pixels only, leaving the border to be re-extended by whoever needs it
+	ImageComp* const component = &image->components[colour];
+	STATS_START(timer);
+	for (int r = 0; r < component->height; ++r) {
+		uint8_t* const row = component->image + (size_t)r * component->stride;
+		applyLutLine(row, row, luts, 1, component->width);
 	}
+	STATS_STOP(timer, stats_stage_scale, (uint64_t)component->width * component->height);
 
 	return SUCCESS;
 }
 
 
+Error scaleRgbBmp(const char* const in_file, const char* const out_file, uint8_t scale_red, uint8_t scale_green, uint8_t scale_blue) {
+	if (scale_red > 100 || scale_green > 100 || scale_blue > 100) return INVALID_SCALE;
+
+	BmpIn bmp_in;
+	Error err_code = bmpInOpen(&bmp_in, in_file);
+	if (err_code != SUCCESS) return err_code;
+	if (bmp_in.num_components != 3) {
+		bmpInClose(&bmp_in);
+		return INVALID_IMAGE_RGB;
+	}
+
+	BmpOut bmp_out;
+	err_code = bmpOutOpen(&bmp_out, out_file, bmp_in.cols, bmp_in.rows, 3);
+	if (err_code != SUCCESS) {
+		bmpInClose(&bmp_in);
+		return err_code;
+	}
+
+	// Tables in BGR order, matching the samples of each line
+	uint8_t luts[3][256];
+	buildScaleLut(luts[colour_blue], scale_blue);
+	buildScaleLut(luts[colour_green], scale_green);
+	buildScaleLut(luts[colour_red], scale_red);
+	const uint8_t* const lut_ptrs[3] = { luts[0], luts[1], luts[2] };
+
+	// Map each input line straight into the output buffer
+	for (int r = 0; r < bmp_in.rows && err_code == SUCCESS; ++r) {
+		const uint8_t* src;
+		uint8_t* dst;
+		err_code = bmpInGetLineRef(&bmp_in, &src);
+		if (err_code == SUCCESS) err_code = bmpOutGetLineRef(&bmp_out, &dst);
+		if (err_code != SUCCESS) break;
+
+		STATS_START(timer);
+		applyLutLine(dst, src, lut_ptrs, 3, bmp_in.cols);
+		STATS_STOP(timer, stats_stage_scale, bmp_in.cols);
+		err_code = bmpOutWriteLine(&bmp_out, dst);
+	}
+
+	bmpInClose(&bmp_in);
+
+	// Any lines still buffered are written on closing
+	const Error close_err = bmpOutClose(&bmp_out);
+	if (err_code == SUCCESS) err_code = close_err;
+
+	return err_code;
+}
+
+
 Error initFilter(Filter** filter) {
 	Filter* temp = (Filter*)calloc(1, sizeof(Filter));
 	if (temp == NULL) return IO_ERR_ALLOC;
@@ -63,8 +121,24 @@ Error initFilter(Filter** filter) {
 void freeFilter(Filter* const filter) {
 	if (filter == NULL) return;
 	if (filter->data != NULL) free(filter->data);
+	free(filter->col);
+	free(filter->row);
 	filter->data = NULL;
+	filter->col = NULL;
+	filter->row = NULL;
 	filter->radius = 0;
+	filter->rank = 0;
+	filter->box = 0.0f;
+}
+
+
+// Returns the value shared by every tap of `filter`, or 0 if the taps differ
+static float getUniformTap(const Filter* const filter) {
+	const int num_taps = (2 * filter->radius + 1) * (2 * filter->radius + 1);
+	for (int i = 1; i < num_taps; ++i) {
+		if (filter->data[i] != filter->data[0]) return 0.0f;
+	}
+	return filter->data[0];
 }
 
 
@@ -72,19 +146,24 @@ Error parseFilter(Filter* const filter, const char* const filepath) {
 	FILE* file = fopen(filepath, "r");
 	if (!file) return IO_ERR_NO_FILE;
 
-	char line[1024];
+	// Rows of large filters run to thousands of characters, so lines are read whole however long
+	char* line = NULL;
+	size_t line_capacity = 0;
 	int radius;
 
 	// Read radius from first line
-	if (!fgets(line, sizeof(line), file)) {
+	if (getline(&line, &line_capacity, file) < 0) {
+		free(line);
 		fclose(file);
 		return IO_ERR_FILE_TRUNC;
 	}
 	if (sscanf(line, "%d", &radius) != 1) {
+		free(line);
 		fclose(file);
 		return INVALID_RADIUS_FORMAT;
 	}
 	if (radius < 0) {
+		free(line);
 		fclose(file);
 		return NEGATIVE_RADIUS;
 	}
@@ -93,6 +172,7 @@ Error parseFilter(Filter* const filter, const char* const filepath) {
 
 	filter->data = (float*)malloc(diameter * diameter * sizeof(float));
 	if (filter->data == NULL) {
+		free(line);
 		fclose(file);
 		return IO_ERR_ALLOC;
 	}
@@ -100,9 +180,10 @@ Error parseFilter(Filter* const filter, const char* const filepath) {
 	// Read filter data
 	for (int i = 0; i < diameter; ++i) {
 		// Read row
-		if (!fgets(line, sizeof(line), file)) {
+		if (getline(&line, &line_capacity, file) < 0) {
 			free(filter->data);
 			filter->data = NULL;
+			free(line);
 			fclose(file);
 			return IO_ERR_FILE_TRUNC;
 		}
@@ -112,6 +193,7 @@ Error parseFilter(Filter* const filter, const char* const filepath) {
 		if (!token) {
 			free(filter->data);
 			filter->data = NULL;
+			free(line);
 			fclose(file);
 			return INVALID_FILTER_FORMAT;
 		}
@@ -121,6 +203,7 @@ Error parseFilter(Filter* const filter, const char* const filepath) {
 			if (strlen(token) == 0) {
 				free(filter->data);
 				filter->data = NULL;
+				free(line);
 				fclose(file);
 				return INVALID_FILTER_FORMAT;
 			}
@@ -132,6 +215,7 @@ Error parseFilter(Filter* const filter, const char* const filepath) {
 			if (errno != 0 || *endptr != '\0') {
 				free(filter->data);
 				filter->data = NULL;
+				free(line);
 				fclose(file);
 				return INVALID_FILTER_DATA;
 			}
@@ -142,6 +226,7 @@ Error parseFilter(Filter* const filter, const char* const filepath) {
 			if (j < diameter - 1 && !token) {
 				free(filter->data);
 				filter->data = NULL;
+				free(line);
 				fclose(file);
 				return INVALID_FILTER_FORMAT;
 			}
@@ -151,76 +236,489 @@ Error parseFilter(Filter* const filter, const char* const filepath) {
 		if (strtok(NULL, ",") != NULL) {
 			free(filter->data);
 			filter->data = NULL;
+			free(line);
 			fclose(file);
 			return INVALID_FILTER_FORMAT;
 		}
 	}
 
 	filter->radius = radius;
+	free(line);
 	fclose(file);
+
+	Error err_code = decomposeFilter(filter);
+	if (err_code != SUCCESS) {
+		free(filter->data);
+		filter->data = NULL;
+		return err_code;
+	}
+	filter->box = getUniformTap(filter);
+
 	return SUCCESS;
 }
 
 
-Error applyFilterComp(ImageComp* const image_comp, const Filter* const filter) {
-	if (image_comp == NULL) return NULL_IMAGE_COMP;
+Error initBoxFilter(Filter* const filter, int radius) {
 	if (filter == NULL) return NULL_FILTER;
+	if (radius < 0) return NEGATIVE_RADIUS;
+
+	// Running sums read nothing but the tap, so no dense array is made
+	const double diameter = 2.0 * radius + 1.0;
+	filter->data = NULL;
+	filter->radius = radius;
+	filter->rank = 0;
+	filter->box = (float)(1.0 / (diameter * diameter));
+
+	return SUCCESS;
+}
 
-	int radius = filter->radius;
-	int diameter = 2 * radius + 1;
 
-	const int width = image_comp->width;
-	const int x_border = image_comp->x_border;
-	const int total_width = width + 2 * x_border;
-	const int height = image_comp->height;
-	const int y_border = image_comp->y_border;
-	const int total_height = height + 2 * y_border;
-
-	// Copy image component
-	ImageComp copy;
-	copy.width = width;
-	copy.height = height;
-	copy.x_border = x_border;
-	copy.y_border = y_border;
-	copy.data = (uint8_t*)malloc(total_width * total_height * sizeof(uint8_t));
-	if (copy.data == NULL) return IO_ERR_ALLOC;
-	copy.image = copy.data + y_border * total_width + x_border;
-
-	for (int r = 0; r < total_height; ++r) {
-		for (int c = 0; c < total_width; ++c) {
-			copy.data[r * total_width + c] = image_comp->data[r * total_width + c];
+// Computes the singular value decomposition of the n x n matrix `a` using one-sided Jacobi rotations.
+// On return the columns of `u` hold the left singular vectors scaled by their singular values and the
+// columns of `v` hold the right singular vectors, so that a = u * v^T.
+static void jacobiSvd(const double* const a, double* const u, double* const v, const int n) {
+	memcpy(u, a, n * n * sizeof(double));
+	for (int i = 0; i < n * n; ++i) v[i] = 0.0;
+	for (int i = 0; i < n; ++i) v[i * n + i] = 1.0;
+
+	for (int sweep = 0; sweep < 64; ++sweep) {
+		int rotated = 0;
+		for (int p = 0; p < n - 1; ++p) {
+			for (int q = p + 1; q < n; ++q) {
+				double alpha = 0.0, beta = 0.0, gamma = 0.0;
+				for (int i = 0; i < n; ++i) {
+					alpha += u[i * n + p] * u[i * n + p];
+					beta += u[i * n + q] * u[i * n + q];
+					gamma += u[i * n + p] * u[i * n + q];
+				}
+				if (gamma == 0.0 || fabs(gamma) <= 1e-15 * sqrt(alpha * beta)) continue;
+				rotated = 1;
+
+				const double zeta = (beta - alpha) / (2.0 * gamma);
+				const double t = (zeta >= 0.0 ? 1.0 : -1.0) / (fabs(zeta) + sqrt(1.0 + zeta * zeta));
+				const double cs = 1.0 / sqrt(1.0 + t * t);
+				const double sn = cs * t;
+				for (int i = 0; i < n; ++i) {
+					const double up = u[i * n + p], uq = u[i * n + q];
+					u[i * n + p] = cs * up - sn * uq;
+					u[i * n + q] = sn * up + cs * uq;
+					const double vp = v[i * n + p], vq = v[i * n + q];
+					v[i * n + p] = cs * vp - sn * vq;
+					v[i * n + q] = sn * vp + cs * vq;
+				}
+			}
 		}
+		if (!rotated) break;
 	}
+}
 
-	// Perform convolution
-	float* filter_centre = filter->data + radius * diameter + radius;
-	for (int r = 0; r < height; ++r) {
-		for (int c = 0; c < width; ++c) {
-			uint8_t* src = copy.image + r * total_width + c;
-			uint8_t* dst = image_comp->image + r * total_width + c;
-			float sum = 0;
-			for (int y = -radius; y <= radius; ++y) {
-				for (int x = -radius; x <= radius; ++x) {
-					sum += (float)src[y * total_width + x] * filter_centre[-y * diameter - x];
+
+Error decomposeFilter(Filter* const filter) {
+	if (filter == NULL) return NULL_FILTER;
+
+	// Box filters keep no taps to decompose
+	if (filter->data == NULL) return (filter->box != 0.0f) ? SUCCESS : NULL_FILTER_DATA;
+
+	free(filter->col);
+	free(filter->row);
+	filter->col = NULL;
+	filter->row = NULL;
+	filter->rank = 0;
+
+	const int diameter = 2 * filter->radius + 1;
+	if (diameter > FILTER_SEPARABLE_MAX_DIAMETER) return SUCCESS;
+
+	const int n = diameter;
+	double* const a = (double*)malloc(n * n * sizeof(double));
+	double* const u = (double*)malloc(n * n * sizeof(double));
+	double* const v = (double*)malloc(n * n * sizeof(double));
+	double* const approx = (double*)calloc(n * n, sizeof(double));
+	double* const sigma = (double*)malloc(n * sizeof(double));
+	int* const order = (int*)malloc(n * sizeof(int));
+	if (a == NULL || u == NULL || v == NULL || approx == NULL || sigma == NULL || order == NULL) {
+		free(a); free(u); free(v); free(approx); free(sigma); free(order);
+		return IO_ERR_ALLOC;
+	}
+
+	double max_tap = 0.0;
+	for (int i = 0; i < n * n; ++i) {
+		a[i] = filter->data[i];
+		if (fabs(a[i]) > max_tap) max_tap = fabs(a[i]);
+	}
+
+	jacobiSvd(a, u, v, n);
+
+	// Order terms by decreasing singular value
+	for (int j = 0; j < n; ++j) {
+		double norm = 0.0;
+		for (int i = 0; i < n; ++i) norm += u[i * n + j] * u[i * n + j];
+		sigma[j] = sqrt(norm);
+		order[j] = j;
+	}
+	for (int j = 1; j < n; ++j) {
+		const int key = order[j];
+		int k = j - 1;
+		while (k >= 0 && sigma[order[k]] < sigma[key]) {
+			order[k + 1] = order[k];
+			--k;
+		}
+		order[k + 1] = key;
+	}
+
+	// Find the smallest number of terms that reproduces the filter within tolerance
+	int rank = 0;
+	double error = max_tap;
+	while (rank < n && error > FILTER_SEPARABLE_TOLERANCE * max_tap) {
+		const int j = order[rank];
+		error = 0.0;
+		for (int i = 0; i < n * n; ++i) {
+			approx[i] += u[(i / n) * n + j] * v[(i % n) * n + j];
+			if (fabs(a[i] - approx[i]) > error) error = fabs(a[i] - approx[i]);
+		}
+		++rank;
+	}
+
+	// Only use the decomposition if it needs fewer taps per pixel than the dense kernel
+	Error err_code = SUCCESS;
+	if (rank > 0 && 2 * rank * n < n * n) {
+		filter->col = (float*)malloc(rank * n * sizeof(float));
+		filter->row = (float*)malloc(rank * n * sizeof(float));
+		if (filter->col == NULL || filter->row == NULL) {
+			free(filter->col);
+			free(filter->row);
+			filter->col = NULL;
+			filter->row = NULL;
+			err_code = IO_ERR_ALLOC;
+		} else {
+			for (int k = 0; k < rank; ++k) {
+				const int j = order[k];
+				const double scale = sqrt(sigma[j]);
+				for (int i = 0; i < n; ++i) {
+					filter->col[k * n + i] = (float)(u[i * n + j] / scale);
+					filter->row[k * n + i] = (float)(v[i * n + j] * scale);
 				}
 			}
-			*dst = (uint8_t)sum;
+			filter->rank = rank;
 		}
 	}
 
-	free(copy.data);
+	free(a); free(u); free(v); free(approx); free(sigma); free(order);
+	return err_code;
+}
+
+
+// Worker threads shared by the processing functions (NULL when running on the calling thread only)
+static ThreadPool* thread_pool = NULL;
+
+
+Error setNumThreads(int num_threads) {
+	if (num_threads < 0) return INVALID_THREAD_COUNT;
+
+	freeThreadPool(thread_pool);
+	thread_pool = NULL;
+	if (num_threads == 1) return SUCCESS;
+
+	return initThreadPool(&thread_pool, num_threads);
+}
+
+
+int getNumThreads(void) {
+	return getThreadPoolSize(thread_pool);
+}
+
+
+ThreadPool* getSharedThreadPool(void) {
+	return thread_pool;
+}
+
+
+// Fewest rows given to a task, so the rows a separable band re-reads at its edges stay a small overhead
+#define MIN_BAND_ROWS 16
+
+// Bands to create per thread so that threads finishing early can steal work from the others
+#define BANDS_PER_THREAD 4
+
+// A filter applied to several components, split into band x component tasks
+typedef struct {
+	const FilterPlan* plan;
+	const ImageComp* components;
+	uint8_t* const* outputs;	// Output image (first pixel) of each component, with the same layout as the component
+	const uint8_t* const* luts;	// Table applied to each component's output rows while they are in cache, or NULL
+	int bands_per_comp;
+	int band_rows;
+	FilterScratch* scratch;		// One per worker
+} FilterJob;
+
+
+static void filterBandTask(void* context, int task, int worker) {
+	FilterJob* const job = (FilterJob*)context;
+	const int p = task / job->bands_per_comp;
+	const int band = task % job->bands_per_comp;
+	const ImageComp* const component = job->components + p;
+	const int stride = component->stride;
+
+	const int first_row = band * job->band_rows;
+	int num_rows = component->height - first_row;
+	if (num_rows > job->band_rows) num_rows = job->band_rows;
+	if (num_rows <= 0) return;
+
+	// Components without a border wide enough for the filter have theirs made up while filtering
+	uint8_t* const dst = job->outputs[p] + (size_t)first_row * stride;
+	const int radius = job->plan->radius;
+	STATS_START(filter_timer);
+	if (component->x_border >= radius && component->y_border >= radius) {
+		filterRows(job->plan, component->image + (size_t)first_row * stride, stride,
+			dst, stride, component->width, num_rows, job->scratch + worker);
+	} else {
+		filterRowsVirtual(job->plan, component->image, stride, component->width, component->height, getBorderMode(),
+			job->outputs[p], stride, first_row, num_rows, job->scratch + worker);
+	}
+	STATS_STOP(filter_timer, stats_stage_filter, (uint64_t)component->width * num_rows);
+
+	if (job->luts == NULL) return;
+	const uint8_t* const lut[1] = { job->luts[p] };
+	STATS_START(scale_timer);
+	for (int r = 0; r < num_rows; ++r) applyLutLine(dst + (size_t)r * stride, dst + (size_t)r * stride, lut, 1, component->width);
+	STATS_STOP(scale_timer, stats_stage_scale, (uint64_t)component->width * num_rows);
+}
+
+
+// Arena capacity needed by `initWorkerScratch()`
+static size_t getWorkerScratchSize(const FilterPlan* const plan, const int width, const int num_scratch) {
+	return arenaAlignSize(num_scratch * sizeof(FilterScratch)) + num_scratch * getFilterScratchSize(plan, width);
+}
+
+
+// Allocates scratch memory from `arena` for `num_scratch` threads that may filter bands
+static Error initWorkerScratch(FilterScratch** const scratch, const FilterPlan* const plan, const int width,
+	const int num_scratch, Arena* const arena) {
+	*scratch = (FilterScratch*)arenaAlloc(arena, num_scratch * sizeof(FilterScratch));
+	if (*scratch == NULL) return IO_ERR_ALLOC;
+
+	for (int w = 0; w < num_scratch; ++w) {
+		Error err_code = initFilterScratch(*scratch + w, plan, width, arena);
+		if (err_code != SUCCESS) return err_code;
+	}
+
+	return SUCCESS;
+}
+
+
+// Filters the image rows of each component into `outputs` on the shared pool, mapping them through `luts` if given
+static void runFilterJob(const FilterPlan* const plan, const ImageComp* const components, uint8_t* const* outputs,
+	const uint8_t* const* luts, const int num_components, FilterScratch* const scratch) {
+	const int num_workers = getThreadPoolSize(thread_pool);
+	int max_height = 0;
+	for (int p = 0; p < num_components; ++p) {
+		if (components[p].height > max_height) max_height = components[p].height;
+	}
+
+	FilterJob job;
+	job.plan = plan;
+	job.components = components;
+	job.outputs = outputs;
+	job.luts = luts;
+	job.scratch = scratch;
+	job.band_rows = (max_height * num_components + num_workers * BANDS_PER_THREAD - 1) / (num_workers * BANDS_PER_THREAD);
+	if (job.band_rows < MIN_BAND_ROWS) job.band_rows = MIN_BAND_ROWS;
+	const int band_multiple = getFilterBandRows(plan);
+	job.band_rows = (job.band_rows + band_multiple - 1) / band_multiple * band_multiple;
+	job.bands_per_comp = (max_height + job.band_rows - 1) / job.band_rows;
+	if (job.bands_per_comp < 1) job.bands_per_comp = 1;
+	runThreadPool(thread_pool, num_components * job.bands_per_comp, filterBandTask, &job);
+}
+
+
+// Filters `num_components` components into the `spare` buffers, each laid out like the component's own data,
+// then swaps the buffers and extends the boundaries, leaving the original data in `spare`. Rows of each
+// component are read only from the original, so bands run in parallel. If `luts` is not NULL, each
+// component's output is also mapped through its table.
+static Error filterComponentsInto(ImageComp* const components, const int num_components, const FilterPlan* const plan,
+	const uint8_t* const* luts, FilterScratch* const scratch, uint8_t** const spare) {
+	uint8_t* outputs[BMP_MAX_COMPONENTS] = { NULL };
+	for (int p = 0; p < num_components; ++p) outputs[p] = spare[p] + (components[p].image - components[p].data);
+
+	// Perform convolution
+	runFilterJob(plan, components, outputs, luts, num_components, scratch);
+
+	// Replace the source components with the results
+	for (int p = 0; p < num_components; ++p) {
+		uint8_t* const data = components[p].data;
+		components[p].data = spare[p];
+		components[p].image = outputs[p];
+		spare[p] = data;
+		extendBoundaryComp(components + p);
+	}
 
 	return SUCCESS;
 }
 
 
+// Moves the data of each component back into `home`, the buffers it was read into, if filtering left it elsewhere
+static void restoreComponents(ImageComp* const components, const int num_components, uint8_t* const* home) {
+	for (int p = 0; p < num_components; ++p) {
+		ImageComp* const component = components + p;
+		if (component->data == home[p]) continue;
+
+		memcpy(home[p], component->data, getImageCompSize(component));
+		placeImageComp(component, home[p]);
+	}
+}
+
+
+// Filters `num_components` components in place, using a temporary arena for the output and scratch memory
+static Error filterComponents(ImageComp* const components, const int num_components, const Filter* const filter) {
+	if (filter == NULL) return NULL_FILTER;
+	if (filter->data == NULL && filter->box == 0.0f) return NULL_FILTER_DATA;
+	if (num_components > BMP_MAX_COMPONENTS) return IO_ERR_UNSUPPORTED;
+	if (components[0].width <= 0 || components[0].height < 0) return BORDER_TOO_LARGE;	// No pixels for a border to repeat
+
+	FilterPlan plan;
+	Error err_code = initFilterPlan(&plan, filter, components[0].width, components[0].height);
+	if (err_code != SUCCESS) return err_code;
+
+	// Size the arena for everything up front
+	const int num_workers = getThreadPoolSize(thread_pool);
+	size_t capacity = getWorkerScratchSize(&plan, components[0].width, num_workers);
+	for (int p = 0; p < num_components; ++p) {
+		const ImageComp* const component = components + p;
+		capacity += arenaAlignSize(getImageCompSize(component));
+	}
+
+	Arena arena;
+	err_code = initArena(&arena, capacity);
+
+	FilterScratch* scratch = NULL;
+	if (err_code == SUCCESS) err_code = initWorkerScratch(&scratch, &plan, components[0].width, num_workers, &arena);
+
+	uint8_t* spare[BMP_MAX_COMPONENTS] = { NULL };
+	uint8_t* home[BMP_MAX_COMPONENTS] = { NULL };
+	for (int p = 0; p < num_components && err_code == SUCCESS; ++p) {
+		const ImageComp* const component = components + p;
+		spare[p] = (uint8_t*)arenaAlloc(&arena, getImageCompSize(component));
+		home[p] = component->data;
+	}
+
+	if (err_code == SUCCESS) {
+		err_code = filterComponentsInto(components, num_components, &plan, NULL, scratch, spare);
+		restoreComponents(components, num_components, home);
+	}
+
+	freeArena(&arena);
+	freeFilterPlan(&plan);
+
+	return err_code;
+}
+
+
+Error applyFilterComp(ImageComp* const image_comp, const Filter* const filter) {
+	if (image_comp == NULL) return NULL_IMAGE_COMP;
+
+	return filterComponents(image_comp, 1, filter);
+}
+
+
 Error applyFilter(Image* const image, const Filter* const filter) {
 	if (image == NULL) return NULL_IMAGE;
 	if (image->components == NULL) return NULL_IMAGE_COMP;
+
+	return filterComponents(image->components, image->num_components, filter);
+}
+
+
+Error initPipeline(Pipeline** pipeline) {
+	Pipeline* temp = (Pipeline*)calloc(1, sizeof(Pipeline));
+	if (temp == NULL) return IO_ERR_ALLOC;
+
+	*pipeline = temp;
+	return SUCCESS;
+}
+
+
+void freePipeline(Pipeline* const pipeline) {
+	if (pipeline == NULL) return;
+	for (int i = 0; i < pipeline->num_stages; ++i) {
+		freeFilter(pipeline->stages[i].filter);
+		free(pipeline->stages[i].filter);
+	}
+	free(pipeline->stages);
+	free(pipeline);
+}
+
+
+// Appends an empty stage to `pipeline`
+static Error addStage(Pipeline* const pipeline, PipelineStage** const stage) {
+	PipelineStage* const stages = (PipelineStage*)realloc(pipeline->stages, (pipeline->num_stages + 1) * sizeof(PipelineStage));
+	if (stages == NULL) return IO_ERR_ALLOC;
+
+	pipeline->stages = stages;
+	*stage = stages + pipeline->num_stages++;
+	memset(*stage, 0, sizeof(PipelineStage));
+	return SUCCESS;
+}
+
+
+Error addScaleStage(Pipeline* const pipeline, uint8_t scale_red, uint8_t scale_green, uint8_t scale_blue) {
+	if (pipeline == NULL) return NULL_PIPELINE;
+	if (scale_red > 100 || scale_green > 100 || scale_blue > 100) return INVALID_SCALE;
+
+	PipelineStage* stage;
+	Error err_code = addStage(pipeline, &stage);
+	if (err_code != SUCCESS) return err_code;
+
+	buildScaleLut(stage->luts[colour_blue], scale_blue);
+	buildScaleLut(stage->luts[colour_green], scale_green);
+	buildScaleLut(stage->luts[colour_red], scale_red);
+	return SUCCESS;
+}
+
+
+Error addFilterStage(Pipeline* const pipeline, Filter* const filter) {
+	if (pipeline == NULL) return NULL_PIPELINE;
 	if (filter == NULL) return NULL_FILTER;
+	if (filter->data == NULL && filter->box == 0.0f) return NULL_FILTER_DATA;
 
-	for (int p = 0; p < image->num_components; ++p) {
-		Error err_code = applyFilterComp(image->components + p, filter);
+	PipelineStage* stage;
+	Error err_code = addStage(pipeline, &stage);
+	if (err_code != SUCCESS) return err_code;
+
+	stage->filter = filter;
+	return SUCCESS;
+}
+
+
+int getPipelineRadius(const Pipeline* const pipeline) {
+	int radius = 0;
+	for (int i = 0; i < pipeline->num_stages; ++i) {
+		const Filter* const filter = pipeline->stages[i].filter;
+		if (filter != NULL && filter->radius > radius) radius = filter->radius;
+	}
+	return radius;
+}
+
+
+// Composes the point operations of stages `first` to `last - 1` into one table per colour
+static void composeStageLuts(const Pipeline* const pipeline, const int first, const int last, uint8_t luts[3][256]) {
+	for (int q = 0; q < 3; ++q) {
+		for (int v = 0; v < 256; ++v) {
+			int value = v;
+			for (int i = first; i < last; ++i) value = pipeline->stages[i].luts[q][value];
+			luts[q][v] = (uint8_t)value;
+		}
+	}
+}
+
+
+// Filter plans for each stage of a pipeline on images of `width` x `height` pixels, zeroed for point operations
+static Error initPipelinePlans(FilterPlan** const plans, const Pipeline* const pipeline, const int width, const int height) {
+	*plans = NULL;
+	if (pipeline->num_stages == 0) return SUCCESS;
+	*plans = (FilterPlan*)calloc(pipeline->num_stages, sizeof(FilterPlan));
+	if (*plans == NULL) return IO_ERR_ALLOC;
+
+	for (int i = 0; i < pipeline->num_stages; ++i) {
+		if (pipeline->stages[i].filter == NULL) continue;
+		Error err_code = initFilterPlan(*plans + i, pipeline->stages[i].filter, width, height);
 		if (err_code != SUCCESS) return err_code;
 	}
 
@@ -228,43 +726,534 @@ Error applyFilter(Image* const image, const Filter* const filter) {
 }
 
 
-Error copyImage(const Image* const image, Image** const copy) {
-	if (*copy != NULL) freeImage(*copy);
+static void freePipelinePlans(FilterPlan* const plans, const Pipeline* const pipeline) {
+	if (plans == NULL) return;
+	for (int i = 0; i < pipeline->num_stages; ++i) freeFilterPlan(plans + i);
+	free(plans);
+}
 
-	Error err_code = initImage(copy);
-	if (err_code != SUCCESS) return err_code;
 
-	(*copy)->num_components = image->num_components;
-	(*copy)->components = (ImageComp*)malloc(image->num_components * sizeof(ImageComp));
-	if ((*copy)->components == NULL) {
-		err_code = IO_ERR_ALLOC;
-		freeImage(*copy);
+// Working memory for running a pipeline, kept from one image to the next while their sizes match
+typedef struct {
+	int num_scratch;			// Scratch sets per filter stage: one per thread that may filter bands
+	int width;					// Width `scratch` was allocated for
+	size_t spare_size;			// Bytes in each of `spare`
+	Arena arena;				// Holds everything below
+	FilterScratch** scratch;	// `num_scratch` sets for each stage, NULL for point operations
+	uint8_t* spare[BMP_MAX_COMPONENTS];	// Filter output buffers, swapped with the image's own data
+} PipelineBuffers;
+
+
+static void freePipelineBuffers(PipelineBuffers* const buffers) {
+	const int num_scratch = buffers->num_scratch;
+	freeArena(&buffers->arena);
+	memset(buffers, 0, sizeof(PipelineBuffers));
+	buffers->num_scratch = num_scratch;
+}
+
+
+// Makes `buffers` fit `image`, keeping them as they are if the previous image had the same size and otherwise
+// reusing the arena if it is large enough
+static Error preparePipelineBuffers(PipelineBuffers* const buffers, const Pipeline* const pipeline,
+	const FilterPlan* const plans, const Image* const image) {
+	const ImageComp* const component = image->components;
+	const int width = component->width;
+	const size_t data_size = getImageCompSize(component);
+	if (buffers->scratch != NULL && buffers->width == width && buffers->spare_size == data_size) return SUCCESS;
+	if (pipeline->num_stages == 0) return SUCCESS;
+
+	// Size the arena for everything up front
+	int has_filter = 0;
+	size_t capacity = arenaAlignSize(pipeline->num_stages * sizeof(FilterScratch*));
+	for (int i = 0; i < pipeline->num_stages; ++i) {
+		if (pipeline->stages[i].filter == NULL) continue;
+		has_filter = 1;
+		capacity += getWorkerScratchSize(plans + i, width, buffers->num_scratch);
+	}
+	if (has_filter) capacity += image->num_components * arenaAlignSize(data_size);
+
+	if (buffers->arena.capacity < capacity) {
+		freePipelineBuffers(buffers);
+		Error err_code = initArena(&buffers->arena, capacity);
+		if (err_code != SUCCESS) return err_code;
+	}
+	resetArena(&buffers->arena);
+	memset(buffers->spare, 0, sizeof(buffers->spare));
+	buffers->width = width;
+	buffers->spare_size = data_size;
+
+	buffers->scratch = (FilterScratch**)arenaAlloc(&buffers->arena, pipeline->num_stages * sizeof(FilterScratch*));
+	if (buffers->scratch == NULL) return IO_ERR_ALLOC;
+	for (int i = 0; i < pipeline->num_stages; ++i) {
+		buffers->scratch[i] = NULL;
+		if (pipeline->stages[i].filter == NULL) continue;
+		Error err_code = initWorkerScratch(buffers->scratch + i, plans + i, width, buffers->num_scratch, &buffers->arena);
+		if (err_code != SUCCESS) return err_code;
+	}
+
+	for (int p = 0; p < image->num_components && has_filter; ++p) {
+		buffers->spare[p] = (uint8_t*)arenaAlloc(&buffers->arena, data_size);
+		if (buffers->spare[p] == NULL) return IO_ERR_ALLOC;
+	}
+
+	return SUCCESS;
+}
+
+
+// Runs a pipeline on an image using prepared plans and buffers
+static Error runPipeline(Image* const image, const Pipeline* const pipeline, const FilterPlan* const plans,
+	PipelineBuffers* const buffers) {
+	for (int i = 0; i < pipeline->num_stages; ++i) {
+		if (pipeline->stages[i].filter == NULL && image->num_components != 3) return INVALID_IMAGE_RGB;
+	}
+
+	Error err_code = preparePipelineBuffers(buffers, pipeline, plans, image);
+	if (err_code != SUCCESS) {
+		freePipelineBuffers(buffers);
 		return err_code;
 	}
 
-	for (int p = 0; p < image->num_components; ++p) {
-		ImageComp* const source = image->components + p;
-		ImageComp* const dest = (*copy)->components + p;
+	uint8_t luts[3][256];
+	const uint8_t* const lut_ptrs[3] = { luts[0], luts[1], luts[2] };
 
-		dest->width = source->width;
-		dest->height = source->height;
-		dest->x_border = source->x_border;
-		dest->y_border = source->y_border;
+	// Point operations ahead of the first filter are composed into one pass, after which any border is
+	// extended again, since a zero border must stay zero
+	int first = 0;
+	while (first < pipeline->num_stages && pipeline->stages[first].filter == NULL) ++first;
+	if (first > 0) {
+		composeStageLuts(pipeline, 0, first, luts);
+		for (int p = 0; p < image->num_components; ++p) {
+			ImageComp* const component = image->components + p;
+			const uint8_t* const lut[1] = { luts[p] };
+			STATS_START(timer);
+			for (int r = 0; r < component->height; ++r) {
+				uint8_t* const row = component->image + (size_t)r * component->stride;
+				applyLutLine(row, row, lut, 1, component->width);
+			}
+			STATS_STOP(timer, stats_stage_scale, (uint64_t)component->width * component->height);
+			extendBoundaryComp(component);
+		}
+	}
 
-		dest->data = (uint8_t*)malloc(dest->width * dest->height * sizeof(uint8_t));
-		if (dest->data == NULL) {
-			err_code = IO_ERR_ALLOC;
+	// Point operations following a filter are composed and fused into its output
+	for (int i = first; i < pipeline->num_stages;) {
+		int next = i + 1;
+		while (next < pipeline->num_stages && pipeline->stages[next].filter == NULL) ++next;
+		if (next > i + 1) composeStageLuts(pipeline, i + 1, next, luts);
+
+		err_code = filterComponentsInto(image->components, image->num_components, plans + i,
+			(next > i + 1) ? lut_ptrs : NULL, buffers->scratch[i], buffers->spare);
+		if (err_code != SUCCESS) return err_code;
+		i = next;
+	}
+
+	return SUCCESS;
+}
+
+
+Error applyPipeline(Image* const image, const Pipeline* const pipeline) {
+	if (image == NULL) return NULL_IMAGE;
+	if (image->components == NULL) return NULL_IMAGE_COMP;
+	if (pipeline == NULL) return NULL_PIPELINE;
+	if (image->num_components > BMP_MAX_COMPONENTS) return IO_ERR_UNSUPPORTED;
+	if (image->components[0].width <= 0 || image->components[0].height < 0) return BORDER_TOO_LARGE;	// No pixels for a border to repeat
+
+	FilterPlan* plans = NULL;
+	Error err_code = initPipelinePlans(&plans, pipeline, image->components[0].width, image->components[0].height);
+
+	PipelineBuffers buffers;
+	memset(&buffers, 0, sizeof(PipelineBuffers));
+	buffers.num_scratch = getThreadPoolSize(thread_pool);
+
+	uint8_t* home[BMP_MAX_COMPONENTS];
+	for (int p = 0; p < image->num_components; ++p) home[p] = image->components[p].data;
+	if (err_code == SUCCESS) err_code = runPipeline(image, pipeline, plans, &buffers);
+	restoreComponents(image->components, image->num_components, home);
+
+	freePipelineBuffers(&buffers);
+	freePipelinePlans(plans, pipeline);
+
+	return err_code;
+}
 
-			// Ensure only allocated components are freed in freeImage()
-			(*copy)->num_components = p;
 
-			freeImage(*copy);
+// Reads `in_file` into an image kept from the previous file. Filtering may have swapped the image's memory
+// with the spare buffers, so if the image has to be reallocated for a new size the buffers go too.
+static Error readReusedImage(Image* const image, PipelineBuffers* const buffers, const char* const in_file) {
+	const int num_components = image->num_components;
+	const int width = (image->components != NULL) ? image->components[0].width : 0;
+	const int height = (image->components != NULL) ? image->components[0].height : 0;
+
+	const Error err_code = readBmp(image, in_file, 0, 0);
+	if (image->num_components != num_components || image->components == NULL ||
+		image->components[0].width != width || image->components[0].height != height) freePipelineBuffers(buffers);
+
+	return err_code;
+}
+
+
+// State of one thread of processBatch(), whose image and buffers are reused for each file it processes
+typedef struct {
+	Image image;
+	PipelineBuffers buffers;
+} BatchWorker;
+
+// Files of a batch, each processed entirely by one thread of the shared pool
+typedef struct {
+	const Pipeline* pipeline;
+	const FilterPlan* plans;
+	const char* const* in_files;
+	const char* const* out_files;
+	Error* results;
+	BatchWorker* workers;
+} BatchJob;
+
+
+static void batchFileTask(void* context, int task, int worker) {
+	BatchJob* const job = (BatchJob*)context;
+	BatchWorker* const state = job->workers + worker;
+
+	// Filtering runs on this thread alone while the pool is busy with the batch. Images are read without a
+	// border, which the filters make up as they go.
+	Error err_code = readReusedImage(&state->image, &state->buffers, job->in_files[task]);
+	if (err_code == SUCCESS) err_code = runPipeline(&state->image, job->pipeline, job->plans, &state->buffers);
+	if (err_code == SUCCESS) err_code = writeBmp(&state->image, job->out_files[task]);
+	job->results[task] = err_code;
+}
+
+
+Error processBatch(const Pipeline* const pipeline, const char* const* in_files, const char* const* out_files,
+	const int num_files, Error* const results) {
+	if (pipeline == NULL) return NULL_PIPELINE;
+
+	// Plans are made for the size of the first image
+	int width = 0;
+	int height = 0;
+	BmpIn bmp_in;
+	if (num_files > 0 && bmpInOpen(&bmp_in, in_files[0]) == SUCCESS) {
+		width = bmp_in.cols;
+		height = bmp_in.rows;
+		bmpInClose(&bmp_in);
+	}
+
+	const int num_workers = getThreadPoolSize(thread_pool);
+	FilterPlan* plans = NULL;
+	Error err_code = initPipelinePlans(&plans, pipeline, width, height);
+
+	BatchWorker* const workers = (BatchWorker*)calloc(num_workers, sizeof(BatchWorker));
+	if (workers == NULL) err_code = IO_ERR_ALLOC;
+	for (int w = 0; w < num_workers && err_code == SUCCESS; ++w) workers[w].buffers.num_scratch = 1;
+
+	if (err_code == SUCCESS) {
+		BatchJob job;
+		job.pipeline = pipeline;
+		job.plans = plans;
+		job.in_files = in_files;
+		job.out_files = out_files;
+		job.results = results;
+		job.workers = workers;
+		runThreadPool(thread_pool, num_files, batchFileTask, &job);
+
+		for (int i = 0; i < num_files && err_code == SUCCESS; ++i) err_code = results[i];
+	}
+
+	if (workers != NULL) {
+		for (int w = 0; w < num_workers; ++w) {
+			freeImage(&workers[w].image);
+			freePipelineBuffers(&workers[w].buffers);
+		}
+	}
+	free(workers);
+	freePipelinePlans(plans, pipeline);
+
+	return err_code;
+}
+
+
+struct PipelineRunner {
+	const Pipeline* pipeline;
+	FilterPlan* plans;			// Made for images of `width` x `height` pixels, or NULL
+	int width;
+	int height;
+	Image image;
+	PipelineBuffers buffers;
+};
+
+
+Error initPipelineRunner(PipelineRunner** runner, const Pipeline* const pipeline) {
+	*runner = NULL;
+	if (pipeline == NULL) return NULL_PIPELINE;
+
+	PipelineRunner* const temp = (PipelineRunner*)calloc(1, sizeof(PipelineRunner));
+	if (temp == NULL) return IO_ERR_ALLOC;
+	temp->pipeline = pipeline;
+
+	*runner = temp;
+	return SUCCESS;
+}
+
+
+void freePipelineRunner(PipelineRunner* const runner) {
+	if (runner == NULL) return;
+
+	freeImage(&runner->image);
+	freePipelineBuffers(&runner->buffers);
+	freePipelinePlans(runner->plans, runner->pipeline);
+	free(runner);
+}
+
+
+Error runPipelineFile(PipelineRunner* const runner, const char* const in_file, const char* const out_file) {
+	if (runner == NULL) return NULL_PIPELINE;
+
+	// Scratch is needed for every thread, whose number may have changed since the buffers were made. The
+	// image may hold the buffers' memory, so it goes with them.
+	const int num_scratch = getThreadPoolSize(thread_pool);
+	if (runner->buffers.num_scratch != num_scratch) {
+		freeImage(&runner->image);
+		freePipelineBuffers(&runner->buffers);
+		runner->buffers.num_scratch = num_scratch;
+	}
+
+	Error err_code = readReusedImage(&runner->image, &runner->buffers, in_file);
+	if (err_code != SUCCESS) return err_code;
+
+	const ImageComp* const component = runner->image.components;
+	if (runner->plans == NULL || runner->width != component->width || runner->height != component->height) {
+		freePipelinePlans(runner->plans, runner->pipeline);
+		runner->plans = NULL;
+		err_code = initPipelinePlans(&runner->plans, runner->pipeline, component->width, component->height);
+		if (err_code != SUCCESS) {
+			freePipelinePlans(runner->plans, runner->pipeline);
+			runner->plans = NULL;
 			return err_code;
 		}
+		runner->width = component->width;
+		runner->height = component->height;
+	}
+
+	err_code = runPipeline(&runner->image, runner->pipeline, runner->plans, &runner->buffers);
+	if (err_code == SUCCESS) err_code = writeBmp(&runner->image, out_file);
+
+	return err_code;
+}
+
+
+// Row window used by filterBmp(). Each component holds rows `first_row` onwards of the image extended by
+// `radius` rows and columns on every side, made up by the border mode as in extendBoundary().
+typedef struct {
+	int num_components;
+	int width;
+	int height;
+	int radius;
+	BorderMode mode;
+	int lead;			// Bytes before the first pixel of each row, the border columns ending on an aligned boundary
+	int stride;			// Bytes between rows, including the border columns and padding
+	int capacity;		// Rows held per component
+	int first_row;		// Extended image row held in the first window row
+	int next_row;		// Next extended image row to load
+	uint8_t* data;		// `capacity` rows for each component, one component after another
+} RowWindow;
+
+
+static inline uint8_t* windowRow(const RowWindow* const window, const int p, const int row) {
+	return window->data + ((size_t)p * window->capacity + (row - window->first_row)) * window->stride + window->lead;
+}
 
-		memcpy(dest->data, source->data, source->width * source->height * sizeof(uint8_t));
 
-		dest->image = dest->data + dest->y_border * dest->width + dest->x_border;
+// Sets a border row of the window to extended image row `src`, which is zero if it lies outside the image
+static void copyWindowRow(RowWindow* const window, const int p, const int row, const int src) {
+	uint8_t* const dst = windowRow(window, p, row) - window->lead;
+	if (src < 0) memset(dst, 0, window->stride);
+	else memcpy(dst, windowRow(window, p, src) - window->lead, window->stride);
+}
+
+
+// Loads the next row of the extended image into the window, reading it from `bmp_in` if it lies in the image.
+// Border rows must come from rows still in the window, which rules out wrapping.
+static Error loadWindowRow(RowWindow* const window, BmpIn* const bmp_in) {
+	const int row = window->next_row++;
+	const int width = window->width;
+	const int height = window->height;
+	const int radius = window->radius;
+	const BorderMode mode = window->mode;
+	const int num_components = window->num_components;
+
+	if (row >= height) {
+		STATS_START(timer);
+		for (int p = 0; p < num_components; ++p) copyWindowRow(window, p, row, getBorderIndex(row, height, mode));
+		STATS_STOP(timer, stats_stage_extend, (uint64_t)num_components * (width + 2 * radius));
+		return SUCCESS;
+	}
+
+	const uint8_t* line;
+	Error err_code = bmpInGetLineRef(bmp_in, &line);
+	if (err_code != SUCCESS) return err_code;
+
+	uint8_t* planes[BMP_MAX_COMPONENTS];
+	for (int p = 0; p < num_components; ++p) planes[p] = windowRow(window, p, row);
+	deinterleaveLine(planes, line, num_components, width);
+
+	STATS_START(timer);
+	for (int p = 0; p < num_components; ++p) {
+		uint8_t* const dst = planes[p];
+		for (int c = 1; c <= radius; ++c) {
+			dst[-c] = getBorderSample(dst, -c, width, mode);
+			dst[width - 1 + c] = getBorderSample(dst, width - 1 + c, width, mode);
+		}
+
+		// Rows above the image repeat the first rows, which are the first to be read
+		for (int r = 1; r <= radius && row < radius; ++r) {
+			const int src = getBorderIndex(-r, height, mode);
+			if (src == row || (src < 0 && row == 0)) copyWindowRow(window, p, -r, src);
+		}
+	}
+	STATS_STOP(timer, stats_stage_extend, (uint64_t)num_components * 2 * radius);
+
+	return SUCCESS;
+}
+
+
+// Drops rows before `row` from the window
+static void slideWindow(RowWindow* const window, const int row) {
+	const int num_rows = window->next_row - row;
+	for (int p = 0; p < window->num_components; ++p) {
+		memmove(windowRow(window, p, window->first_row) - window->lead, windowRow(window, p, row) - window->lead,
+			(size_t)num_rows * window->stride);
+	}
+	window->first_row = row;
+}
+
+
+Error filterBmp(const char* const in_file, const char* const out_file, const Filter* const filter) {
+	if (filter == NULL) return NULL_FILTER;
+	if (filter->data == NULL && filter->box == 0.0f) return NULL_FILTER_DATA;
+
+	BmpIn bmp_in;
+	Error err_code = bmpInOpen(&bmp_in, in_file);
+	if (err_code != SUCCESS) return err_code;
+
+	const int radius = filter->radius;
+	const int num_components = bmp_in.num_components;
+	const int num_workers = getThreadPoolSize(thread_pool);
+
+	RowWindow window;
+	window.num_components = num_components;
+	window.width = bmp_in.cols;
+	window.height = bmp_in.rows;
+	window.radius = radius;
+	window.mode = getBorderMode();
+	window.lead = (int)arenaAlignSize(radius);
+	window.stride = (int)arenaAlignSize(window.lead + window.width + radius);
+	window.first_row = -radius;
+	window.next_row = 0;
+	window.data = NULL;
+	if (window.mode == border_wrap && radius > 0) {
+		bmpInClose(&bmp_in);
+		return UNSUPPORTED_BORDER_MODE;
+	}
+
+	BmpOut bmp_out;
+	err_code = bmpOutOpen(&bmp_out, out_file, window.width, window.height, num_components);
+	if (err_code != SUCCESS) {
+		bmpInClose(&bmp_in);
+		return err_code;
+	}
+
+	FilterPlan plan;
+	err_code = initFilterPlan(&plan, filter, window.width, window.height);
+	if (err_code != SUCCESS) {
+		bmpInClose(&bmp_in);
+		bmpOutClose(&bmp_out);
+		return err_code;
+	}
+
+	// Blocks give each worker a band, in whole FFT tiles if the plan uses them
+	const int band_multiple = getFilterBandRows(&plan);
+	const int block_rows = (MIN_BAND_ROWS + band_multiple - 1) / band_multiple * band_multiple * num_workers;
+	window.capacity = block_rows + 2 * radius;
+
+	// One arena holds the window, the filtered block and the scratch memory
+	const size_t window_size = (size_t)num_components * window.capacity * window.stride * sizeof(uint8_t);
+	const size_t out_size = (size_t)num_components * block_rows * window.stride * sizeof(uint8_t);
+	Arena arena;
+	err_code = initArena(&arena, arenaAlignSize(window_size) + arenaAlignSize(out_size) +
+		arenaAlignSize(num_components * sizeof(ImageComp)) + arenaAlignSize(num_components * sizeof(uint8_t*)) +
+		getWorkerScratchSize(&plan, window.width, num_workers));
+
+	FilterScratch* scratch = NULL;
+	if (err_code == SUCCESS) err_code = initWorkerScratch(&scratch, &plan, window.width, num_workers, &arena);
+
+	ImageComp* const blocks = (ImageComp*)arenaAlloc(&arena, num_components * sizeof(ImageComp));
+	uint8_t** const outputs = (uint8_t**)arenaAlloc(&arena, num_components * sizeof(uint8_t*));
+	uint8_t* const out_data = (uint8_t*)arenaAlloc(&arena, out_size);
+	window.data = (uint8_t*)arenaAlloc(&arena, window_size);
+	if (blocks == NULL || outputs == NULL || out_data == NULL || window.data == NULL) err_code = IO_ERR_ALLOC;
+
+	for (int first = 0; first < window.height && err_code == SUCCESS; first += block_rows) {
+		int num_rows = window.height - first;
+		if (num_rows > block_rows) num_rows = block_rows;
+
+		// Load every row the block depends on
+		while (window.next_row < first + num_rows + radius && err_code == SUCCESS) {
+			err_code = loadWindowRow(&window, &bmp_in);
+		}
+		if (err_code != SUCCESS) break;
+
+		// Filter the block as one set of bordered components
+		for (int p = 0; p < num_components; ++p) {
+			blocks[p].width = window.width;
+			blocks[p].height = num_rows;
+			blocks[p].x_border = radius;
+			blocks[p].y_border = radius;
+			blocks[p].stride = window.stride;
+			blocks[p].image = windowRow(&window, p, first);
+			blocks[p].data = blocks[p].image - radius * window.stride - window.lead;
+			outputs[p] = out_data + (size_t)p * block_rows * window.stride + window.lead;
+		}
+		runFilterJob(&plan, blocks, outputs, NULL, num_components, scratch);
+
+		// Write the block
+		for (int r = 0; r < num_rows && err_code == SUCCESS; ++r) {
+			const uint8_t* planes[BMP_MAX_COMPONENTS];
+			for (int p = 0; p < num_components; ++p) planes[p] = outputs[p] + r * window.stride;
+			uint8_t* line;
+			err_code = bmpOutGetLineRef(&bmp_out, &line);
+			if (err_code != SUCCESS) break;
+			interleaveLine(line, planes, num_components, window.width);
+			err_code = bmpOutWriteLine(&bmp_out, line);
+		}
+
+		slideWindow(&window, first + num_rows - radius);
+	}
+
+	bmpInClose(&bmp_in);
+	const Error close_err = bmpOutClose(&bmp_out);
+	if (err_code == SUCCESS) err_code = close_err;
+	freeArena(&arena);
+	freeFilterPlan(&plan);
+
+	return err_code;
+}
+
+
+Error copyImage(const Image* const image, Image** const copy) {
+	if (*copy != NULL) freeImage(*copy);
+
+	Error err_code = initImage(copy);
+	if (err_code != SUCCESS) return err_code;
+	if (image->num_components == 0) return SUCCESS;
+
+	const ImageComp* const first = image->components;
+	err_code = allocImage(*copy, image->num_components, first->width, first->height, first->x_border, first->y_border);
+	if (err_code != SUCCESS) {
+		freeImage(*copy);
+		return err_code;
+	}
+
+	// Copy the borders along with the pixels
+	for (int p = 0; p < image->num_components; ++p) {
+		memcpy((*copy)->components[p].data, image->components[p].data, getImageCompSize(first));
 	}
 
 	return SUCCESS;
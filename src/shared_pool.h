@@ -0,0 +1,10 @@
+#ifndef SHARED_POOL_H
+#define SHARED_POOL_H
+
+#include "thread_pool.h"
+
+// Returns the worker threads started by `setNumThreads()`, shared by every processing function, or NULL
+// when work runs on the calling thread only
+ThreadPool* getSharedThreadPool(void);
+
+#endif // SHARED_POOL_H
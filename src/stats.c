@@ -0,0 +1,135 @@
+#include "string.h"
+#include "time.h"
+#include "stats.h"
+#include "stats_hooks.h"
+#include "perf_events.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include "sys/resource.h"
+#endif
+
+#ifdef BMP_PROCESSOR_STATS
+// Totals updated with relaxed atomic adds from any thread
+static uint64_t stage_ns[STATS_NUM_STAGES];
+static uint64_t stage_calls[STATS_NUM_STAGES];
+static uint64_t stage_pixels[STATS_NUM_STAGES];
+static uint64_t counters[STATS_NUM_COUNTERS];
+static uint64_t stage_events[STATS_NUM_STAGES][STATS_NUM_EVENTS];
+
+
+// Monotonic clock reading in nanoseconds
+static uint64_t getStatsTime(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+
+StatsTimer startStatsTimer(void) {
+	StatsTimer timer;
+	timer.event_mask = readPerfEvents(timer.events);
+	timer.ns = getStatsTime();
+	return timer;
+}
+
+
+void stopStatsTimer(const StatsTimer* const timer, StatsStage stage, uint64_t pixels) {
+	const uint64_t ns = getStatsTime() - timer->ns;
+	if (timer->event_mask != 0) {
+		uint64_t events[STATS_NUM_EVENTS];
+		const uint32_t mask = readPerfEvents(events) & timer->event_mask;
+		for (int e = 0; e < STATS_NUM_EVENTS; ++e) {
+			if (mask & (1u << e)) __atomic_fetch_add(stage_events[stage] + e, events[e] - timer->events[e], __ATOMIC_RELAXED);
+		}
+	}
+
+	__atomic_fetch_add(stage_ns + stage, ns, __ATOMIC_RELAXED);
+	__atomic_fetch_add(stage_calls + stage, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(stage_pixels + stage, pixels, __ATOMIC_RELAXED);
+}
+
+
+void addStatsCount(StatsCounter counter, uint64_t amount) {
+	__atomic_fetch_add(counters + counter, amount, __ATOMIC_RELAXED);
+}
+
+
+// Highest resident set size so far, which the system keeps in kilobytes on Linux and bytes on macOS
+static uint64_t getPeakResidentBytes(void) {
+#if defined(__unix__) || defined(__APPLE__)
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+	return (uint64_t)usage.ru_maxrss;
+#else
+	return (uint64_t)usage.ru_maxrss * 1024;
+#endif
+#else
+	return 0;
+#endif
+}
+#endif // BMP_PROCESSOR_STATS
+
+
+void getStats(Stats* const stats) {
+	memset(stats, 0, sizeof(Stats));
+#ifdef BMP_PROCESSOR_STATS
+	stats->enabled = 1;
+	for (int s = 0; s < STATS_NUM_STAGES; ++s) {
+		stats->seconds[s] = (double)__atomic_load_n(stage_ns + s, __ATOMIC_RELAXED) * 1e-9;
+		stats->calls[s] = __atomic_load_n(stage_calls + s, __ATOMIC_RELAXED);
+		stats->pixels[s] = __atomic_load_n(stage_pixels + s, __ATOMIC_RELAXED);
+	}
+	stats->bytes_read = __atomic_load_n(counters + stats_bytes_read, __ATOMIC_RELAXED);
+	stats->bytes_written = __atomic_load_n(counters + stats_bytes_written, __ATOMIC_RELAXED);
+	stats->allocations = __atomic_load_n(counters + stats_allocations, __ATOMIC_RELAXED);
+	stats->allocated_bytes = __atomic_load_n(counters + stats_allocated_bytes, __ATOMIC_RELAXED);
+	stats->peak_resident_bytes = getPeakResidentBytes();
+	stats->event_mask = getPerfEventMask();
+	for (int s = 0; s < STATS_NUM_STAGES; ++s) {
+		for (int e = 0; e < STATS_NUM_EVENTS; ++e) stats->events[s][e] = __atomic_load_n(stage_events[s] + e, __ATOMIC_RELAXED);
+	}
+#endif
+}
+
+
+void resetStats(void) {
+#ifdef BMP_PROCESSOR_STATS
+	for (int s = 0; s < STATS_NUM_STAGES; ++s) {
+		__atomic_store_n(stage_ns + s, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(stage_calls + s, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(stage_pixels + s, 0, __ATOMIC_RELAXED);
+		for (int e = 0; e < STATS_NUM_EVENTS; ++e) __atomic_store_n(stage_events[s] + e, 0, __ATOMIC_RELAXED);
+	}
+	for (int c = 0; c < STATS_NUM_COUNTERS; ++c) __atomic_store_n(counters + c, 0, __ATOMIC_RELAXED);
+#endif
+}
+
+
+const char* getStatsStageName(StatsStage stage) {
+	static const char* const names[STATS_NUM_STAGES] = {
+		"read", "deinterleave", "extend", "filter", "scale", "interleave", "write"
+	};
+	if ((int)stage < 0 || stage >= STATS_NUM_STAGES) return "unknown";
+	return names[stage];
+}
+
+
+uint32_t setStatsEvents(int enabled) {
+#ifdef BMP_PROCESSOR_STATS
+	if (enabled) return enablePerfEvents();
+#else
+	(void)enabled;
+#endif
+	disablePerfEvents();
+	return 0;
+}
+
+
+const char* getStatsEventName(StatsEvent event) {
+	static const char* const names[STATS_NUM_EVENTS] = {
+		"cycles", "instructions", "cache_misses", "l1d_misses", "branch_misses", "page_faults"
+	};
+	if ((int)event < 0 || event >= STATS_NUM_EVENTS) return "unknown";
+	return names[event];
+}
@@ -0,0 +1,55 @@
+#ifndef STATS_HOOKS_H
+#define STATS_HOOKS_H
+
+#include "stdint.h"
+#include "stats.h"
+
+/*  Probes placed on the library's hot paths to collect the totals read by
+	`getStats()'. Timers read the monotonic clock once at each end of a
+	stage and counters are relaxed atomic adds, so a probe costs a few tens
+	of nanoseconds; they sit on lines and bands rather than pixels to keep
+	that out of inner loops. Timers also read the thread's event counters
+	while `setStatsEvents()' has them on. Without BMP_PROCESSOR_STATS every
+	probe compiles to nothing. */
+
+// Totals other than stage times, calls and pixels
+typedef enum {
+	stats_bytes_read = 0,
+	stats_bytes_written,
+	stats_allocations,
+	stats_allocated_bytes,
+} StatsCounter;
+
+#define STATS_NUM_COUNTERS 4
+
+#ifdef BMP_PROCESSOR_STATS
+
+// Clock and event counts at the start of a stage
+typedef struct {
+	uint64_t ns;
+	uint32_t event_mask;	// Events read into `events', 0 if counting is off
+	uint64_t events[STATS_NUM_EVENTS];
+} StatsTimer;
+
+// Starts timing a stage on the calling thread
+StatsTimer startStatsTimer(void);
+
+// Adds a call to `stage' covering everything since `timer' was started and handling `pixels' pixels
+void stopStatsTimer(const StatsTimer* const timer, StatsStage stage, uint64_t pixels);
+
+// Adds `amount' to `counter'
+void addStatsCount(StatsCounter counter, uint64_t amount);
+
+#define STATS_START(timer) const StatsTimer timer = startStatsTimer()
+#define STATS_STOP(timer, stage, pixels) stopStatsTimer(&timer, stage, (uint64_t)(pixels))
+#define STATS_COUNT(counter, amount) addStatsCount(counter, (uint64_t)(amount))
+
+#else
+
+#define STATS_START(timer) ((void)0)
+#define STATS_STOP(timer, stage, pixels) ((void)0)
+#define STATS_COUNT(counter, amount) ((void)0)
+
+#endif // BMP_PROCESSOR_STATS
+
+#endif // STATS_HOOKS_H
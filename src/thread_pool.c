@@ -0,0 +1,171 @@
+#include "stdlib.h"
+#include "stdatomic.h"
+#include "pthread.h"
+#include "unistd.h"
+#include "thread_pool.h"
+
+// Share of the tasks owned by one thread, padded to avoid false sharing between threads
+typedef struct {
+	_Alignas(64) atomic_int next;
+	int end;
+} TaskRange;
+
+typedef struct {
+	ThreadPool* pool;
+	int index;
+} Worker;
+
+struct ThreadPool {
+	int num_threads;
+	pthread_t* threads;
+	Worker* workers;
+	TaskRange* ranges;
+
+	pthread_mutex_t run_lock;	// Held by the caller of runThreadPool()
+	pthread_mutex_t lock;		// Protects the fields below
+	pthread_cond_t start;
+	pthread_cond_t done;
+	unsigned long generation;
+	int num_busy;
+	int shutdown;
+	TaskFunc func;
+	void* context;
+};
+
+
+static void runTasks(ThreadPool* const pool, const int self) {
+	for (int k = 0; k < pool->num_threads; ++k) {
+		TaskRange* const range = pool->ranges + (self + k) % pool->num_threads;
+		for (;;) {
+			const int task = atomic_fetch_add_explicit(&range->next, 1, memory_order_relaxed);
+			if (task >= range->end) break;
+			pool->func(pool->context, task, self);
+		}
+	}
+}
+
+
+static void* workerMain(void* arg) {
+	Worker* const worker = (Worker*)arg;
+	ThreadPool* const pool = worker->pool;
+	unsigned long seen = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (pool->generation == seen && !pool->shutdown) pthread_cond_wait(&pool->start, &pool->lock);
+		if (pool->shutdown) break;
+		seen = pool->generation;
+		pthread_mutex_unlock(&pool->lock);
+
+		runTasks(pool, worker->index);
+
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->num_busy == 0) pthread_cond_signal(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+
+Error initThreadPool(ThreadPool** pool, int num_threads) {
+	if (num_threads < 0) return INVALID_THREAD_COUNT;
+	if (num_threads == 0) {
+		const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		num_threads = (cpus > 0) ? (int)cpus : 1;
+	}
+
+	ThreadPool* temp = (ThreadPool*)calloc(1, sizeof(ThreadPool));
+	if (temp == NULL) return IO_ERR_ALLOC;
+
+	temp->num_threads = num_threads;
+	temp->threads = (pthread_t*)malloc(num_threads * sizeof(pthread_t));
+	temp->workers = (Worker*)malloc(num_threads * sizeof(Worker));
+	temp->ranges = (TaskRange*)aligned_alloc(_Alignof(TaskRange), num_threads * sizeof(TaskRange));
+	if (temp->threads == NULL || temp->workers == NULL || temp->ranges == NULL) {
+		free(temp->threads);
+		free(temp->workers);
+		free(temp->ranges);
+		free(temp);
+		return IO_ERR_ALLOC;
+	}
+	for (int i = 0; i < num_threads; ++i) {
+		atomic_init(&temp->ranges[i].next, 0);
+		temp->ranges[i].end = 0;
+	}
+
+	pthread_mutex_init(&temp->run_lock, NULL);
+	pthread_mutex_init(&temp->lock, NULL);
+	pthread_cond_init(&temp->start, NULL);
+	pthread_cond_init(&temp->done, NULL);
+
+	// Thread 0 is whichever thread calls runThreadPool()
+	temp->num_threads = 1;
+	for (int i = 1; i < num_threads; ++i) {
+		temp->workers[i].pool = temp;
+		temp->workers[i].index = i;
+		if (pthread_create(temp->threads + i, NULL, workerMain, temp->workers + i) != 0) {
+			freeThreadPool(temp);
+			return THREAD_ERR_CREATE;
+		}
+		temp->num_threads = i + 1;
+	}
+
+	*pool = temp;
+	return SUCCESS;
+}
+
+
+void freeThreadPool(ThreadPool* const pool) {
+	if (pool == NULL) return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->shutdown = 1;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+	for (int i = 1; i < pool->num_threads; ++i) pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->start);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_mutex_destroy(&pool->run_lock);
+	free(pool->threads);
+	free(pool->workers);
+	free(pool->ranges);
+	free(pool);
+}
+
+
+int getThreadPoolSize(const ThreadPool* const pool) {
+	return (pool == NULL) ? 1 : pool->num_threads;
+}
+
+
+void runThreadPool(ThreadPool* const pool, int num_tasks, TaskFunc func, void* context) {
+	if (pool == NULL || pool->num_threads == 1 || num_tasks <= 1 || pthread_mutex_trylock(&pool->run_lock) != 0) {
+		for (int task = 0; task < num_tasks; ++task) func(context, task, 0);
+		return;
+	}
+
+	const int num_threads = pool->num_threads;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->func = func;
+	pool->context = context;
+	for (int i = 0; i < num_threads; ++i) {
+		atomic_store_explicit(&pool->ranges[i].next, (int)((long long)num_tasks * i / num_threads), memory_order_relaxed);
+		pool->ranges[i].end = (int)((long long)num_tasks * (i + 1) / num_threads);
+	}
+	pool->num_busy = num_threads - 1;
+	++pool->generation;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+
+	runTasks(pool, 0);
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->num_busy > 0) pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+
+	pthread_mutex_unlock(&pool->run_lock);
+}